@@ -0,0 +1,73 @@
+; Application processor entry. smp.h copies this blob to AP_TRAMPOLINE_ADDR
+; and points the startup IPI at it, so the AP starts here in real mode at
+; address AP_BASE with CS = AP_BASE >> 4. Everything is addressed relative
+; to that copy, not to where the kernel was linked.
+
+global ap_trampoline_start
+global ap_trampoline_end
+global ap_boot_cr3
+global ap_boot_cr4
+global ap_boot_stack
+global ap_boot_entry
+global ap_boot_cpu
+
+%define AP_BASE 0x8000
+%define REL(x) (AP_BASE + (x) - ap_trampoline_start)
+
+section .text
+[bits 16]
+ap_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [REL(tramp_gdt_desc)]
+    mov eax, cr0
+    or eax, 1                   ; PE
+    mov cr0, eax
+    jmp dword 0x08:REL(ap_protected)
+
+[bits 32]
+ap_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    ; Same paging setup as the boot CPU: PSE/PGE first, the kernel lives in 4 MB pages
+    mov eax, [REL(ap_boot_cr4)]
+    mov cr4, eax
+    mov eax, [REL(ap_boot_cr3)]
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80010000          ; PG | WP
+    mov cr0, eax
+
+    mov esp, [REL(ap_boot_stack)]
+    push dword [REL(ap_boot_cpu)]
+    mov eax, [REL(ap_boot_entry)]
+    call eax                    ; ap_main(cpu), doesn't return
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+align 8
+tramp_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF       ; flat code
+    dq 0x00CF92000000FFFF       ; flat data
+tramp_gdt_desc:
+    dw tramp_gdt_desc - tramp_gdt - 1
+    dd REL(tramp_gdt)
+
+; Filled in by the boot CPU before each startup IPI
+align 4
+ap_boot_cr3:   dd 0
+ap_boot_cr4:   dd 0
+ap_boot_stack: dd 0
+ap_boot_entry: dd 0
+ap_boot_cpu:   dd 0
+ap_trampoline_end:
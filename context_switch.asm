@@ -0,0 +1,23 @@
+[bits 32]
+global context_switch
+
+; void context_switch(uint32_t* old_esp, uint32_t new_esp)
+; Saves the callee-saved registers on the current kernel stack, parks its
+; esp in *old_esp and resumes the stack at new_esp. Everything else was
+; saved by the caller or the interrupt frame further up.
+context_switch:
+    mov eax, [esp + 4]
+    mov edx, [esp + 8]
+
+    push ebp
+    push ebx
+    push esi
+    push edi
+    mov [eax], esp
+
+    mov esp, edx
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
@@ -4,54 +4,136 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "helpers/disk.h"
+#include "helpers/heap.h"
+#include "helpers/timer.h"
 
 
 #define BLOCK_SIZE 512
-#define FILE_TABLE_BLOCKS ((MAX_FILE_ENTRIES * sizeof(FileEntry) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define MAX_BLOCKS 4096
 #define MAX_FILE_ENTRIES 1024
+// Entries never straddle a sector, so one entry can be persisted with one write
+#define FILE_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(FileEntry))
+#define FILE_TABLE_BLOCKS ((MAX_FILE_ENTRIES + FILE_ENTRIES_PER_BLOCK - 1) / FILE_ENTRIES_PER_BLOCK)
+#define FILE_HASH_BUCKETS 256
+#define NO_ENTRY (-1)
+#define FS_SUMMARY_MAGIC 0x53554D31 // 'SUM1'
+#define FS_STATE_CLEAN 1
+#define FS_STATE_DIRTY 2
+#define FS_SYNC_INTERVAL_NS (5ull * NSEC_PER_SEC)   // longest the summary stays stale while files are in use
 
-FileEntry file_table[MAX_FILE_ENTRIES];  // loaded from disk at startup
+// One on-disk file table sector, kept in memory exactly as it is stored
+typedef struct {
+    FileEntry entries[FILE_ENTRIES_PER_BLOCK];
+    uint8_t pad[BLOCK_SIZE - FILE_ENTRIES_PER_BLOCK * sizeof(FileEntry)];
+} FileTableBlock;
+
+FileTableBlock* file_table = NULL;  // sized from the superblock at mount
+uint32_t file_table_sectors = 0;
+// Serializes filesystem syscalls: a task can sleep on the disk mid-update
+KMutex fs_lock = { -1, 0, { NULL, NULL, SPINLOCK_INIT } };
 Superblock superblock;
 
+// Data block allocation state, block numbers are relative to data_start
+uint32_t block_bitmap[MAX_BLOCKS / 32];
+uint32_t free_block_count = 0;
+uint32_t next_free_block = 0;   // high-water mark: everything above is free
+int block_bitmap_valid = 0;     // bits below the high-water mark are only filled in on demand
+uint64_t fs_dirty_since = 0;    // when the on-disk summary was last flagged stale
+
+// Filename hash index so lookups don't scan the whole table
+int16_t name_hash_head[FILE_HASH_BUCKETS];
+int16_t name_hash_next[MAX_FILE_ENTRIES];
+int name_index_valid = 0;
+
+// While batching, save_file_entry only marks its sector and fs_batch_end
+// writes them all at once
+uint32_t file_table_dirty[(FILE_TABLE_BLOCKS + 31) / 32];
+int fs_batching = 0;
+
+static inline FileEntry* file_entry(int index) {
+    return &file_table[index / FILE_ENTRIES_PER_BLOCK].entries[index % FILE_ENTRIES_PER_BLOCK];
+}
+
+static inline int file_entry_index(const FileEntry* fe) {
+    uint32_t offset = (const uint8_t*)fe - (const uint8_t*)file_table;
+    return (offset / BLOCK_SIZE) * FILE_ENTRIES_PER_BLOCK + (offset % BLOCK_SIZE) / sizeof(FileEntry);
+}
+
+static inline uint32_t blocks_for_size(uint32_t size) {
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+static inline uint32_t data_block_capacity(void) {
+    uint32_t cap = superblock.total_blocks - superblock.data_start;
+    return (cap < MAX_BLOCKS) ? cap : MAX_BLOCKS;
+}
+
 void save_file_table(void) {
     log("Saving file table to disk...\n");
-    
-    uint8_t sector[BLOCK_SIZE];
-    size_t entries_per_sector = BLOCK_SIZE / sizeof(FileEntry);
-    
-    for (int sector_num = 0; sector_num < FILE_TABLE_BLOCKS; sector_num++) {
-        memset(sector, 0, BLOCK_SIZE);
-        
-        // Copy file entries to this sector
-        size_t start_entry = sector_num * entries_per_sector;
-        size_t entries_to_copy = entries_per_sector;
-        
-        if (start_entry < MAX_FILE_ENTRIES) {
-            if (start_entry + entries_to_copy > MAX_FILE_ENTRIES) {
-                entries_to_copy = MAX_FILE_ENTRIES - start_entry;
-            }
-            
-            memcpy(sector, &file_table[start_entry], entries_to_copy * sizeof(FileEntry));
-        }
-        
-        uint32_t lba = superblock.file_table_start + sector_num;
-        if (ata_write_sector(lba, sector) != 0) {
-            log("Error writing file table sector ");
-            char buf[12];
-            int_to_chars(sector_num, buf, sizeof(buf));
-            log_buffer(buf);
-            log("\n");
-            return;
-        }
+
+    uint32_t sectors = (superblock.file_table_length + FILE_ENTRIES_PER_BLOCK - 1) / FILE_ENTRIES_PER_BLOCK;
+    if (ata_write_sectors(superblock.file_table_start, sectors, file_table) != 0) {
+        log("Error writing file table\n");
+        return;
     }
-    
+
     log("File table saved successfully.\n");
 }
 
+// Persist a single entry by rewriting only the sector that holds it
+int save_file_entry(const FileEntry* fe) {
+    uint32_t sector_num = file_entry_index(fe) / FILE_ENTRIES_PER_BLOCK;
+    if (fs_batching) {
+        file_table_dirty[sector_num / 32] |= 1u << (sector_num % 32);
+        return 0;
+    }
+    if (ata_write_sector(superblock.file_table_start + sector_num, &file_table[sector_num]) != 0) {
+        log("Error writing file table sector ");
+        char buf[12];
+        int_to_chars(sector_num, buf, sizeof(buf));
+        log_buffer(buf);
+        log("\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Defer file table writes until fs_batch_end, with fs_lock held throughout
+void fs_batch_begin(void) {
+    fs_batching = 1;
+}
+
+static inline int table_sector_dirty(uint32_t sector) {
+    return file_table_dirty[sector / 32] & (1u << (sector % 32));
+}
+
+// Write the sectors touched since fs_batch_begin, each run of adjacent ones
+// in a single transfer
+int fs_batch_end(void) {
+    int ret = 0;
+    fs_batching = 0;
+    for (uint32_t first = 0; first < file_table_sectors; first++) {
+        if (!table_sector_dirty(first)) continue;
+        uint32_t end = first;
+        while (end < file_table_sectors && table_sector_dirty(end)) {
+            file_table_dirty[end / 32] &= ~(1u << (end % 32));
+            end++;
+        }
+        if (ata_write_sectors(superblock.file_table_start + first, end - first, &file_table[first]) != 0) {
+            log("Error writing file table sectors\n");
+            ret = -1;
+        }
+        first = end;
+    }
+    return ret;
+}
 
 void save_superblock() {
     log("Saving superblock...\n");
-    int ret = ata_write_sector(0, (uint8_t*)&superblock);
+    uint8_t sector[BLOCK_SIZE];
+    memset(sector, 0, BLOCK_SIZE);
+    memcpy(sector, &superblock, sizeof(Superblock));
+    int ret = ata_write_sector(0, sector);
     if (ret != 0) {
         log("Error writing superblock sector!\n");
     }
@@ -59,7 +141,9 @@ void save_superblock() {
 
 void load_superblock() {
     log("Loading superblock...\n");
-    int ret = ata_read_sector(0, (uint8_t*)&superblock);
+    uint8_t sector[BLOCK_SIZE];
+    int ret = ata_read_sector(0, sector);
+    memcpy(&superblock, sector, sizeof(Superblock));
     if (ret != 0) {
         log("Error reading superblock sector!\n");
         // Clear to zero so you can tell
@@ -90,28 +174,258 @@ void disk_write_block(uint32_t block_num, const void* buffer) {
 }
 
 
-void load_file_table() { 
-    int blocks_for_table = (sizeof(file_table) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    for (int i = 0; i < blocks_for_table; i++) {
-        disk_read_block(superblock.file_table_start + i, ((char*)file_table) + i * BLOCK_SIZE);
+// Size the in-memory table for `sectors` table sectors, zeroed
+int alloc_file_table(uint32_t sectors) {
+    kfree(file_table);
+    file_table = (FileTableBlock*)kzalloc(sectors * BLOCK_SIZE);
+    file_table_sectors = file_table ? sectors : 0;
+    name_index_valid = 0;
+    return file_table ? 0 : -1;
+}
+
+void load_file_table() {
+    // Older images reserved fewer table sectors than MAX_FILE_ENTRIES needs,
+    // only expose the slots that actually fit before data_start
+    uint32_t table_sectors = superblock.data_start - superblock.file_table_start;
+    if (table_sectors > FILE_TABLE_BLOCKS) table_sectors = FILE_TABLE_BLOCKS;
+    if (superblock.file_table_length > table_sectors * FILE_ENTRIES_PER_BLOCK)
+        superblock.file_table_length = table_sectors * FILE_ENTRIES_PER_BLOCK;
+
+    if (alloc_file_table(table_sectors) != 0) {
+        log("Out of memory for file table\n");
+        superblock.file_table_length = 0;
+        return;
+    }
+
+    // The whole table comes in with one multi-sector transfer
+    if (ata_read_sectors(superblock.file_table_start, table_sectors, file_table) != 0) {
+        log("Error reading file table\n");
+        memset(file_table, 0, table_sectors * BLOCK_SIZE);
+    }
+}
+
+/* ---- Block allocator ---- */
+
+static inline int block_in_use(uint32_t block) {
+    return (block_bitmap[block / 32] >> (block % 32)) & 1;
+}
+
+static void mark_blocks(uint32_t start, uint32_t count, int used) {
+    for (uint32_t b = start; b < start + count; b++) {
+        if (used) block_bitmap[b / 32] |= (1u << (b % 32));
+        else      block_bitmap[b / 32] &= ~(1u << (b % 32));
+    }
+}
+
+static int blocks_free(uint32_t start, uint32_t count) {
+    if (start + count > data_block_capacity()) return 0;
+    for (uint32_t b = start; b < start + count; b++) {
+        if (block_in_use(b)) return 0;
     }
+    return 1;
 }
 
-FileEntry* find_file(const char* filename) {
+// Rebuild the bitmap and high-water mark from the file table
+void build_block_bitmap(void) {
+    memset(block_bitmap, 0, sizeof(block_bitmap));
+    next_free_block = 0;
+    uint32_t used = 0;
+
     for (int i = 0; i < superblock.file_table_length; i++) {
-        if (file_table[i].active) {
-            log("Comparing: ");
-            log(file_table[i].filename);
-            log(" == ");
-            log(filename);
-            log("\n");
-
-            if (strcmp(file_table[i].filename, filename) == 0) {
-                log("Found match!\n");
-                return &file_table[i];
+        FileEntry* fe = file_entry(i);
+        if (!fe->active) continue;
+
+        uint32_t count = blocks_for_size(fe->size);
+        mark_blocks(fe->start_block, count, 1);
+        used += count;
+        if (fe->start_block + count > next_free_block)
+            next_free_block = fe->start_block + count;
+    }
+    free_block_count = data_block_capacity() - used;
+    block_bitmap_valid = 1;
+}
+
+// Fill in the bitmap below the high-water mark the first time a free-space
+// search or a free needs it. Bits already set by bump allocations are kept,
+// the summary counters came from the superblock and stay as they are.
+static void ensure_block_bitmap(void) {
+    if (block_bitmap_valid) return;
+
+    for (int i = 0; i < superblock.file_table_length; i++) {
+        FileEntry* fe = file_entry(i);
+        if (fe->active) mark_blocks(fe->start_block, blocks_for_size(fe->size), 1);
+    }
+    block_bitmap_valid = 1;
+}
+
+// Flag the on-disk summary as stale before the first change after mount or sync
+static void fs_mark_dirty(void) {
+    if (superblock.state == FS_STATE_DIRTY) return;
+    superblock.state = FS_STATE_DIRTY;
+    fs_dirty_since = clock_ns();
+    save_superblock();
+}
+
+// Persist the allocation summary and mark the filesystem clean so the next
+// mount can trust it
+void fs_sync(void) {
+    superblock.summary_magic = FS_SUMMARY_MAGIC;
+    superblock.free_blocks = free_block_count;
+    superblock.high_water = next_free_block;
+    superblock.state = FS_STATE_CLEAN;
+    save_superblock();
+}
+
+// Called with fs_lock held just before it's let go, so a crash while files
+// are busy costs a scan at the next mount only if it hits within
+// FS_SYNC_INTERVAL_NS of a change
+void fs_sync_if_stale(void) {
+    if (superblock.state == FS_STATE_DIRTY && clock_ns() - fs_dirty_since >= FS_SYNC_INTERVAL_NS)
+        fs_sync();
+}
+
+// An exiting task is done writing, sync whatever it left
+void fs_exit_sync(void) {
+    if (superblock.state != FS_STATE_DIRTY) return;
+    mutex_lock(&fs_lock);
+    if (superblock.state == FS_STATE_DIRTY) fs_sync();
+    mutex_unlock(&fs_lock);
+}
+
+// Set up allocation state at mount. A cleanly synced filesystem is mounted
+// from its summary without touching the file table; anything else is scanned.
+void load_allocation_summary(void) {
+    if (superblock.summary_magic == FS_SUMMARY_MAGIC && superblock.state == FS_STATE_CLEAN) {
+        free_block_count = superblock.free_blocks;
+        next_free_block = superblock.high_water;
+        memset(block_bitmap, 0, sizeof(block_bitmap));
+        block_bitmap_valid = 0;
+        log("Mounted from allocation summary\n");
+        return;
+    }
+
+    log("No clean allocation summary, scanning file table\n");
+    build_block_bitmap();
+}
+
+// Allocate `count` contiguous data blocks. Bumps the high-water mark when there
+// is room above it and only falls back to a first-fit search when there isn't.
+int fs_alloc_blocks(uint32_t count, uint32_t* start) {
+    if (count == 0) {
+        *start = 0;
+        return 0;
+    }
+    if (count > free_block_count) return -1;
+
+    uint32_t capacity = data_block_capacity();
+    uint32_t found = capacity;
+
+    fs_mark_dirty();
+    if (next_free_block + count <= capacity) {
+        found = next_free_block;
+    } else {
+        ensure_block_bitmap();
+        uint32_t run = 0;
+        for (uint32_t b = 0; b < next_free_block; b++) {
+            if (block_in_use(b)) {
+                run = 0;
+                continue;
+            }
+            if (++run == count) {
+                found = b + 1 - count;
+                break;
             }
         }
     }
+    if (found == capacity) return -1;
+
+    mark_blocks(found, count, 1);
+    free_block_count -= count;
+    if (found + count > next_free_block) next_free_block = found + count;
+    *start = found;
+    return 0;
+}
+
+// Return blocks to the allocator, pulling the high-water mark down over any
+// free space that now sits at the top of the used region
+void fs_free_blocks(uint32_t start, uint32_t count) {
+    if (count == 0) return;
+
+    fs_mark_dirty();
+    ensure_block_bitmap();
+    mark_blocks(start, count, 0);
+    free_block_count += count;
+    if (start + count >= next_free_block) {
+        next_free_block = start;
+        while (next_free_block > 0 && !block_in_use(next_free_block - 1))
+            next_free_block--;
+    }
+}
+
+// Grow an extent in place if the blocks right after it are free
+int fs_extend_blocks(uint32_t start, uint32_t old_count, uint32_t new_count) {
+    uint32_t extra = new_count - old_count;
+    // Everything above the high-water mark is free without consulting the bitmap
+    if (start + old_count == next_free_block) {
+        if (next_free_block + extra > data_block_capacity()) return -1;
+    } else {
+        ensure_block_bitmap();
+        if (!blocks_free(start + old_count, extra)) return -1;
+    }
+
+    fs_mark_dirty();
+    mark_blocks(start + old_count, extra, 1);
+    free_block_count -= extra;
+    if (start + new_count > next_free_block) next_free_block = start + new_count;
+    return 0;
+}
+
+/* ---- Filename index ---- */
+
+static uint32_t name_hash(const char* name) {
+    uint32_t h = 5381;
+    for (int i = 0; name[i] && i < MAX_FILENAME_LEN - 1; i++)
+        h = h * 33 + (uint8_t)name[i];
+    return h % FILE_HASH_BUCKETS;
+}
+
+void name_index_insert(int index) {
+    uint32_t h = name_hash(file_entry(index)->filename);
+    name_hash_next[index] = name_hash_head[h];
+    name_hash_head[h] = index;
+}
+
+void name_index_remove(int index) {
+    uint32_t h = name_hash(file_entry(index)->filename);
+    int16_t* link = &name_hash_head[h];
+    while (*link != NO_ENTRY) {
+        if (*link == index) {
+            *link = name_hash_next[index];
+            return;
+        }
+        link = &name_hash_next[*link];
+    }
+}
+
+// Built on first lookup rather than at mount
+static void build_name_index(void) {
+    for (int i = 0; i < FILE_HASH_BUCKETS; i++) name_hash_head[i] = NO_ENTRY;
+    for (int i = 0; i < superblock.file_table_length; i++) {
+        if (file_entry(i)->active) name_index_insert(i);
+    }
+    name_index_valid = 1;
+}
+
+FileEntry* find_file(const char* filename) {
+    if (!name_index_valid) build_name_index();
+
+    for (int i = name_hash_head[name_hash(filename)]; i != NO_ENTRY; i = name_hash_next[i]) {
+        FileEntry* fe = file_entry(i);
+        if (fe->active && strncmp(fe->filename, filename, MAX_FILENAME_LEN) == 0) {
+            log("Found match!\n");
+            return fe;
+        }
+    }
 
     log("No match found for ");
     log(filename);
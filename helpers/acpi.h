@@ -0,0 +1,155 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+#include "helpers/basics.h"
+#include "helpers/serial.h"
+#include "helpers/paging.h"
+#include "helpers/percpu.h"
+
+#define ACPI_MAX_OVERRIDES 16
+
+#define MADT_LAPIC          0
+#define MADT_IOAPIC         1
+#define MADT_IRQ_OVERRIDE   2
+#define MADT_LAPIC_ENABLED  0x1
+
+typedef struct {
+    char signature[8];       // "RSD PTR "
+    uint8_t checksum;
+    char oem[6];
+    uint8_t revision;
+    uint32_t rsdt;
+} __attribute__((packed)) AcpiRsdp;
+
+typedef struct {
+    char signature[4];
+    uint32_t length;         // including this header
+    uint8_t revision;
+    uint8_t checksum;
+    char oem[6];
+    char oem_table[8];
+    uint32_t oem_revision;
+    uint32_t creator;
+    uint32_t creator_revision;
+} __attribute__((packed)) AcpiHeader;
+
+// "APIC": the interrupt controllers. Variable-length entries follow.
+typedef struct {
+    AcpiHeader header;
+    uint32_t lapic_addr;
+    uint32_t flags;
+} __attribute__((packed)) AcpiMadt;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) MadtEntry;
+
+// ISA IRQ that isn't wired to the same-numbered IOAPIC input (IRQ0 usually
+// arrives on GSI 2). Flags: bits 0-1 polarity, 2-3 trigger; 3 means active
+// low / level triggered, 0 means the bus default.
+typedef struct {
+    uint8_t irq;
+    uint32_t gsi;
+    uint16_t flags;
+} IrqOverride;
+
+uint8_t acpi_apic_ids[MAX_CPUS];   // enabled CPUs, in MADT order
+int acpi_cpu_count = 0;
+uint32_t acpi_ioapic_addr = 0;
+uint32_t acpi_ioapic_gsi_base = 0;
+IrqOverride acpi_overrides[ACPI_MAX_OVERRIDES];
+int acpi_override_count = 0;
+
+static int acpi_checksum_ok(const void* p, uint32_t len) {
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) sum += ((const uint8_t*)p)[i];
+    return sum == 0;
+}
+
+// Firmware tables sit in reserved RAM, usually just below the top of memory
+static void* acpi_map(uint32_t phys, uint32_t len) {
+    if (phys + len < phys || phys + len > physmap_end) return NULL;
+    return phys_to_virt(phys);
+}
+
+static AcpiRsdp* acpi_scan_rsdp(uint32_t start, uint32_t len) {
+    for (uint32_t p = start; p < start + len; p += 16) {
+        AcpiRsdp* rsdp = (AcpiRsdp*)acpi_map(p, sizeof(AcpiRsdp));
+        if (rsdp && strncmp(rsdp->signature, "RSD PTR ", 8) == 0 && acpi_checksum_ok(rsdp, 20))
+            return rsdp;
+    }
+    return NULL;
+}
+
+// The RSDP is in the first KB of the EBDA or in the BIOS area below 1 MB
+static AcpiRsdp* acpi_find_rsdp(void) {
+    uint32_t ebda = (uint32_t)(*(uint16_t*)phys_to_virt(0x40E)) << 4;
+    AcpiRsdp* rsdp = ebda ? acpi_scan_rsdp(ebda, 1024) : NULL;
+    return rsdp ? rsdp : acpi_scan_rsdp(0xE0000, 0x20000);
+}
+
+static AcpiHeader* acpi_find_table(AcpiRsdp* rsdp, const char* sig) {
+    AcpiHeader* rsdt = (AcpiHeader*)acpi_map(rsdp->rsdt, sizeof(AcpiHeader));
+    if (!rsdt || !acpi_map(rsdp->rsdt, rsdt->length) || !acpi_checksum_ok(rsdt, rsdt->length))
+        return NULL;
+
+    uint32_t* entries = (uint32_t*)(rsdt + 1);
+    uint32_t count = (rsdt->length - sizeof(AcpiHeader)) / 4;
+    for (uint32_t i = 0; i < count; i++) {
+        AcpiHeader* h = (AcpiHeader*)acpi_map(entries[i], sizeof(AcpiHeader));
+        if (!h || strncmp(h->signature, sig, 4) != 0) continue;
+        if (acpi_map(entries[i], h->length) && acpi_checksum_ok(h, h->length)) return h;
+    }
+    return NULL;
+}
+
+// Collect the CPUs, the (first) IOAPIC and the ISA IRQ overrides.
+// Returns 0 when there's an APIC setup we can use.
+int acpi_parse_madt(void) {
+    AcpiRsdp* rsdp = acpi_find_rsdp();
+    if (!rsdp) {
+        log("acpi: no RSDP\n");
+        return -1;
+    }
+    AcpiMadt* madt = (AcpiMadt*)acpi_find_table(rsdp, "APIC");
+    if (!madt) {
+        log("acpi: no MADT\n");
+        return -1;
+    }
+
+    uint8_t* p = (uint8_t*)(madt + 1);
+    uint8_t* end = (uint8_t*)madt + madt->header.length;
+    while (p + sizeof(MadtEntry) <= end) {
+        MadtEntry* e = (MadtEntry*)p;
+        if (e->length < sizeof(MadtEntry)) break;
+
+        if (e->type == MADT_LAPIC) {
+            // processor id, apic id, flags
+            uint8_t apic_id = p[3];
+            uint32_t flags = *(uint32_t*)(p + 4);
+            if ((flags & MADT_LAPIC_ENABLED) && acpi_cpu_count < MAX_CPUS)
+                acpi_apic_ids[acpi_cpu_count++] = apic_id;
+        } else if (e->type == MADT_IOAPIC && !acpi_ioapic_addr) {
+            // id, reserved, address, GSI base
+            acpi_ioapic_addr = *(uint32_t*)(p + 4);
+            acpi_ioapic_gsi_base = *(uint32_t*)(p + 8);
+        } else if (e->type == MADT_IRQ_OVERRIDE && acpi_override_count < ACPI_MAX_OVERRIDES) {
+            // bus, source IRQ, GSI, flags
+            IrqOverride* o = &acpi_overrides[acpi_override_count++];
+            o->irq = p[3];
+            o->gsi = *(uint32_t*)(p + 4);
+            o->flags = *(uint16_t*)(p + 8);
+        }
+        p += e->length;
+    }
+
+    if (acpi_cpu_count == 0 || !acpi_ioapic_addr) {
+        log("acpi: MADT lists no usable APICs\n");
+        return -1;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef APIC_H
+#define APIC_H
+
+#include <stdint.h>
+#include "helpers/basics.h"
+#include "helpers/serial.h"
+#include "helpers/cpu.h"
+#include "helpers/pic.h"
+#include "helpers/pit.h"
+#include "helpers/paging.h"
+#include "helpers/percpu.h"
+#include "helpers/acpi.h"
+#include "helpers/idt.h"
+
+#define MSR_APIC_BASE     0x1B
+#define APIC_BASE_ENABLE  (1u << 11)
+
+// Local APIC registers, offsets from its MMIO base
+#define LAPIC_ID          0x020
+#define LAPIC_TPR         0x080
+#define LAPIC_EOI         0x0B0
+#define LAPIC_SVR         0x0F0
+#define LAPIC_ICR_LOW     0x300
+#define LAPIC_ICR_HIGH    0x310
+#define LAPIC_LVT_TIMER   0x320
+#define LAPIC_TIMER_INIT  0x380
+#define LAPIC_TIMER_CUR   0x390
+#define LAPIC_TIMER_DIV   0x3E0
+
+#define LAPIC_SVR_ENABLE  0x100
+#define LAPIC_LVT_MASKED  (1u << 16)
+#define LAPIC_TIMER_PERIODIC (1u << 17)
+#define LAPIC_TIMER_DIV16 0x3
+
+#define ICR_INIT          0x500
+#define ICR_STARTUP       0x600
+#define ICR_ASSERT        0x4000
+#define ICR_PENDING       0x1000
+
+#define IOAPIC_REGSEL     0x00
+#define IOAPIC_WINDOW     0x10
+#define IOAPIC_VER        0x01
+#define IOAPIC_REDTBL     0x10       // two registers per input
+#define IOAPIC_MASKED     (1u << 16)
+#define IOAPIC_ACTIVE_LOW (1u << 13)
+#define IOAPIC_LEVEL      (1u << 15)
+
+#define APIC_TIMER_VECTOR 0x40
+#define RESCHED_VECTOR    0xF0
+#define SPURIOUS_VECTOR   0xFF
+
+extern char isr64[], isr240[], isr255[];   // isr_stubs.asm
+
+// Where paging_map_mmio put them; high MMIO is identity mapped
+uint32_t lapic_base = 0;
+uint32_t ioapic_base = 0;
+int apic_enabled = 0;                      // IRQs go through the IOAPIC, not the 8259s
+uint32_t lapic_timer_count = 0;            // LAPIC timer counts per scheduler tick
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return *(volatile uint32_t*)(lapic_base + reg);
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t v) {
+    *(volatile uint32_t*)(lapic_base + reg) = v;
+}
+
+static uint32_t ioapic_read(uint32_t reg) {
+    *(volatile uint32_t*)(ioapic_base + IOAPIC_REGSEL) = reg;
+    return *(volatile uint32_t*)(ioapic_base + IOAPIC_WINDOW);
+}
+
+static void ioapic_write(uint32_t reg, uint32_t v) {
+    *(volatile uint32_t*)(ioapic_base + IOAPIC_REGSEL) = reg;
+    *(volatile uint32_t*)(ioapic_base + IOAPIC_WINDOW) = v;
+}
+
+uint8_t lapic_id(void) {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_send_ipi(uint8_t apic_id, uint32_t icr) {
+    lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, icr);
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING) cpu_relax();
+}
+
+// Deliver ISA `irq` as `vector` to one CPU, honouring the MADT overrides
+void ioapic_route(uint8_t irq, uint8_t vector, uint8_t dest) {
+    uint32_t gsi = irq;
+    uint16_t flags = 0;
+    for (int i = 0; i < acpi_override_count; i++) {
+        if (acpi_overrides[i].irq != irq) continue;
+        gsi = acpi_overrides[i].gsi;
+        flags = acpi_overrides[i].flags;
+    }
+
+    uint32_t low = vector;
+    if ((flags & 0x3) == 0x3) low |= IOAPIC_ACTIVE_LOW;
+    if (((flags >> 2) & 0x3) == 0x3) low |= IOAPIC_LEVEL;
+
+    uint32_t pin = gsi - acpi_ioapic_gsi_base;
+    ioapic_write(IOAPIC_REDTBL + pin * 2 + 1, (uint32_t)dest << 24);
+    ioapic_write(IOAPIC_REDTBL + pin * 2, low);
+}
+
+// Device IRQs all land on the boot CPU, whichever controller is in charge
+void irq_unmask(uint8_t irq) {
+    if (apic_enabled) ioapic_route(irq, IRQ_BASE + irq, cpus[0].apic_id);
+    else pic_unmask(irq);
+}
+
+void irq_eoi(uint8_t irq) {
+    if (apic_enabled) lapic_eoi();
+    else pic_send_eoi(irq);
+}
+
+// Per CPU: accept interrupts, spurious ones go to a vector that isn't acknowledged
+void lapic_enable(void) {
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | SPURIOUS_VECTOR);
+}
+
+// Count LAPIC timer ticks over 10 ms of PIT time. The timer runs off the bus
+// clock, which is the same on every CPU, so the boot CPU measures once.
+static void lapic_timer_calibrate(void) {
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    pit_delay_us(10000);
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+
+    lapic_timer_count = elapsed / 10 * 1000 / PIT_HZ;
+    if (lapic_timer_count == 0) lapic_timer_count = 1;
+}
+
+// Per CPU: the scheduler tick, PIT_HZ times a second
+void lapic_timer_start(void) {
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TIMER, APIC_TIMER_VECTOR | LAPIC_TIMER_PERIODIC);
+    lapic_write(LAPIC_TIMER_INIT, lapic_timer_count);
+}
+
+// Switch the boot CPU from the 8259s to the local APIC + IOAPIC. Leaves
+// everything as it was (PIC mode, one CPU) when the hardware or the ACPI
+// tables aren't there.
+int apic_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    if (!(d & CPUID_EDX_APIC) || !(d & CPUID_EDX_MSR)) {
+        log("apic: not supported, staying on the 8259\n");
+        return -1;
+    }
+    if (acpi_parse_madt() != 0) return -1;
+
+    uint64_t msr = rdmsr(MSR_APIC_BASE);
+    lapic_base = (uint32_t)paging_map_mmio((uint32_t)msr & 0xFFFFF000, PAGE_SIZE);
+    ioapic_base = (uint32_t)paging_map_mmio(acpi_ioapic_addr, PAGE_SIZE);
+    if (!lapic_base || !ioapic_base) {
+        log("apic: can't map the registers\n");
+        return -1;
+    }
+    wrmsr(MSR_APIC_BASE, msr | APIC_BASE_ENABLE);
+
+    // Nothing is routed until a driver asks for it
+    uint32_t pins = ((ioapic_read(IOAPIC_VER) >> 16) & 0xFF) + 1;
+    for (uint32_t i = 0; i < pins; i++) {
+        ioapic_write(IOAPIC_REDTBL + i * 2, IOAPIC_MASKED);
+        ioapic_write(IOAPIC_REDTBL + i * 2 + 1, 0);
+    }
+    pic_disable();
+
+    idt_set_gate(APIC_TIMER_VECTOR, (uint32_t)isr64, KERNEL_CS, 0x8E);
+    idt_set_gate(RESCHED_VECTOR, (uint32_t)isr240, KERNEL_CS, 0x8E);
+    idt_set_gate(SPURIOUS_VECTOR, (uint32_t)isr255, KERNEL_CS, 0x8E);
+
+    lapic_enable();
+    this_cpu()->apic_id = lapic_id();
+    lapic_timer_calibrate();
+    apic_enabled = 1;
+
+    char buf[12];
+    log("apic: ");
+    int_to_chars(acpi_cpu_count, buf, sizeof(buf)); log_buffer(buf);
+    log(" CPUs, timer ");
+    int_to_chars(lapic_timer_count, buf, sizeof(buf)); log_buffer(buf);
+    log(" counts/tick\n");
+    return 0;
+}
+
+#endif
@@ -1,5 +1,9 @@
 #include <stdint.h>
 #include <stddef.h>
+#include "port_io.h"
+#include "spinlock.h"
+#include "basics.h"
+#include "cpu.h"
 
 #define LOGO_WIDTH 31
 #define LOGO_HEIGHT 25
@@ -12,27 +16,189 @@ volatile char* const VIDEO_MEMORY = (volatile char*)0xB8000;
 int col = 0;
 int row = 0;
 
-int strcmp(const char *a, const char *b) {
-    while (*a && (*a == *b)) {
-        a++; b++;
-    }
-    return *(unsigned char*)a - *(unsigned char*)b;
-}
+// memcpy and memset go through a pointer that mem_init points at the best
+// variant once at boot: rep movsd/stosd on any CPU, SSE2 for large blocks
+// when the CPU has it and cpu_setup enabled it. The byte loops stay for
+// comparison (helpers/membench.h). The string routines work a word at a
+// time: aligned loads never cross into the next page.
+#define MEM_SSE2_MIN 512   // below this, saving xmm registers costs more than it gains
+#define HAS_ZERO_BYTE(w) (((w) - 0x01010101u) & ~(w) & 0x80808080u)
 
-void *memcpy(void *dest, const void *src, size_t n) {
+typedef uint32_t __attribute__((may_alias)) word_t;
+
+void* memcpy_bytes(void* dest, const void* src, size_t n) {
     char *d = dest;
     const char *s = src;
     for (size_t i = 0; i < n; i++) d[i] = s[i];
     return dest;
 }
 
-void *memset(void *s, int c, size_t n) {
+void* memcpy_rep(void* dest, const void* src, size_t n) {
+    void* d = dest;
+    size_t words = n / 4, tail = n & 3;
+    __asm__ volatile ("rep movsl" : "+D"(d), "+S"(src), "+c"(words) : : "memory");
+    __asm__ volatile ("rep movsb" : "+D"(d), "+S"(src), "+c"(tail) : : "memory");
+    return dest;
+}
+
+// The kernel doesn't own the xmm registers, whatever task ran last does, so
+// the SSE2 routines put back the ones they use. A set CR0.TS (the registers
+// belong to a task that isn't loaded) is cleared for the copy and restored.
+static inline uint32_t sse_begin(uint8_t* save) {
+    uint32_t cr0 = read_cr0();
+    if (cr0 & CR0_TS) __asm__ volatile ("clts");
+    __asm__ volatile ("movdqu %%xmm0, (%0)\n"
+                      "movdqu %%xmm1, 16(%0)\n"
+                      "movdqu %%xmm2, 32(%0)\n"
+                      "movdqu %%xmm3, 48(%0)\n" : : "r"(save) : "memory");
+    return cr0;
+}
+
+static inline void sse_end(const uint8_t* save, uint32_t cr0) {
+    __asm__ volatile ("movdqu (%0), %%xmm0\n"
+                      "movdqu 16(%0), %%xmm1\n"
+                      "movdqu 32(%0), %%xmm2\n"
+                      "movdqu 48(%0), %%xmm3\n" : : "r"(save) : "memory");
+    if (cr0 & CR0_TS) write_cr0(cr0);
+}
+
+// 64 bytes per iteration into a 16-byte aligned destination
+void* memcpy_sse2(void* dest, const void* src, size_t n) {
+    if (n < MEM_SSE2_MIN) return memcpy_rep(dest, src, n);
+
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+    size_t head = (16 - ((uint32_t)d & 15)) & 15;
+    memcpy_rep(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    uint8_t save[64];
+    uint32_t cr0 = sse_begin(save);
+    size_t blocks = n / 64;
+    if (((uint32_t)s & 15) == 0) {
+        __asm__ volatile ("1:\n"
+                          "movdqa (%1), %%xmm0\n"
+                          "movdqa 16(%1), %%xmm1\n"
+                          "movdqa 32(%1), %%xmm2\n"
+                          "movdqa 48(%1), %%xmm3\n"
+                          "movdqa %%xmm0, (%0)\n"
+                          "movdqa %%xmm1, 16(%0)\n"
+                          "movdqa %%xmm2, 32(%0)\n"
+                          "movdqa %%xmm3, 48(%0)\n"
+                          "add $64, %1\n"
+                          "add $64, %0\n"
+                          "dec %2\n"
+                          "jnz 1b\n"
+                          : "+r"(d), "+r"(s), "+r"(blocks) : : "memory", "cc");
+    } else {
+        __asm__ volatile ("1:\n"
+                          "movdqu (%1), %%xmm0\n"
+                          "movdqu 16(%1), %%xmm1\n"
+                          "movdqu 32(%1), %%xmm2\n"
+                          "movdqu 48(%1), %%xmm3\n"
+                          "movdqa %%xmm0, (%0)\n"
+                          "movdqa %%xmm1, 16(%0)\n"
+                          "movdqa %%xmm2, 32(%0)\n"
+                          "movdqa %%xmm3, 48(%0)\n"
+                          "add $64, %1\n"
+                          "add $64, %0\n"
+                          "dec %2\n"
+                          "jnz 1b\n"
+                          : "+r"(d), "+r"(s), "+r"(blocks) : : "memory", "cc");
+    }
+    sse_end(save, cr0);
+    memcpy_rep(d, s, n & 63);
+    return dest;
+}
+
+void* memset_bytes(void* s, int c, size_t n) {
     unsigned char *p = s;
     for (size_t i = 0; i < n; i++) p[i] = (unsigned char)c;
     return s;
 }
 
+void* memset_rep(void* s, int c, size_t n) {
+    void* d = s;
+    uint32_t pattern = (uint8_t)c * 0x01010101u;
+    size_t words = n / 4, tail = n & 3;
+    __asm__ volatile ("rep stosl" : "+D"(d), "+c"(words) : "a"(pattern) : "memory");
+    __asm__ volatile ("rep stosb" : "+D"(d), "+c"(tail) : "a"(pattern) : "memory");
+    return s;
+}
 
+void* memset_sse2(void* s, int c, size_t n) {
+    if (n < MEM_SSE2_MIN) return memset_rep(s, c, n);
+
+    uint8_t* d = s;
+    size_t head = (16 - ((uint32_t)d & 15)) & 15;
+    memset_rep(d, c, head);
+    d += head;
+    n -= head;
+
+    uint8_t save[64];
+    uint32_t cr0 = sse_begin(save);
+    size_t blocks = n / 64;
+    __asm__ volatile ("movd %2, %%xmm0\n"
+                      "pshufd $0, %%xmm0, %%xmm0\n"
+                      "1:\n"
+                      "movdqa %%xmm0, (%0)\n"
+                      "movdqa %%xmm0, 16(%0)\n"
+                      "movdqa %%xmm0, 32(%0)\n"
+                      "movdqa %%xmm0, 48(%0)\n"
+                      "add $64, %0\n"
+                      "dec %1\n"
+                      "jnz 1b\n"
+                      : "+r"(d), "+r"(blocks) : "r"((uint8_t)c * 0x01010101u) : "memory", "cc");
+    sse_end(save, cr0);
+    memset_rep(d, c, n & 63);
+    return s;
+}
+
+static void* (*memcpy_impl)(void*, const void*, size_t) = memcpy_rep;
+static void* (*memset_impl)(void*, int, size_t) = memset_rep;
+const char* mem_variant = "rep";
+
+// Pick the memcpy/memset variants, on the boot CPU after cpu_setup
+void mem_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    if ((d & CPUID_EDX_SSE2) && (read_cr4() & CR4_OSFXSR)) {
+        memcpy_impl = memcpy_sse2;
+        memset_impl = memset_sse2;
+        mem_variant = "sse2";
+    }
+}
+
+void *memcpy(void *dest, const void *src, size_t n) {
+    return memcpy_impl(dest, src, n);
+}
+
+void *memset(void *s, int c, size_t n) {
+    return memset_impl(s, c, n);
+}
+
+int strcmp(const char *a, const char *b) {
+    // Equally aligned strings can be compared a word at a time until one
+    // differs or holds the terminator
+    if ((((uint32_t)a ^ (uint32_t)b) & 3) == 0) {
+        for (; (uint32_t)a & 3; a++, b++)
+            if (*a != *b || !*a) return *(unsigned char*)a - *(unsigned char*)b;
+        const word_t* wa = (const word_t*)a;
+        const word_t* wb = (const word_t*)b;
+        while (*wa == *wb && !HAS_ZERO_BYTE(*wa)) {
+            wa++;
+            wb++;
+        }
+        a = (const char*)wa;
+        b = (const char*)wb;
+    }
+    while (*a && (*a == *b)) {
+        a++; b++;
+    }
+    return *(unsigned char*)a - *(unsigned char*)b;
+}
 
 char *strncpy(char *dest, const char *src, size_t n) {
     size_t i;
@@ -41,15 +207,36 @@ char *strncpy(char *dest, const char *src, size_t n) {
     return dest;
 }
 
-// Correct strlen signature
-int strlen(const char *str) {
+int strlen_bytes(const char *str) {
     int len = 0;
     while (str[len] != '\0') len++;
     return len;
 }
 
-// Correct strncmp signature
+int strlen(const char *str) {
+    const char* p = str;
+    for (; (uint32_t)p & 3; p++)
+        if (!*p) return p - str;
+    const word_t* w = (const word_t*)p;
+    while (!HAS_ZERO_BYTE(*w)) w++;
+    for (p = (const char*)w; *p; p++);
+    return p - str;
+}
+
 int strncmp(const char *s1, const char *s2, int n) {
+    if ((((uint32_t)s1 ^ (uint32_t)s2) & 3) == 0) {
+        for (; n > 0 && ((uint32_t)s1 & 3); s1++, s2++, n--)
+            if (*s1 != *s2 || !*s1) return (unsigned char)*s1 - (unsigned char)*s2;
+        const word_t* w1 = (const word_t*)s1;
+        const word_t* w2 = (const word_t*)s2;
+        while (n >= 4 && *w1 == *w2 && !HAS_ZERO_BYTE(*w1)) {
+            w1++;
+            w2++;
+            n -= 4;
+        }
+        s1 = (const char*)w1;
+        s2 = (const char*)w2;
+    }
     for (int i = 0; i < n; i++) {
         if (s1[i] != s2[i] || s1[i] == '\0' || s2[i] == '\0') {
             return (unsigned char)s1[i] - (unsigned char)s2[i];
@@ -124,128 +311,250 @@ void int_to_chars(int num, char *buf, int buf_size) {
     buf[j] = '\0';
 }
 
-void scroll() {
-    if (row < VIDEO_HEIGHT) return;  // no scroll needed
+// Console: text goes into a shadow copy of the screen with CONSOLE_LINES of
+// history, and only lines that changed are copied to VGA memory, on a
+// newline, after a screenful of characters or on the timer tick. The 32 KB
+// at 0xB8000 holds VGA_ROWS rows; scrolling moves the CRTC start address
+// down them and only wraps back to the top (one full redraw) when it runs out.
+// A framebuffer console (helpers/fbcon.h) can take over the drawing with
+// console_set_output, and the screen size with it; there newlines don't
+// flush, so a burst of scrolling costs one redraw.
+#define CONSOLE_LINES 256             // power of two
+#define VGA_ROWS (0x8000 / 2 / VIDEO_WIDTH)
+#define VGA_CRTC_INDEX 0x3D4
+#define VGA_CRTC_DATA  0x3D5
+#define CONSOLE_BLANK 0x0720          // space, light gray on black
+
+static uint16_t con_buf[CONSOLE_LINES][CONSOLE_MAX_COLS];
+static uint32_t con_dirty[CONSOLE_LINES / 32];   // by slot, changed since the last flush
+static uint32_t con_top;        // line number (not slot) shown at row 0
+static uint32_t con_view;       // lines scrolled back from the bottom
+static uint32_t con_pending;    // characters since the last flush
+static uint32_t vga_top;        // line at the CRTC start address
+static uint32_t vga_origin;     // VGA row the CRTC start address points at
+static Spinlock con_lock = SPINLOCK_INIT;
+static int con_cols = VIDEO_WIDTH, con_rows = VIDEO_HEIGHT;
+static ConsoleDrawRow con_draw_row;         // NULL: VGA text mode
+static ConsoleDrawCursor con_draw_cursor;
+
+static inline uint16_t* con_line(uint32_t line) {
+    return con_buf[line & (CONSOLE_LINES - 1)];
+}
 
-    // Copy each row (starting from 1) to previous row
-    for (int r = 1; r < VIDEO_HEIGHT; r++) {
-        for (int c = 0; c < VIDEO_WIDTH; c++) {
-            int src = 2 * (r * VIDEO_WIDTH + c);
-            int dest = 2 * ((r - 1) * VIDEO_WIDTH + c);
-            VIDEO_MEMORY[dest] = VIDEO_MEMORY[src];
-            VIDEO_MEMORY[dest + 1] = VIDEO_MEMORY[src + 1];
-        }
-    }
-    // Clear the last line
-    int last_row = VIDEO_HEIGHT - 1;
-    for (int c = 0; c < VIDEO_WIDTH; c++) {
-        int pos = 2 * (last_row * VIDEO_WIDTH + c);
-        VIDEO_MEMORY[pos] = ' ';
-        VIDEO_MEMORY[pos + 1] = 0x07; // Light gray on black
-    }
+static inline void con_mark(uint32_t line) {
+    uint32_t slot = line & (CONSOLE_LINES - 1);
+    con_dirty[slot / 32] |= 1u << (slot % 32);
+}
 
-    row = VIDEO_HEIGHT - 1;
+static void crtc_write16(uint8_t reg_high, uint16_t val) {
+    outb(VGA_CRTC_INDEX, reg_high);
+    outb(VGA_CRTC_DATA, val >> 8);
+    outb(VGA_CRTC_INDEX, reg_high + 1);
+    outb(VGA_CRTC_DATA, val & 0xFF);
 }
 
-void putc(char c) {
-    if (c == '\n') {
-        col = 0;
-        row++;
-    } else {
-        int index = 2 * (row * VIDEO_WIDTH + col);
-        VIDEO_MEMORY[index] = c;
-        VIDEO_MEMORY[index + 1] = 0x07; // color attribute
-        col++;
-        if (col >= VIDEO_WIDTH) {
-            col = 0;
-            row++;
+// Hand the backend every row that changed, or all of them if the view moved
+static void console_flush_output(uint32_t want) {
+    int moved = want != vga_top;
+    vga_top = want;
+    for (int r = 0; r < con_rows; r++) {
+        uint32_t slot = (want + r) & (CONSOLE_LINES - 1);
+        uint32_t bit = 1u << (slot % 32);
+        if (moved || (con_dirty[slot / 32] & bit)) {
+            con_draw_row(r, con_buf[slot], con_cols);
+            con_dirty[slot / 32] &= ~bit;
         }
     }
-
-    scroll();  // Scroll if needed
+    con_draw_cursor(row + con_view, col < con_cols ? col : con_cols - 1);
 }
 
-void lputc(char c) {
-    if (c == '\n') {
-        col = 0;
-        row++;
+// Caller holds con_lock
+static void console_flush_locked(void) {
+    uint32_t want = con_top - con_view;
+    con_pending = 0;
+    if (con_draw_row) {
+        console_flush_output(want);
         return;
     }
-
-    if (col >= LOGO_WIDTH) {
-        col = 0;
-        row++;
+    int delta = (int)(want - vga_top);
+    int from = 0, to = 0;   // rows shown fresh, written whether dirty or not
+
+    // Follow the text by moving the start address when the rows are there
+    if (delta > 0 && delta < VIDEO_HEIGHT && vga_origin + delta + VIDEO_HEIGHT <= VGA_ROWS) {
+        vga_origin += delta;
+        from = VIDEO_HEIGHT - delta;
+        to = VIDEO_HEIGHT;
+    } else if (delta < 0 && -delta < VIDEO_HEIGHT && vga_origin >= (uint32_t)-delta) {
+        vga_origin += delta;
+        to = -delta;
+    } else if (delta != 0) {
+        vga_origin = 0;
+        to = VIDEO_HEIGHT;
     }
-
-    if (row >= LOGO_HEIGHT) {
-        row = 0; // Wrap around, or implement scrolling
+    vga_top = want;
+
+    uint16_t* vga = (uint16_t*)VIDEO_MEMORY + vga_origin * VIDEO_WIDTH;
+    for (int r = 0; r < VIDEO_HEIGHT; r++) {
+        uint32_t slot = (want + r) & (CONSOLE_LINES - 1);
+        uint32_t bit = 1u << (slot % 32);
+        if ((r >= from && r < to) || (con_dirty[slot / 32] & bit)) {
+            memcpy(vga + r * VIDEO_WIDTH, con_buf[slot], VIDEO_WIDTH * 2);
+            con_dirty[slot / 32] &= ~bit;
+        }
     }
 
-    int pos = 2 * (row * 80 + col);
-    VIDEO_MEMORY[pos] = c;
-    VIDEO_MEMORY[pos + 1] = 0x07; // Light gray on black
-    col++;
+    crtc_write16(0x0C, vga_origin * VIDEO_WIDTH);   // start address
+    // The cursor drops below the screen, out of sight, while scrolled back
+    int c = col < VIDEO_WIDTH ? col : VIDEO_WIDTH - 1;
+    crtc_write16(0x0E, (vga_origin + row + con_view) * VIDEO_WIDTH + c);
 }
-void bputc(char c) {
-    if (c == '\n') {
-        col = 0;
+
+static void console_blank_line(uint32_t line) {
+    uint16_t* l = con_line(line);
+    for (int i = 0; i < CONSOLE_MAX_COLS; i++) l[i] = CONSOLE_BLANK;
+    con_mark(line);
+}
+
+static void console_newline(void) {
+    col = 0;
+    if (row < con_rows - 1) {
         row++;
         return;
     }
+    // Scroll: the line falling out of history becomes the new bottom one
+    con_top++;
+    console_blank_line(con_top + con_rows - 1);
+}
 
-    if (col >= BEAR_WIDTH) {
-        col = 0;
-        row++;
+// Put one character, wrapping to a new line before column `width` or the
+// edge of the screen
+static void console_putc(char c, int width) {
+    con_view = 0;   // new output brings the view back down
+    if (c == '\n') {
+        console_newline();
+        if (!con_draw_row) {
+            console_flush_locked();
+            return;
+        }
+        // A framebuffer scroll redraws every row, so it waits for a
+        // screenful or the tick; the newline counts as a whole line
+        con_pending += con_cols;
+    } else {
+        if (col >= width || col >= con_cols) console_newline();
+        con_line(con_top + row)[col++] = 0x0700 | (uint8_t)c;
+        con_mark(con_top + row);
+        con_pending++;
     }
+    if (con_pending >= (uint32_t)(con_cols * con_rows)) console_flush_locked();   // a screenful
+}
+
+static void console_write(const char* s, int len, int width) {
+    spin_lock(&con_lock);
+    for (int i = 0; i < len; i++) console_putc(s[i], width);
+    spin_unlock(&con_lock);
+}
+
+void console_flush(void) {
+    spin_lock(&con_lock);
+    console_flush_locked();
+    spin_unlock(&con_lock);
+}
+
+// Timer tick: show text that didn't end in a newline. Skipped if another
+// CPU is printing, it will flush soon enough.
+void console_tick(void) {
+    if (!con_pending || !spin_trylock(&con_lock)) return;
+    console_flush_locked();
+    spin_unlock(&con_lock);
+}
 
-    if (row >= BEAR_HEIGHT) {
-        row = 0; // Wrap around, or implement scrolling
+// Look `lines` further back into the history (negative: forward again)
+void console_scrollback(int lines) {
+    spin_lock(&con_lock);
+    int view = (int)con_view + lines;
+    int oldest = con_top < (uint32_t)(CONSOLE_LINES - con_rows) ? (int)con_top : CONSOLE_LINES - con_rows;
+    if (view < 0) view = 0;
+    if (view > oldest) view = oldest;
+    con_view = view;
+    console_flush_locked();
+    spin_unlock(&con_lock);
+}
+
+void console_clear(void) {
+    spin_lock(&con_lock);
+    for (int l = 0; l < CONSOLE_LINES; l++) console_blank_line(l);
+    con_top = con_view = 0;
+    row = col = 0;
+    vga_top = 1;   // anything but con_top, for a full redraw at row 0
+    vga_origin = 0;
+    console_flush_locked();
+    spin_unlock(&con_lock);
+}
+
+// Switch drawing to another device of cols x rows cells. The text on screen
+// is kept, lines past what VGA showed start out blank.
+void console_set_output(int cols, int rows, ConsoleDrawRow draw_row, ConsoleDrawCursor draw_cursor) {
+    if (cols > CONSOLE_MAX_COLS) cols = CONSOLE_MAX_COLS;
+    if (rows > CONSOLE_MAX_ROWS) rows = CONSOLE_MAX_ROWS;
+    spin_lock(&con_lock);
+    for (int r = con_rows; r < rows; r++) console_blank_line(con_top + r);
+    if (row >= rows) {
+        con_top += row - rows + 1;
+        row = rows - 1;
     }
+    con_cols = cols;
+    con_rows = rows;
+    con_draw_row = draw_row;
+    con_draw_cursor = draw_cursor;
+    con_view = 0;
+    vga_top = con_top + 1;   // redraw everything
+    console_flush_locked();
+    spin_unlock(&con_lock);
+}
 
-    int pos = 2 * (row * 80 + col);
-    VIDEO_MEMORY[pos] = c;
-    VIDEO_MEMORY[pos + 1] = 0x07; // Light gray on black
-    col++;
+void putc(char c) {
+    console_write(&c, 1, CONSOLE_MAX_COLS);
+}
+
+// The boot logo and bear are drawn in narrow columns
+void lputc(char c) {
+    console_write(&c, 1, LOGO_WIDTH);
+}
+
+void bputc(char c) {
+    console_write(&c, 1, BEAR_WIDTH);
 }
 
 void print_logo(const char* str) {
-    while (*str) {
-        char c = *str++;
-        lputc(c);
-    }
+    console_write(str, strlen(str), LOGO_WIDTH);
 }
 
 void print_bear(const char* str) {
-    while (*str) {
-        char c = *str++;
-        bputc(c);
-    }
+    console_write(str, strlen(str), BEAR_WIDTH);
 }
 
 void print(const char* str) {
-    while (*str) {
-        char c = *str++;
-        putc(c);
-    }
+    console_write(str, strlen(str), CONSOLE_MAX_COLS);
 }
 
 
 void print_buffer_n(const char *buffer, int len) {
-    for (int i = 0; i < len; i++) {
-        putc(buffer[i]);
-    }
+    console_write(buffer, len, CONSOLE_MAX_COLS);
 }
 
 void print_buffer(const char *buffer) {
-    while (*buffer != '\0') {
-        char c = *buffer++;
-        putc(c);
-    }
+    print(buffer);
 }
 
 
+void serial_flush(void);   // helpers/serial.h
+void log(const char* str);
+
 void panic(const char *msg) {
     print(msg);
+    console_flush();
+    serial_flush();   // whatever was queued, then the message, without IRQs
+    log(msg);
     while (1) { __asm__("hlt"); }
 }
 
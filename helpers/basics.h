@@ -11,6 +11,15 @@ extern volatile char* const VIDEO_MEMORY;
 int strcmp(const char *a, const char *b);
 void *memcpy(void *dest, const void *src, size_t n);
 void *memset(void *s, int c, size_t n);
+void* memcpy_bytes(void* dest, const void* src, size_t n);
+void* memcpy_rep(void* dest, const void* src, size_t n);
+void* memcpy_sse2(void* dest, const void* src, size_t n);
+void* memset_bytes(void* s, int c, size_t n);
+void* memset_rep(void* s, int c, size_t n);
+void* memset_sse2(void* s, int c, size_t n);
+int strlen_bytes(const char *str);
+void mem_init(void);
+extern const char* mem_variant;
 char *strncpy(char *dest, const char *src, size_t n);
 int strlen(const char *str);
 int strncmp(const char *s1, const char *s2, int n);
@@ -19,7 +28,6 @@ static char *trim(char *s);
 void char_to_string(char c, char *out);
 void int_to_hex(uint8_t val, char* out);
 void int_to_chars(int num, char *buf, int buf_size);
-void scroll();
 void putc(char c);
 void lputc(char c);
 void bputc(char c);
@@ -29,5 +37,19 @@ void print(const char* str);
 void print_buffer_n(const char *buffer, int len);
 void print_buffer(const char *buffer);
 void panic(const char *msg);
+#define CONSOLE_MAX_COLS 160
+#define CONSOLE_MAX_ROWS 100
+
+// Console output other than VGA text: draws row `row` of the screen from
+// `cols` cells (character in the low byte, VGA attribute in the high one),
+// and moves the cursor, which may be below the screen while scrolled back
+typedef void (*ConsoleDrawRow)(int row, const uint16_t* cells, int cols);
+typedef void (*ConsoleDrawCursor)(int row, int col);
+
+void console_flush(void);
+void console_tick(void);
+void console_scrollback(int lines);
+void console_clear(void);
+void console_set_output(int cols, int rows, ConsoleDrawRow draw_row, ConsoleDrawCursor draw_cursor);
 
 #endif
@@ -4,9 +4,63 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "helpers/basics.h"
+#include "helpers/pic.h"
+#include "helpers/apic.h"
+#include "helpers/timer.h"
+#include "helpers/sched.h"
 
 #define ATA_PRIMARY_CMD  0x1F0
-#define ATA_PRIMARY_CTRL 0x3F6
+#define ATA_PRIMARY_CTRL 0x3F6           // reads as alternate status, which doesn't ack the IRQ
+#define ATA_TIMEOUT_US   1000000         // a command still busy after this has failed
+#define ATA_SELECT_DELAY_US 1            // the drive needs 400 ns after a select
+
+WaitQueue ata_queue;                     // tasks waiting for the drive to finish
+uint32_t ata_irqs = 0;
+
+// IRQ14: the drive finished a command or has the next sector ready
+void ata_irq_handler(struct registers* r) {
+    inb(ATA_PRIMARY_CMD + 7);            // reading status acknowledges the drive's interrupt
+    ata_irqs++;
+    wake_up(&ata_queue);
+}
+
+void ata_enable_irq(void) {
+    outb(ATA_PRIMARY_CTRL, 0x00);        // clear nIEN
+}
+
+static void ata_timeout_fn(Timer* t) {
+    wake_up(&ata_queue);
+}
+
+// While the drive is busy, give the CPU to another task until IRQ14 instead
+// of spinning, or until the caller's deadline if the IRQ never comes.
+// IRQ14 goes to the boot CPU while we may be on another one: the check
+// happens under the queue's lock, so the handler's wake_up waits until
+// we're queued.
+static void ata_sleep_while_busy(uint64_t deadline) {
+    if (!can_sleep()) return;
+
+    Timer timeout;
+    timer_init(&timeout, ata_timeout_fn, NULL);
+    timer_add(&timeout, deadline);
+    spin_lock(&ata_queue.lock);
+    if ((inb(ATA_PRIMARY_CTRL) & 0x80) && clock_ns() < deadline)
+        sleep_on(&ata_queue, &ata_queue.lock);
+    spin_unlock(&ata_queue.lock);
+    timer_cancel(&timeout);
+}
+
+static uint64_t ata_deadline(void) {
+    return clock_ns() + (uint64_t)ATA_TIMEOUT_US * NSEC_PER_USEC;
+}
+
+static void ata_log_elapsed(const char* what, uint64_t start) {
+    char buf[12];
+    log(what);
+    int_to_chars((uint32_t)div_u64(clock_ns() - start, NSEC_PER_USEC), buf, sizeof(buf));
+    log_buffer(buf);
+    log(" us\n");
+}
 
 // Add these debug functions AFTER your existing utility functions (after int_to_chars, print, etc.)
 void print_ata_status(const char* context) {
@@ -26,17 +80,16 @@ void print_ata_status(const char* context) {
 static int ata_wait_bsy_clear(void) {
     uint8_t status;
     log("Waiting for BSY to clear...\n");
-    for (int i = 0; i < 100000; i++) {
+    uint64_t start = clock_ns();
+    uint64_t deadline = ata_deadline();
+    do {
         status = inb(ATA_PRIMARY_CMD + 7);
         if (!(status & 0x80)) {
-            log("BSY cleared after ");
-            char buf[12];
-            int_to_chars(i, buf, sizeof(buf));
-            log_buffer(buf);
-            log(" iterations\n");
+            ata_log_elapsed("BSY cleared after ", start);
             return 0;
         }
-    }
+        ata_sleep_while_busy(deadline);
+    } while (clock_ns() < deadline);
     log("BSY clear timeout! Final status: 0x");
     char hex[3];
     int_to_hex(status, hex);
@@ -48,17 +101,16 @@ static int ata_wait_bsy_clear(void) {
 static int ata_wait_drq_set(void) {
     uint8_t status;
     log("Waiting for DRQ to set...\n");
-    for (int i = 0; i < 100000; i++) {
+    uint64_t start = clock_ns();
+    uint64_t deadline = ata_deadline();
+    do {
         status = inb(ATA_PRIMARY_CMD + 7);
         if ((status & 0x08) && !(status & 0x80)) {
-            log("DRQ set after ");
-            char buf[12];
-            int_to_chars(i, buf, sizeof(buf));
-            log_buffer(buf);
-            log(" iterations\n");
+            ata_log_elapsed("DRQ set after ", start);
             return 0;
         }
-    }
+        ata_sleep_while_busy(deadline);
+    } while (clock_ns() < deadline);
     log("DRQ set timeout! Final status: 0x");
     char hex[3];
     int_to_hex(status, hex);
@@ -120,103 +172,125 @@ int ata_identify_drive(void) {
 
 int ata_wait_ready() {
     uint8_t status;
-    for (int i = 0; i < 100000; i++) {
+    uint64_t deadline = ata_deadline();
+    do {
         status = inb(ATA_PRIMARY_CMD + 7);
         if (!(status & 0x80) && (status & 0x08)) // BSY=0 and DRQ=1
             return 0; // ready
-    }
+    } while (clock_ns() < deadline);
     return -1; // timeout or error
 }
 
-int ata_read_sector(uint32_t lba, void* buffer) {
-    log("ATA read sector ");
+#define ATA_MAX_SECTORS_PER_CMD 256
+
+// Program drive/LBA/count registers for a 28-bit PIO command
+static void ata_setup_lba28(uint32_t lba, uint32_t count) {
+    // Select drive 0 with LBA mode
+    outb(0x1F6, 0xE0 | ((lba >> 24) & 0x0F));
+
+    // Let the drive settle after selection
+    udelay(ATA_SELECT_DELAY_US);
+
+    // Set sector count and LBA (a count of 0 means 256 sectors)
+    outb(0x1F2, (uint8_t)(count & 0xFF));      // sector count
+    outb(0x1F3, (uint8_t)(lba & 0xFF));        // LBA 0-7
+    outb(0x1F4, (uint8_t)((lba >> 8) & 0xFF));  // LBA 8-15
+    outb(0x1F5, (uint8_t)((lba >> 16) & 0xFF)); // LBA 16-23
+}
+
+// Read `count` consecutive sectors straight from the data port into `buffer`.
+// Large ranges are split into 256-sector commands; no intermediate copy.
+int ata_read_sectors(uint32_t lba, uint32_t count, void* buffer) {
+    log("ATA read ");
     char buf[12];
+    int_to_chars(count, buf, sizeof(buf));
+    log_buffer(buf);
+    log(" sectors at ");
     int_to_chars(lba, buf, sizeof(buf));
     log_buffer(buf);
     log("\n");
-    
-    // Wait for drive to be ready first
-    if (ata_wait_bsy_clear() != 0) {
-        log("Read: Initial BSY clear failed\n");
-        return -1;
-    }
 
-    // Select drive 0 with LBA mode
-    outb(0x1F6, 0xE0 | ((lba >> 24) & 0x0F));
-    
-    // Small delay after drive selection
-    for(int i = 0; i < 1000; i++) {
-        inb(0x1F7); // Status port read for delay
-    }
-    
-    // Set sector count and LBA
-    outb(0x1F2, 1);                           // sector count
-    outb(0x1F3, (uint8_t)(lba & 0xFF));       // LBA 0-7
-    outb(0x1F4, (uint8_t)((lba >> 8) & 0xFF)); // LBA 8-15
-    outb(0x1F5, (uint8_t)((lba >> 16) & 0xFF)); // LBA 16-23
-    
-    // Send READ SECTORS command
-    outb(0x1F7, 0x20);
+    uint8_t* dst = (uint8_t*)buffer;
+    while (count > 0) {
+        uint32_t n = (count < ATA_MAX_SECTORS_PER_CMD) ? count : ATA_MAX_SECTORS_PER_CMD;
 
-    print_ata_status("After read command");
+        // Wait for drive to be ready first
+        if (ata_wait_bsy_clear() != 0) {
+            log("Read: Initial BSY clear failed\n");
+            return -1;
+        }
 
-    if (ata_wait_drq_set() != 0) {
-        log("Read: DRQ set failed\n");
-        return -2;
-    }
+        ata_setup_lba28(lba, n);
+        outb(0x1F7, 0x20); // READ SECTORS command
 
-    // Read data
-    uint16_t* buf16 = (uint16_t*)buffer;
-    for (int i = 0; i < 256; i++) {
-        buf16[i] = inw(0x1F0); // Use explicit port instead of ATA_PRIMARY_CMD
+        for (uint32_t s = 0; s < n; s++) {
+            if (ata_wait_drq_set() != 0) {
+                log("Read: DRQ set failed\n");
+                return -2;
+            }
+            insw(ATA_PRIMARY_CMD, dst, 256);
+            dst += 512;
+        }
+
+        lba += n;
+        count -= n;
     }
-    
+
     log("Read completed successfully\n");
     return 0;
 }
 
-int ata_write_sector(uint32_t lba, const void* buffer) {
-    log("ATA write sector ");
+// Write `count` consecutive sectors straight from `buffer` to the data port,
+// flushing the drive cache once per command rather than once per sector.
+int ata_write_sectors(uint32_t lba, uint32_t count, const void* buffer) {
+    log("ATA write ");
     char buf[12];
+    int_to_chars(count, buf, sizeof(buf));
+    log_buffer(buf);
+    log(" sectors at ");
     int_to_chars(lba, buf, sizeof(buf));
     log_buffer(buf);
     log("\n");
-    
-    print_ata_status("Before write");
-    
-    if (ata_wait_bsy_clear() != 0) {
-        log("Write: BSY clear failed\n");
-        return -1;
-    }
 
-    // Select drive and set LBA
-    outb(0x1F6, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(0x1F2, 1);
-    outb(0x1F3, (uint8_t)(lba & 0xFF));
-    outb(0x1F4, (uint8_t)((lba >> 8) & 0xFF));
-    outb(0x1F5, (uint8_t)((lba >> 16) & 0xFF));
-    outb(0x1F7, 0x30); // WRITE SECTORS command
+    const uint8_t* src = (const uint8_t*)buffer;
+    while (count > 0) {
+        uint32_t n = (count < ATA_MAX_SECTORS_PER_CMD) ? count : ATA_MAX_SECTORS_PER_CMD;
 
-    print_ata_status("After write command");
+        if (ata_wait_bsy_clear() != 0) {
+            log("Write: BSY clear failed\n");
+            return -1;
+        }
 
-    if (ata_wait_drq_set() != 0) {
-        log("Write: DRQ set failed\n");
-        return -2;
-    }
+        ata_setup_lba28(lba, n);
+        outb(0x1F7, 0x30); // WRITE SECTORS command
 
+        for (uint32_t s = 0; s < n; s++) {
+            if (ata_wait_drq_set() != 0) {
+                log("Write: DRQ set failed\n");
+                return -2;
+            }
+            outsw(ATA_PRIMARY_CMD, src, 256);
+            src += 512;
+        }
 
-    // Write data
-    const uint16_t* buf16 = (const uint16_t*)buffer;
-    for (int i = 0; i < 256; i++) {
-        outw(ATA_PRIMARY_CMD, buf16[i]);
+        // Flush cache
+        outb(0x1F7, 0xE7);
+        ata_wait_bsy_clear();
+
+        lba += n;
+        count -= n;
     }
 
-    // Flush cache
-    outb(0x1F7, 0xE7);
-    ata_wait_bsy_clear();
-    
     log("Write completed successfully\n");
     return 0;
 }
 
+int ata_read_sector(uint32_t lba, void* buffer) {
+    return ata_read_sectors(lba, 1, buffer);
+}
+
+int ata_write_sector(uint32_t lba, const void* buffer) {
+    return ata_write_sectors(lba, 1, buffer);
+}
+
 #endif
@@ -0,0 +1,240 @@
+#ifndef FBCON_H
+#define FBCON_H
+
+#include <stdint.h>
+#include "helpers/basics.h"
+#include "helpers/serial.h"
+#include "helpers/paging.h"
+#include "structs/structs.h"
+
+// Console on a 32-bit linear framebuffer from GRUB. The console keeps the
+// text (helpers/basics.c); here every cell of the screen remembers what it
+// shows, so a flush only draws cells that changed, scrolling included, and
+// the framebuffer is never read back.
+#define FONT_WIDTH  8
+#define FONT_HEIGHT 16          // the 8x8 font with every row drawn twice
+#define FONT_FIRST  ' '
+#define FONT_LAST   '~'
+#define FONT_GLYPHS (FONT_LAST - FONT_FIRST + 1)
+#define FBCON_DEFAULT_ATTR 0x07
+
+// Leftmost pixel in the top bit, glyphs in columns 1-5 and rows 0-6, row 7
+// for descenders
+static const uint8_t font8x8[FONT_GLYPHS][8] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },   // ' '
+    { 0x10, 0x10, 0x10, 0x10, 0x10, 0x00, 0x10, 0x00 },   // '!'
+    { 0x28, 0x28, 0x28, 0x00, 0x00, 0x00, 0x00, 0x00 },   // '"'
+    { 0x28, 0x28, 0x7C, 0x28, 0x7C, 0x28, 0x28, 0x00 },   // '#'
+    { 0x10, 0x3C, 0x50, 0x38, 0x14, 0x78, 0x10, 0x00 },   // '$'
+    { 0x60, 0x64, 0x08, 0x10, 0x20, 0x4C, 0x0C, 0x00 },   // '%'
+    { 0x30, 0x48, 0x50, 0x20, 0x54, 0x48, 0x34, 0x00 },   // '&'
+    { 0x10, 0x10, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00 },   // '\''
+    { 0x08, 0x10, 0x20, 0x20, 0x20, 0x10, 0x08, 0x00 },   // '('
+    { 0x20, 0x10, 0x08, 0x08, 0x08, 0x10, 0x20, 0x00 },   // ')'
+    { 0x00, 0x10, 0x54, 0x38, 0x54, 0x10, 0x00, 0x00 },   // '*'
+    { 0x00, 0x10, 0x10, 0x7C, 0x10, 0x10, 0x00, 0x00 },   // '+'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x30, 0x10, 0x20 },   // ','
+    { 0x00, 0x00, 0x00, 0x7C, 0x00, 0x00, 0x00, 0x00 },   // '-'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x30, 0x30, 0x00 },   // '.'
+    { 0x00, 0x04, 0x08, 0x10, 0x20, 0x40, 0x00, 0x00 },   // '/'
+    { 0x38, 0x44, 0x4C, 0x54, 0x64, 0x44, 0x38, 0x00 },   // '0'
+    { 0x10, 0x30, 0x10, 0x10, 0x10, 0x10, 0x38, 0x00 },   // '1'
+    { 0x38, 0x44, 0x04, 0x08, 0x10, 0x20, 0x7C, 0x00 },   // '2'
+    { 0x7C, 0x08, 0x10, 0x08, 0x04, 0x44, 0x38, 0x00 },   // '3'
+    { 0x08, 0x18, 0x28, 0x48, 0x7C, 0x08, 0x08, 0x00 },   // '4'
+    { 0x7C, 0x40, 0x78, 0x04, 0x04, 0x44, 0x38, 0x00 },   // '5'
+    { 0x18, 0x20, 0x40, 0x78, 0x44, 0x44, 0x38, 0x00 },   // '6'
+    { 0x7C, 0x04, 0x08, 0x10, 0x20, 0x20, 0x20, 0x00 },   // '7'
+    { 0x38, 0x44, 0x44, 0x38, 0x44, 0x44, 0x38, 0x00 },   // '8'
+    { 0x38, 0x44, 0x44, 0x3C, 0x04, 0x08, 0x30, 0x00 },   // '9'
+    { 0x00, 0x30, 0x30, 0x00, 0x30, 0x30, 0x00, 0x00 },   // ':'
+    { 0x00, 0x30, 0x30, 0x00, 0x30, 0x10, 0x20, 0x00 },   // ';'
+    { 0x08, 0x10, 0x20, 0x40, 0x20, 0x10, 0x08, 0x00 },   // '<'
+    { 0x00, 0x00, 0x7C, 0x00, 0x7C, 0x00, 0x00, 0x00 },   // '='
+    { 0x20, 0x10, 0x08, 0x04, 0x08, 0x10, 0x20, 0x00 },   // '>'
+    { 0x38, 0x44, 0x04, 0x08, 0x10, 0x00, 0x10, 0x00 },   // '?'
+    { 0x38, 0x44, 0x04, 0x34, 0x54, 0x54, 0x38, 0x00 },   // '@'
+    { 0x38, 0x44, 0x44, 0x44, 0x7C, 0x44, 0x44, 0x00 },   // 'A'
+    { 0x78, 0x44, 0x44, 0x78, 0x44, 0x44, 0x78, 0x00 },   // 'B'
+    { 0x38, 0x44, 0x40, 0x40, 0x40, 0x44, 0x38, 0x00 },   // 'C'
+    { 0x70, 0x48, 0x44, 0x44, 0x44, 0x48, 0x70, 0x00 },   // 'D'
+    { 0x7C, 0x40, 0x40, 0x78, 0x40, 0x40, 0x7C, 0x00 },   // 'E'
+    { 0x7C, 0x40, 0x40, 0x78, 0x40, 0x40, 0x40, 0x00 },   // 'F'
+    { 0x38, 0x44, 0x40, 0x5C, 0x44, 0x44, 0x3C, 0x00 },   // 'G'
+    { 0x44, 0x44, 0x44, 0x7C, 0x44, 0x44, 0x44, 0x00 },   // 'H'
+    { 0x38, 0x10, 0x10, 0x10, 0x10, 0x10, 0x38, 0x00 },   // 'I'
+    { 0x1C, 0x08, 0x08, 0x08, 0x08, 0x48, 0x30, 0x00 },   // 'J'
+    { 0x44, 0x48, 0x50, 0x60, 0x50, 0x48, 0x44, 0x00 },   // 'K'
+    { 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x7C, 0x00 },   // 'L'
+    { 0x44, 0x6C, 0x54, 0x54, 0x44, 0x44, 0x44, 0x00 },   // 'M'
+    { 0x44, 0x44, 0x64, 0x54, 0x4C, 0x44, 0x44, 0x00 },   // 'N'
+    { 0x38, 0x44, 0x44, 0x44, 0x44, 0x44, 0x38, 0x00 },   // 'O'
+    { 0x78, 0x44, 0x44, 0x78, 0x40, 0x40, 0x40, 0x00 },   // 'P'
+    { 0x38, 0x44, 0x44, 0x44, 0x54, 0x48, 0x34, 0x00 },   // 'Q'
+    { 0x78, 0x44, 0x44, 0x78, 0x50, 0x48, 0x44, 0x00 },   // 'R'
+    { 0x3C, 0x40, 0x40, 0x38, 0x04, 0x04, 0x78, 0x00 },   // 'S'
+    { 0x7C, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00 },   // 'T'
+    { 0x44, 0x44, 0x44, 0x44, 0x44, 0x44, 0x38, 0x00 },   // 'U'
+    { 0x44, 0x44, 0x44, 0x44, 0x44, 0x28, 0x10, 0x00 },   // 'V'
+    { 0x44, 0x44, 0x44, 0x54, 0x54, 0x54, 0x28, 0x00 },   // 'W'
+    { 0x44, 0x44, 0x28, 0x10, 0x28, 0x44, 0x44, 0x00 },   // 'X'
+    { 0x44, 0x44, 0x44, 0x28, 0x10, 0x10, 0x10, 0x00 },   // 'Y'
+    { 0x7C, 0x04, 0x08, 0x10, 0x20, 0x40, 0x7C, 0x00 },   // 'Z'
+    { 0x38, 0x20, 0x20, 0x20, 0x20, 0x20, 0x38, 0x00 },   // '['
+    { 0x00, 0x40, 0x20, 0x10, 0x08, 0x04, 0x00, 0x00 },   // '\\'
+    { 0x38, 0x08, 0x08, 0x08, 0x08, 0x08, 0x38, 0x00 },   // ']'
+    { 0x10, 0x28, 0x44, 0x00, 0x00, 0x00, 0x00, 0x00 },   // '^'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7C, 0x00 },   // '_'
+    { 0x20, 0x10, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00 },   // '`'
+    { 0x00, 0x00, 0x38, 0x04, 0x3C, 0x44, 0x3C, 0x00 },   // 'a'
+    { 0x40, 0x40, 0x58, 0x64, 0x44, 0x44, 0x78, 0x00 },   // 'b'
+    { 0x00, 0x00, 0x38, 0x40, 0x40, 0x44, 0x38, 0x00 },   // 'c'
+    { 0x04, 0x04, 0x34, 0x4C, 0x44, 0x44, 0x3C, 0x00 },   // 'd'
+    { 0x00, 0x00, 0x38, 0x44, 0x7C, 0x40, 0x38, 0x00 },   // 'e'
+    { 0x18, 0x24, 0x20, 0x70, 0x20, 0x20, 0x20, 0x00 },   // 'f'
+    { 0x00, 0x00, 0x3C, 0x44, 0x44, 0x3C, 0x04, 0x38 },   // 'g'
+    { 0x40, 0x40, 0x58, 0x64, 0x44, 0x44, 0x44, 0x00 },   // 'h'
+    { 0x10, 0x00, 0x30, 0x10, 0x10, 0x10, 0x38, 0x00 },   // 'i'
+    { 0x08, 0x00, 0x18, 0x08, 0x08, 0x08, 0x48, 0x30 },   // 'j'
+    { 0x40, 0x40, 0x48, 0x50, 0x60, 0x50, 0x48, 0x00 },   // 'k'
+    { 0x30, 0x10, 0x10, 0x10, 0x10, 0x10, 0x38, 0x00 },   // 'l'
+    { 0x00, 0x00, 0x68, 0x54, 0x54, 0x44, 0x44, 0x00 },   // 'm'
+    { 0x00, 0x00, 0x58, 0x64, 0x44, 0x44, 0x44, 0x00 },   // 'n'
+    { 0x00, 0x00, 0x38, 0x44, 0x44, 0x44, 0x38, 0x00 },   // 'o'
+    { 0x00, 0x00, 0x78, 0x44, 0x44, 0x78, 0x40, 0x40 },   // 'p'
+    { 0x00, 0x00, 0x3C, 0x44, 0x44, 0x3C, 0x04, 0x04 },   // 'q'
+    { 0x00, 0x00, 0x58, 0x64, 0x40, 0x40, 0x40, 0x00 },   // 'r'
+    { 0x00, 0x00, 0x3C, 0x40, 0x38, 0x04, 0x78, 0x00 },   // 's'
+    { 0x20, 0x20, 0x70, 0x20, 0x20, 0x24, 0x18, 0x00 },   // 't'
+    { 0x00, 0x00, 0x44, 0x44, 0x44, 0x4C, 0x34, 0x00 },   // 'u'
+    { 0x00, 0x00, 0x44, 0x44, 0x44, 0x28, 0x10, 0x00 },   // 'v'
+    { 0x00, 0x00, 0x44, 0x44, 0x54, 0x54, 0x28, 0x00 },   // 'w'
+    { 0x00, 0x00, 0x44, 0x28, 0x10, 0x28, 0x44, 0x00 },   // 'x'
+    { 0x00, 0x00, 0x44, 0x44, 0x44, 0x3C, 0x04, 0x38 },   // 'y'
+    { 0x00, 0x00, 0x7C, 0x08, 0x10, 0x20, 0x7C, 0x00 },   // 'z'
+    { 0x08, 0x10, 0x10, 0x20, 0x10, 0x10, 0x08, 0x00 },   // '{'
+    { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00 },   // '|'
+    { 0x20, 0x10, 0x10, 0x08, 0x10, 0x10, 0x20, 0x00 },   // '}'
+    { 0x00, 0x00, 0x20, 0x54, 0x08, 0x00, 0x00, 0x00 },   // '~'
+};
+
+// VGA text attribute colours as 0xRRGGBB
+static const uint32_t vga_palette[16] = {
+    0x000000, 0x0000AA, 0x00AA00, 0x00AAAA, 0xAA0000, 0xAA00AA, 0xAA5500, 0xAAAAAA,
+    0x555555, 0x5555FF, 0x55FF55, 0x55FFFF, 0xFF5555, 0xFF55FF, 0xFFFF55, 0xFFFFFF,
+};
+
+static uint8_t* fb_base;
+static uint32_t fb_pitch;
+static int fb_cols, fb_rows;
+static uint32_t fb_colors[16];                                  // palette in the framebuffer's format
+static uint32_t fb_glyphs[FONT_GLYPHS][FONT_HEIGHT][FONT_WIDTH];   // default colours, ready to copy
+static uint16_t fb_shown[CONSOLE_MAX_ROWS][CONSOLE_MAX_COLS];   // 0 until drawn: cells always have an attribute
+static int fb_cursor_row = -1, fb_cursor_col;
+
+static uint32_t fb_pixel(multiboot_info_t* mb, uint32_t rgb) {
+    uint32_t r = (rgb >> 16) & 0xFF, g = (rgb >> 8) & 0xFF, b = rgb & 0xFF;
+    return ((r >> (8 - mb->framebuffer_red_size)) << mb->framebuffer_red_pos) |
+           ((g >> (8 - mb->framebuffer_green_size)) << mb->framebuffer_green_pos) |
+           ((b >> (8 - mb->framebuffer_blue_size)) << mb->framebuffer_blue_pos);
+}
+
+static inline volatile uint32_t* fb_cell(int row, int col) {
+    return (volatile uint32_t*)(fb_base + row * FONT_HEIGHT * fb_pitch) + col * FONT_WIDTH;
+}
+
+static inline volatile uint32_t* fb_next_line(volatile uint32_t* p) {
+    return (volatile uint32_t*)((volatile uint8_t*)p + fb_pitch);
+}
+
+static void fb_draw_cell(int row, int col, uint16_t cell) {
+    uint8_t c = cell & 0xFF, attr = cell >> 8;
+    if (c < FONT_FIRST || c > FONT_LAST) c = ' ';
+    volatile uint32_t* dst = fb_cell(row, col);
+
+    if (attr == FBCON_DEFAULT_ATTR) {
+        const uint32_t* src = fb_glyphs[c - FONT_FIRST][0];
+        for (int y = 0; y < FONT_HEIGHT; y++, src += FONT_WIDTH, dst = fb_next_line(dst))
+            for (int x = 0; x < FONT_WIDTH; x++) dst[x] = src[x];
+        return;
+    }
+    uint32_t fg = fb_colors[attr & 0xF], bg = fb_colors[attr >> 4];
+    for (int y = 0; y < FONT_HEIGHT; y++, dst = fb_next_line(dst)) {
+        uint8_t bits = font8x8[c - FONT_FIRST][y / 2];
+        for (int x = 0; x < FONT_WIDTH; x++) dst[x] = (bits & (0x80 >> x)) ? fg : bg;
+    }
+}
+
+static void fbcon_draw_row(int row, const uint16_t* cells, int cols) {
+    uint16_t* shown = fb_shown[row];
+    for (int c = 0; c < cols; c++) {
+        if (shown[c] == cells[c]) continue;
+        shown[c] = cells[c];
+        fb_draw_cell(row, c, cells[c]);
+    }
+}
+
+// An underline in the bottom two pixel rows of the cell
+static void fbcon_draw_cursor(int row, int col) {
+    if (fb_cursor_row >= 0)
+        fb_draw_cell(fb_cursor_row, fb_cursor_col, fb_shown[fb_cursor_row][fb_cursor_col]);
+    fb_cursor_row = -1;
+    if (row >= fb_rows) return;   // scrolled back past it
+
+    volatile uint32_t* dst = fb_cell(row, col);
+    for (int y = 0; y < FONT_HEIGHT - 2; y++) dst = fb_next_line(dst);
+    for (int y = 0; y < 2; y++, dst = fb_next_line(dst))
+        for (int x = 0; x < FONT_WIDTH; x++) dst[x] = fb_colors[FBCON_DEFAULT_ATTR];
+    fb_cursor_row = row;
+    fb_cursor_col = col;
+}
+
+// Move the console to GRUB's framebuffer if it set up a 32-bit RGB one.
+// Call after paging_init.
+int fbcon_init(multiboot_info_t* mb) {
+    if (!(mb->flags & MULTIBOOT_INFO_FRAMEBUFFER_INFO) ||
+        mb->framebuffer_type != MULTIBOOT_FRAMEBUFFER_TYPE_RGB || mb->framebuffer_bpp != 32 ||
+        (mb->framebuffer_addr >> 32) || mb->framebuffer_width < FONT_WIDTH || mb->framebuffer_height < FONT_HEIGHT)
+        return -1;
+
+    uint8_t* base = paging_map_wc((uint32_t)mb->framebuffer_addr, mb->framebuffer_pitch * mb->framebuffer_height);
+    if (!base) {
+        log("fbcon: can't map the framebuffer\n");
+        return -1;
+    }
+    fb_base = base;
+    fb_pitch = mb->framebuffer_pitch;
+    fb_cols = mb->framebuffer_width / FONT_WIDTH;
+    fb_rows = mb->framebuffer_height / FONT_HEIGHT;
+    if (fb_cols > CONSOLE_MAX_COLS) fb_cols = CONSOLE_MAX_COLS;
+    if (fb_rows > CONSOLE_MAX_ROWS) fb_rows = CONSOLE_MAX_ROWS;
+
+    for (int i = 0; i < 16; i++) fb_colors[i] = fb_pixel(mb, vga_palette[i]);
+    uint32_t fg = fb_colors[FBCON_DEFAULT_ATTR & 0xF], bg = fb_colors[FBCON_DEFAULT_ATTR >> 4];
+    for (int g = 0; g < FONT_GLYPHS; g++)
+        for (int y = 0; y < FONT_HEIGHT; y++)
+            for (int x = 0; x < FONT_WIDTH; x++)
+                fb_glyphs[g][y][x] = (font8x8[g][y / 2] & (0x80 >> x)) ? fg : bg;
+
+    // Whatever GRUB left there, including the margins no cell covers
+    for (uint32_t y = 0; y < mb->framebuffer_height; y++) {
+        volatile uint32_t* line = (volatile uint32_t*)(fb_base + y * fb_pitch);
+        for (uint32_t x = 0; x < mb->framebuffer_width; x++) line[x] = bg;
+    }
+
+    console_set_output(fb_cols, fb_rows, fbcon_draw_row, fbcon_draw_cursor);
+
+    char buf[12];
+    log("fbcon: ");
+    int_to_chars(mb->framebuffer_width, buf, sizeof(buf)); log(buf);
+    log("x");
+    int_to_chars(mb->framebuffer_height, buf, sizeof(buf)); log(buf);
+    log(", ");
+    int_to_chars(fb_cols, buf, sizeof(buf)); log(buf);
+    log(" columns, ");
+    int_to_chars(fb_rows, buf, sizeof(buf)); log(buf);
+    log(" rows\n");
+    return 0;
+}
+
+#endif
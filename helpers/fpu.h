@@ -0,0 +1,104 @@
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+#include "helpers/basics.h"
+#include "helpers/cpu.h"
+#include "helpers/heap.h"
+#include "helpers/percpu.h"
+#include "helpers/serial.h"
+#include "structs/structs.h"
+
+// Lazy FPU/SSE switching. Every switch leaves CR0.TS set, so a task's first
+// x87/SSE instruction in its slice traps (#NM) and only then is its state
+// loaded. A task that used the FPU is saved when it's switched out, while
+// its CPU still runs it, so the registers never hold state that exists
+// nowhere else and a task can move to another CPU at any time. If it comes
+// back to the same CPU with nobody else having used the FPU there, the
+// trap just clears TS.
+#define FPU_STATE_SIZE 512       // fxsave area (fnsave needs 108), 16-byte aligned as kmalloc gives it
+#define MXCSR_DEFAULT 0x1F80     // all SIMD exceptions masked
+
+// fnsave reinitializes the FPU, so without fxsave the state is put back
+static inline void fpu_save(uint8_t* area) {
+    if (fpu_fxsr) __asm__ volatile ("fxsave (%0)" : : "r"(area) : "memory");
+    else __asm__ volatile ("fnsave (%0); frstor (%0)" : : "r"(area) : "memory");
+}
+
+static inline void fpu_restore(const uint8_t* area) {
+    if (fpu_fxsr) __asm__ volatile ("fxrstor (%0)" : : "r"(area) : "memory");
+    else __asm__ volatile ("frstor (%0)" : : "r"(area) : "memory");
+}
+
+static inline void stts(void) {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+// The FPU is live for the running task: it used it this slice
+static inline int fpu_live(void) {
+    return !(read_cr0() & CR0_TS);
+}
+
+void user_fault_kill(void);
+
+// #NM: the current task wants the FPU
+void fpu_nm_handler(struct registers* r) {
+    Cpu* cpu = this_cpu();
+    Task* t = cpu->current;
+    if ((r->cs & 3) == 0 || t == &cpu->idle_task)
+        panic("FPU used by the kernel with CR0.TS set\n");
+
+    __asm__ volatile ("clts");
+    if (!t->fpu_state) {
+        // First use: a clean FPU, saved for the first time at switch out
+        t->fpu_state = kmalloc(FPU_STATE_SIZE);
+        if (!t->fpu_state) {
+            stts();
+            log("fpu: no memory for the FPU state\n");
+            user_fault_kill();
+            return;
+        }
+        __asm__ volatile ("fninit");
+        if (fpu_fxsr) {
+            uint32_t mxcsr = MXCSR_DEFAULT;
+            __asm__ volatile ("ldmxcsr %0" : : "m"(mxcsr));
+        }
+    } else if (cpu->fpu_owner != t || t->fpu_cpu != cpu->id) {
+        fpu_restore(t->fpu_state);
+    }
+    cpu->fpu_owner = t;
+    t->fpu_cpu = cpu->id;
+    cpu->fpu_loads++;
+}
+
+// On the way out of `prev`, before another CPU can pick it up
+static inline void fpu_switch_out(Task* prev) {
+    if (!fpu_live()) return;
+    if (prev->fpu_state) fpu_save(prev->fpu_state);
+    stts();
+}
+
+// The child starts from the parent's FPU state
+int fpu_fork(Task* parent, Task* child) {
+    child->fpu_state = NULL;
+    child->fpu_cpu = -1;
+    if (!parent->fpu_state) return 0;
+
+    if (parent == this_cpu()->current && fpu_live()) fpu_save(parent->fpu_state);
+    child->fpu_state = kmalloc(FPU_STATE_SIZE);
+    if (!child->fpu_state) return -1;
+    memcpy(child->fpu_state, parent->fpu_state, FPU_STATE_SIZE);
+    return 0;
+}
+
+// Drop the task's FPU state (exec, exit); the next use starts clean
+void fpu_release(Task* t) {
+    Cpu* cpu = this_cpu();
+    if (t == cpu->current && fpu_live()) stts();
+    if (cpu->fpu_owner == t) cpu->fpu_owner = NULL;
+    t->fpu_cpu = -1;
+    kfree(t->fpu_state);
+    t->fpu_state = NULL;
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef GDT_H
+#define GDT_H
+
+#include <stdint.h>
+#include "helpers/basics.h"
+
+#define GDT_ENTRIES 7
+#define KERNEL_CS 0x08
+#define KERNEL_DS 0x10
+#define USER_CS   0x1B   // entry 3, RPL 3
+#define USER_DS   0x23   // entry 4, RPL 3
+#define TSS_SEL   0x28
+#define PERCPU_SEL 0x30  // entry 6, based at this CPU's struct Cpu, kept in %gs
+
+struct GDTEntry {
+    uint16_t limit_low;
+    uint16_t base_low;
+    uint8_t  base_mid;
+    uint8_t  access;
+    uint8_t  granularity;
+    uint8_t  base_high;
+} __attribute__((packed));
+
+struct GDTDescriptor {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed));
+
+// Only ss0/esp0 matter: they're the stack the CPU switches to on a ring 3 -> 0 trap
+struct TSS {
+    uint32_t prev_tss;
+    uint32_t esp0, ss0;
+    uint32_t esp1, ss1;
+    uint32_t esp2, ss2;
+    uint32_t cr3, eip, eflags;
+    uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint32_t es, cs, ss, ds, fs, gs;
+    uint32_t ldt;
+    uint16_t trap, iomap_base;
+} __attribute__((packed));
+
+// Every CPU has its own GDT and TSS (they live in struct Cpu, percpu.h): the
+// TSS holds that CPU's esp0 and the per-CPU segment points at its data.
+static void gdt_set_entry(struct GDTEntry* gdt, int n, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
+    gdt[n].base_low = base & 0xFFFF;
+    gdt[n].base_mid = (base >> 16) & 0xFF;
+    gdt[n].base_high = (base >> 24) & 0xFF;
+    gdt[n].limit_low = limit & 0xFFFF;
+    gdt[n].granularity = ((limit >> 16) & 0x0F) | (gran & 0xF0);
+    gdt[n].access = access;
+}
+
+void gdt_install(struct GDTEntry* gdt, struct GDTDescriptor* gdtp, struct TSS* tss,
+                 uint32_t percpu_base, uint32_t percpu_size, uint32_t kernel_stack_top) {
+    gdt_set_entry(gdt, 0, 0, 0, 0, 0);                // Null
+    gdt_set_entry(gdt, 1, 0, 0xFFFFF, 0x9A, 0xCF);    // Kernel code
+    gdt_set_entry(gdt, 2, 0, 0xFFFFF, 0x92, 0xCF);    // Kernel data
+    gdt_set_entry(gdt, 3, 0, 0xFFFFF, 0xFA, 0xCF);    // User code
+    gdt_set_entry(gdt, 4, 0, 0xFFFFF, 0xF2, 0xCF);    // User data
+
+    memset(tss, 0, sizeof(*tss));
+    tss->ss0 = KERNEL_DS;
+    tss->esp0 = kernel_stack_top;
+    tss->iomap_base = sizeof(*tss);                   // no I/O permission bitmap
+    gdt_set_entry(gdt, 5, (uint32_t)tss, sizeof(*tss) - 1, 0x89, 0x00);
+    gdt_set_entry(gdt, 6, percpu_base, percpu_size - 1, 0x92, 0x40);   // Per-CPU data
+
+    gdtp->limit = sizeof(struct GDTEntry) * GDT_ENTRIES - 1;
+    gdtp->base = (uint32_t)gdt;
+
+    __asm__ volatile (
+        "lgdt %0\n"
+        "mov %1, %%ax\n"
+        "mov %%ax, %%ds\n"
+        "mov %%ax, %%es\n"
+        "mov %%ax, %%fs\n"
+        "mov %%ax, %%ss\n"
+        "mov %4, %%ax\n"
+        "mov %%ax, %%gs\n"
+        "ljmp %2, $1f\n"       // reload CS
+        "1:\n"
+        "ltr %w3\n"
+        :
+        : "m"(*gdtp), "i"(KERNEL_DS), "i"(KERNEL_CS), "r"(TSS_SEL), "i"(PERCPU_SEL)
+        : "eax", "memory"
+    );
+}
+
+#endif
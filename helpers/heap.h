@@ -0,0 +1,324 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "helpers/basics.h"
+#include "helpers/pmm.h"
+
+#define SLAB_MAGIC 0x51AB51AB
+#define SLAB_ALIGN 16
+#define SLAB_MAX_ORDER 3                // slabs span at most 8 pages
+#define SLAB_MIN_OBJECTS 8              // grow the slab until this many objects fit
+#define SLAB_KEEP_EMPTY 1               // empty slabs kept per cache before pages go back
+#define KMALLOC_MIN_SHIFT 4             // 16 bytes
+#define KMALLOC_MAX_SHIFT 11            // 2048 bytes, larger requests get whole pages
+#define KMALLOC_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+#define INITIAL_TABLE_SIZE 4            // first size of tables grown with grow_table
+
+typedef struct KmemCache KmemCache;
+
+// Lives at the start of the slab's first page, objects follow it
+typedef struct Slab {
+    uint32_t magic;
+    KmemCache* cache;
+    struct Slab* next;
+    struct Slab* prev;
+    void* freelist;      // free objects, linked through their first word
+    uint16_t inuse;
+    uint16_t total;
+} Slab;
+
+struct KmemCache {
+    const char* name;
+    uint32_t size;          // object size after alignment
+    uint32_t order;         // pages per slab = 2^order
+    uint32_t objs_per_slab;
+    void (*ctor)(void*);    // runs once when an object is first carved out of a slab
+    void (*dtor)(void*);    // runs when the slab's pages are handed back
+
+    Spinlock lock;          // slab lists and stats
+    Slab* partial;          // slabs with some free objects
+    Slab* full;
+    Slab* empty;
+    uint32_t empty_count;
+
+    // Usage stats
+    uint32_t active_objs;
+    uint32_t total_slabs;
+    uint32_t allocs;
+    uint32_t frees;
+
+    KmemCache* next_cache;
+};
+
+KmemCache* cache_list = NULL;
+KmemCache kmalloc_caches[KMALLOC_CLASSES];
+static const char* kmalloc_names[KMALLOC_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+uint32_t kmalloc_large_pages = 0;       // pages currently held by page-sized kmallocs
+
+static void slab_list_push(Slab** list, Slab* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+static void slab_list_remove(Slab** list, Slab* slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else *list = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+static uint32_t slab_header_size(void) {
+    return align_up(sizeof(Slab), SLAB_ALIGN);
+}
+
+void kmem_cache_init(KmemCache* cache, const char* name, uint32_t size,
+                     void (*ctor)(void*), void (*dtor)(void*)) {
+    memset(cache, 0, sizeof(KmemCache));
+    cache->name = name;
+    cache->size = align_up(size < sizeof(void*) ? sizeof(void*) : size, SLAB_ALIGN);
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+
+    // Smallest slab that holds a reasonable number of objects
+    cache->order = 0;
+    while (cache->order < SLAB_MAX_ORDER &&
+           ((PAGE_SIZE << cache->order) - slab_header_size()) / cache->size < SLAB_MIN_OBJECTS)
+        cache->order++;
+    cache->objs_per_slab = ((PAGE_SIZE << cache->order) - slab_header_size()) / cache->size;
+
+    cache->next_cache = cache_list;
+    cache_list = cache;
+}
+
+static Slab* kmem_cache_grow(KmemCache* cache) {
+    uint32_t phys = pmm_alloc_pages(cache->order);
+    if (!phys) return NULL;
+
+    // Every page of the slab points back at its header so kfree can find it
+    uint32_t first = phys_to_frame(phys);
+    for (uint32_t i = 0; i < (1u << cache->order); i++) {
+        frames[first + i].flags |= FRAME_SLAB;
+        frames[first + i].owner = phys;
+    }
+
+    Slab* slab = (Slab*)phys_to_virt(phys);
+    slab->magic = SLAB_MAGIC;
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->total = cache->objs_per_slab;
+    slab->freelist = NULL;
+
+    // Build the freelist back to front so objects come out in address order
+    uint8_t* base = (uint8_t*)slab + slab_header_size();
+    for (int i = cache->objs_per_slab - 1; i >= 0; i--) {
+        void* obj = base + i * cache->size;
+        if (cache->ctor) cache->ctor(obj);
+        *(void**)obj = slab->freelist;
+        slab->freelist = obj;
+    }
+
+    cache->total_slabs++;
+    return slab;
+}
+
+static void kmem_cache_release(KmemCache* cache, Slab* slab) {
+    if (cache->dtor) {
+        uint8_t* base = (uint8_t*)slab + slab_header_size();
+        for (uint32_t i = 0; i < cache->objs_per_slab; i++)
+            cache->dtor(base + i * cache->size);
+    }
+
+    uint32_t phys = virt_to_phys(slab);
+    uint32_t first = phys_to_frame(phys);
+    for (uint32_t i = 0; i < (1u << cache->order); i++) {
+        frames[first + i].flags &= ~FRAME_SLAB;
+        frames[first + i].owner = 0;
+    }
+    cache->total_slabs--;
+    pmm_free_pages(phys, cache->order);
+}
+
+// Objects come back in whatever state they were freed in, apart from the first
+// word. Callers return them to their constructed state so allocation doesn't
+// have to redo the setup.
+void* kmem_cache_alloc(KmemCache* cache) {
+    spin_lock(&cache->lock);
+    Slab* slab = cache->partial;
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            slab_list_remove(&cache->empty, slab);
+            cache->empty_count--;
+        } else {
+            slab = kmem_cache_grow(cache);
+            if (!slab) {
+                spin_unlock(&cache->lock);
+                return NULL;
+            }
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    void* obj = slab->freelist;
+    slab->freelist = *(void**)obj;
+    slab->inuse++;
+    if (slab->inuse == slab->total) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    // The freelist link lives in the first word, hand it out zeroed
+    *(void**)obj = NULL;
+    cache->active_objs++;
+    cache->allocs++;
+    spin_unlock(&cache->lock);
+    return obj;
+}
+
+static Slab* slab_of(const void* obj) {
+    uint32_t frame = phys_to_frame(virt_to_phys(obj));
+    if (frame >= frame_count || !(frames[frame].flags & FRAME_SLAB)) return NULL;
+    return (Slab*)phys_to_virt(frames[frame].owner);
+}
+
+void kmem_cache_free(KmemCache* cache, void* obj) {
+    if (!obj) return;
+    Slab* slab = slab_of(obj);
+    if (!slab || slab->magic != SLAB_MAGIC || slab->cache != cache) {
+        log("kmem_cache_free: object not from this cache\n");
+        return;
+    }
+
+    spin_lock(&cache->lock);
+    if (slab->inuse == slab->total) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+
+    *(void**)obj = slab->freelist;
+    slab->freelist = obj;
+    slab->inuse--;
+    cache->active_objs--;
+    cache->frees++;
+
+    if (slab->inuse == 0) {
+        slab_list_remove(&cache->partial, slab);
+        if (cache->empty_count < SLAB_KEEP_EMPTY) {
+            slab_list_push(&cache->empty, slab);
+            cache->empty_count++;
+        } else {
+            kmem_cache_release(cache, slab);
+        }
+    }
+    spin_unlock(&cache->lock);
+}
+
+void heap_init(void) {
+    for (int i = 0; i < KMALLOC_CLASSES; i++)
+        kmem_cache_init(&kmalloc_caches[i], kmalloc_names[i], 1u << (KMALLOC_MIN_SHIFT + i), NULL, NULL);
+}
+
+void* kmalloc(size_t size) {
+    if (size == 0) return NULL;
+
+    if (size <= (1u << KMALLOC_MAX_SHIFT)) {
+        int cls = 0;
+        while ((1u << (KMALLOC_MIN_SHIFT + cls)) < size) cls++;
+        return kmem_cache_alloc(&kmalloc_caches[cls]);
+    }
+
+    // Big requests get their own run of pages, the order is kept in the frame
+    uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t order = pmm_order_for(pages);
+    uint32_t phys = pmm_alloc_pages(order);
+    if (!phys) return NULL;
+
+    frames[phys_to_frame(phys)].flags |= FRAME_KMALLOC;
+    __atomic_add_fetch(&kmalloc_large_pages, 1u << order, __ATOMIC_RELAXED);
+    return phys_to_virt(phys);
+}
+
+void* kzalloc(size_t size) {
+    void* p = kmalloc(size);
+    if (p) memset(p, 0, size);
+    return p;
+}
+
+static size_t ksize(const void* ptr) {
+    Slab* slab = slab_of(ptr);
+    if (slab) return slab->cache->size;
+    return (size_t)PAGE_SIZE << frames[phys_to_frame(virt_to_phys(ptr))].order;
+}
+
+void kfree(void* ptr) {
+    if (!ptr) return;
+
+    Slab* slab = slab_of(ptr);
+    if (slab) {
+        kmem_cache_free(slab->cache, ptr);
+        return;
+    }
+
+    uint32_t frame = phys_to_frame(virt_to_phys(ptr));
+    if (frame >= frame_count || !(frames[frame].flags & FRAME_KMALLOC)) {
+        log("kfree: bad pointer\n");
+        return;
+    }
+    frames[frame].flags &= ~FRAME_KMALLOC;
+    __atomic_sub_fetch(&kmalloc_large_pages, 1u << frames[frame].order, __ATOMIC_RELAXED);
+    pmm_free_pages(virt_to_phys(ptr), frames[frame].order);
+}
+
+void* krealloc(void* ptr, size_t size) {
+    if (!ptr) return kmalloc(size);
+    size_t old = ksize(ptr);
+    if (size <= old) return ptr;
+
+    void* p = kmalloc(size);
+    if (!p) return NULL;
+    memcpy(p, ptr, old);
+    kfree(ptr);
+    return p;
+}
+
+// Double a pointer table, new slots start out empty
+int grow_table(void*** table, int* capacity) {
+    int new_capacity = *capacity ? *capacity * 2 : INITIAL_TABLE_SIZE;
+    void** grown = krealloc(*table, new_capacity * sizeof(void*));
+    if (!grown) return -1;
+    memset(grown + *capacity, 0, (new_capacity - *capacity) * sizeof(void*));
+    *table = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+void kmem_dump_stats(void) {
+    char buf[12];
+    for (KmemCache* c = cache_list; c; c = c->next_cache) {
+        if (c->total_slabs == 0 && c->allocs == 0) continue;
+        log(c->name);
+        log(": obj ");
+        int_to_chars(c->size, buf, sizeof(buf)); log_buffer(buf);
+        log(" active ");
+        int_to_chars(c->active_objs, buf, sizeof(buf)); log_buffer(buf);
+        log(" slabs ");
+        int_to_chars(c->total_slabs, buf, sizeof(buf)); log_buffer(buf);
+        log(" allocs ");
+        int_to_chars(c->allocs, buf, sizeof(buf)); log_buffer(buf);
+        log(" frees ");
+        int_to_chars(c->frees, buf, sizeof(buf)); log_buffer(buf);
+        log("\n");
+    }
+    log("kmalloc pages: ");
+    int_to_chars(kmalloc_large_pages, buf, sizeof(buf)); log_buffer(buf);
+    log("\n");
+}
+
+#endif
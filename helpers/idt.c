@@ -1,3 +1,4 @@
+
 #include "idt.h"
 #include <string.h> // For memset
 
@@ -16,6 +17,15 @@ void idt_install() {
     idtp.limit = sizeof(idt) - 1;
     idtp.base = (uint32_t)&idt;
     memset(&idt, 0, sizeof(idt));
+
+    // CPU exceptions: ring 0 interrupt gates
+    for (int i = 0; i < 32; i++)
+        idt_set_gate(i, isr_stub_table[i], 0x08, 0x8E);
+
+    // Remapped PIC IRQs
+    for (int i = 0; i < 16; i++)
+        idt_set_gate(32 + i, irq_stub_table[i], 0x08, 0x8E);
+
     idt_load();
 }
 
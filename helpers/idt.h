@@ -23,6 +23,8 @@ extern struct IDTDescriptor idtp;
 void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags);
 void idt_install();
 void idt_load(); // Implemented in assembly
+extern uint32_t isr_stub_table[32]; // isr_stubs.asm, one entry per CPU exception
+extern uint32_t irq_stub_table[16]; // isr_stubs.asm, PIC IRQs 0-15
 
 #endif
 
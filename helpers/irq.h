@@ -0,0 +1,118 @@
+#ifndef IRQ_H
+#define IRQ_H
+
+#include <stdint.h>
+#include "helpers/basics.h"
+#include "helpers/serial.h"
+#include "helpers/cpu.h"
+#include "helpers/percpu.h"
+#include "helpers/pic.h"
+#include "helpers/apic.h"
+#include "helpers/timer.h"
+#include "structs/registers.h"
+#include "structs/interrupts.h"
+
+#define PIC_SPURIOUS_MASTER 7
+#define PIC_SPURIOUS_SLAVE  15
+
+void (*interrupt_handlers[MAX_INTERRUPTS])(struct registers *);   // dispatched through irq_dispatch
+uint32_t irq_spurious = 0;
+
+void register_interrupt_handler(int n, void (*handler)(struct registers *r)) {
+    if (n >= 0 && n < MAX_INTERRUPTS) {
+        interrupt_handlers[n] = handler;
+    }
+}
+
+// Acknowledge a hardware interrupt before its handler runs: the handler may
+// switch tasks and not return for a while, and with IF clear in the kernel
+// nothing can nest meanwhile. -1 for a spurious one, which has no handler.
+static int irq_ack(uint32_t vector) {
+    if (vector == SPURIOUS_VECTOR) return -1;           // local APIC: never acknowledged
+    if (vector == APIC_TIMER_VECTOR || vector == RESCHED_VECTOR) {
+        lapic_eoi();   // the reschedule IPI has no handler, it only ends a hlt
+        return 0;
+    }
+    if (vector < IRQ_BASE || vector >= IRQ_BASE + 16) return 0;   // exception or syscall
+
+    uint8_t irq = vector - IRQ_BASE;
+    if (!apic_enabled && (irq == PIC_SPURIOUS_MASTER || irq == PIC_SPURIOUS_SLAVE) &&
+        !(pic_read_isr() & (1u << irq))) {
+        // The 8259 raised it without an IRQ in service. The slave's still
+        // went through the cascade, which the master wants acknowledged.
+        if (irq == PIC_SPURIOUS_SLAVE) pic_send_eoi(0);
+        return -1;
+    }
+    irq_eoi(irq);
+    return 0;
+}
+
+// Cycles go to the vector in progress on this CPU until its handler returns
+// or schedule() switches away (irq_account_switch): time other tasks run
+// isn't charged to the interrupt that preempted them.
+static inline void irq_charge(Cpu* cpu, uint64_t now) {
+    if (cpu->irq_vector >= 0) cpu->irq_stats[cpu->irq_vector].cycles += now - cpu->irq_start;
+}
+
+void irq_account_switch(Cpu* cpu) {
+    irq_charge(cpu, rdtsc());
+    cpu->irq_vector = -1;
+}
+
+// Called by isr_handler (isr.c) for every vector. Returns 0 only for an
+// exception nobody registered a handler for.
+int irq_dispatch(struct registers* r) {
+    uint32_t vector = r->int_no;
+    Cpu* cpu = this_cpu();
+    uint64_t now = rdtsc();
+    int outer = cpu->irq_vector;                // an exception inside a handler pauses its clock
+    irq_charge(cpu, now);
+    cpu->irq_vector = vector;
+    cpu->irq_start = now;
+    cpu->irq_stats[vector].count++;
+
+    int handled = 1;
+    if (irq_ack(vector) != 0) __atomic_add_fetch(&irq_spurious, 1, __ATOMIC_RELAXED);
+    else if (interrupt_handlers[vector]) interrupt_handlers[vector](r);
+    else handled = vector >= 32;                // masked or unexpected IRQs are just dropped
+
+    cpu = this_cpu();                           // the handler may have come back on another CPU
+    now = rdtsc();
+    if (cpu->irq_vector == (int)vector) irq_charge(cpu, now);
+    cpu->irq_vector = outer;
+    cpu->irq_start = now;
+    return handled;
+}
+
+// Totals for one vector over all CPUs
+int irq_get_stats(uint32_t vector, IrqStat* out) {
+    if (vector >= MAX_INTERRUPTS) return -1;
+    out->count = 0;
+    out->cycles = 0;
+    for (int i = 0; i < cpu_count; i++) {
+        out->count += cpus[i].irq_stats[vector].count;
+        out->cycles += cpus[i].irq_stats[vector].cycles;
+    }
+    return 0;
+}
+
+void irq_dump_stats(void) {
+    char buf[12];
+    for (uint32_t v = 0; v < MAX_INTERRUPTS; v++) {
+        IrqStat s;
+        irq_get_stats(v, &s);
+        if (!s.count) continue;
+        log("irq: vector ");
+        int_to_chars(v, buf, sizeof(buf)); log_buffer(buf);
+        log(" count ");
+        int_to_chars(s.count, buf, sizeof(buf)); log_buffer(buf);
+        log(" avg cycles ");
+        int_to_chars((uint32_t)div_u64(s.cycles, s.count), buf, sizeof(buf)); log_buffer(buf);
+        log("\n");
+    }
+    log("irq: spurious ");
+    int_to_chars(irq_spurious, buf, sizeof(buf)); log_buffer(buf);
+    log("\n");
+}
+
+#endif
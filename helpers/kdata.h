@@ -0,0 +1,82 @@
+#ifndef KDATA_H
+#define KDATA_H
+
+#include <stdint.h>
+#include "helpers/basics.h"
+#include "helpers/pmm.h"
+#include "helpers/paging.h"
+#include "helpers/timer.h"
+#include "structs/structs.h"
+#include "structs/kernel_data.h"
+
+extern volatile uint32_t nr_tasks;   // sched.h
+
+// The kernel's view of the shared read-only page, through the physmap.
+// Every address space holds a reference on its frame.
+KernelData* kdata = NULL;
+static uint32_t kdata_phys = 0;
+
+// Once the clock is calibrated and the APs are up
+void kdata_init(void) {
+    kdata_phys = pmm_alloc_frame();
+    if (!kdata_phys) panic("kdata: out of memory\n");
+    kdata = (KernelData*)phys_to_virt(kdata_phys);
+    memset(kdata, 0, PAGE_SIZE);
+
+    kdata->version = KDATA_VERSION;
+    kdata->tsc_khz = tsc_khz;
+    kdata->tsc_ns_mult = tsc_ns_mult;
+    kdata->tick_ns = NSEC_PER_TICK;
+    kdata->clock_base_tsc = clock_base_tsc;
+    kdata->cpu_count = cpu_count;
+}
+
+// Boot CPU tick: refresh the counters that don't change on their own path
+static inline void kdata_tick(void) {
+    if (!kdata) return;
+    kdata->ticks = timer_ticks;
+    kdata->nr_tasks = nr_tasks;
+}
+
+// Map the shared page and a fresh task page into `pd` for task `t`. A page
+// inherited through fork is replaced, the child must not see the parent's.
+int kdata_map(Task* t, uint32_t* pd) {
+    uint32_t* pte = get_pte(pd, USER_KDATA_ADDR, 1);
+    if (!pte) return -1;
+    if (!(*pte & PTE_PRESENT)) {
+        pmm_frame_get(kdata_phys);
+        *pte = kdata_phys | PTE_PRESENT | PTE_USER;
+    }
+
+    uint32_t frame = pmm_alloc_frame();
+    if (!frame) return -1;
+    TaskData* td = (TaskData*)phys_to_virt(frame);
+    memset(td, 0, PAGE_SIZE);
+    td->task_id = t->id;
+    td->cpu = t->cpu;
+
+    pte = get_pte(pd, USER_TASKDATA_ADDR, 1);
+    if (!pte) {
+        pmm_free_frame(frame);
+        return -1;
+    }
+    if (*pte & PTE_PRESENT) pmm_frame_put(*pte & ~0xFFF);
+    *pte = frame | PTE_PRESENT | PTE_USER;
+    if (pd == current_page_dir) {
+        invlpg(USER_KDATA_ADDR);
+        invlpg(USER_TASKDATA_ADDR);
+    }
+    t->task_data = td;
+    return 0;
+}
+
+// Switching to `t` on `cpu`
+static inline void kdata_switch_in(Task* t, Cpu* cpu) {
+    if (t->task_data) {
+        t->task_data->cpu = cpu->id;
+        t->task_data->switches++;
+    }
+    if (kdata) __atomic_add_fetch(&kdata->context_switches, 1, __ATOMIC_RELAXED);
+}
+
+#endif
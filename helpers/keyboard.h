@@ -0,0 +1,156 @@
+#ifndef KEYBOARD_H
+#define KEYBOARD_H
+
+#include <stdint.h>
+#include "helpers/port_io.h"
+#include "helpers/apic.h"
+#include "helpers/pic.h"
+#include "helpers/sched.h"
+#include "structs/structs.h"
+
+#define KBD_DATA_PORT 0x60
+#define KBD_BUFFER_SIZE 256
+#define VIDEO_HALF_PAGE 12   // console lines per Shift+PgUp
+
+// PS/2 scancode set 1
+#define SC_RELEASE  0x80
+#define SC_EXTENDED 0xE0
+#define SC_LCTRL    0x1D
+#define SC_LSHIFT   0x2A
+#define SC_RSHIFT   0x36
+#define SC_LALT     0x38
+#define SC_CAPSLOCK 0x3A
+#define SC_ENTER    0x1C
+#define SC_SLASH    0x35
+#define SC_PGUP     0x49   // after 0xE0
+#define SC_PGDN     0x51
+
+#define KBD_SHIFT 0x1
+#define KBD_CTRL  0x2
+#define KBD_ALT   0x4
+#define KBD_CAPS  0x8
+
+char scancode_to_ascii[128] = {
+    0, 27, '1','2','3','4','5','6','7','8','9','0','-','=', '\b',
+    '\t','q','w','e','r','t','y','u','i','o','p','[',']','\n',
+    0,'a','s','d','f','g','h','j','k','l',';','\'','`',
+    0,'\\','z','x','c','v','b','n','m',',','.','/',
+    0,'*',0,' ',
+};
+
+char scancode_to_ascii_shift[128] = {
+    0, 27, '!','@','#','$','%','^','&','*','(',')','_','+', '\b',
+    '\t','Q','W','E','R','T','Y','U','I','O','P','{','}','\n',
+    0,'A','S','D','F','G','H','J','K','L',':','"','~',
+    0,'|','Z','X','C','V','B','N','M','<','>','?',
+    0,'*',0,' ',
+};
+
+// Characters queued by IRQ1 until a reader takes them. The handler is the
+// only producer (IRQ1 goes to the boot CPU) and publishes kbd_head; readers
+// on any CPU claim slots by advancing kbd_tail with a compare-and-swap, so
+// neither side takes a lock for the ring itself.
+static char kbd_buffer[KBD_BUFFER_SIZE];
+static volatile uint32_t kbd_head = 0, kbd_tail = 0;
+static uint32_t kbd_mods = 0;          // only touched by the handler
+static int kbd_extended = 0;           // last byte was the 0xE0 prefix
+uint32_t kbd_dropped = 0;              // characters lost to a full ring
+WaitQueue kbd_queue;                   // readers waiting for a key
+
+// Character for a key press with the current modifiers, 0 for none
+static char kbd_translate(uint8_t code) {
+    if (kbd_extended) {
+        // Keypad Enter and '/' are the only extended keys that type something
+        if (code == SC_ENTER) return '\n';
+        if (code == SC_SLASH) return '/';
+        return 0;
+    }
+
+    char c = (kbd_mods & KBD_SHIFT) ? scancode_to_ascii_shift[code] : scancode_to_ascii[code];
+    int letter = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    if (letter && (kbd_mods & KBD_CAPS)) c ^= 0x20;
+    if (kbd_mods & KBD_CTRL) {
+        if (letter) return c & 0x1F;     // Ctrl-A is 1 ... Ctrl-Z is 26
+        if (c == '[') return 27;
+        if (c == '\\') return 28;
+        if (c == ']') return 29;
+    }
+    return c;
+}
+
+// Returns 1 if `code` was a modifier key, updating the state
+static int kbd_modifier(uint8_t code, int released) {
+    uint32_t bit;
+    switch (code) {
+        case SC_LSHIFT: case SC_RSHIFT:
+            bit = kbd_extended ? 0 : KBD_SHIFT;   // E0 2A/E0 36 are fake shifts around some keys
+            break;
+        case SC_LCTRL: bit = KBD_CTRL; break;     // E0 1D is right ctrl
+        case SC_LALT:  bit = KBD_ALT; break;      // E0 38 is right alt
+        case SC_CAPSLOCK:
+            if (!released) kbd_mods ^= KBD_CAPS;
+            return 1;
+        default:
+            return 0;
+    }
+    if (released) kbd_mods &= ~bit;
+    else kbd_mods |= bit;
+    return 1;
+}
+
+void keyboard_irq_handler(struct registers* r) {
+    uint8_t scancode = inb(KBD_DATA_PORT);
+
+    if (scancode == SC_EXTENDED) {
+        kbd_extended = 1;
+        return;
+    }
+    int released = scancode & SC_RELEASE;
+    uint8_t code = scancode & ~SC_RELEASE;
+    // Shift+PgUp/PgDn page through the console history
+    if (kbd_extended && !released && (kbd_mods & KBD_SHIFT) && (code == SC_PGUP || code == SC_PGDN)) {
+        console_scrollback(code == SC_PGUP ? VIDEO_HALF_PAGE : -VIDEO_HALF_PAGE);
+        kbd_extended = 0;
+        return;
+    }
+    char c = 0;
+    if (!kbd_modifier(code, released) && !released) c = kbd_translate(code);
+    kbd_extended = 0;
+    if (!c || (kbd_mods & KBD_ALT)) return;
+
+    uint32_t head = kbd_head;
+    if (head - __atomic_load_n(&kbd_tail, __ATOMIC_ACQUIRE) >= KBD_BUFFER_SIZE) {
+        kbd_dropped++;
+        return;
+    }
+    kbd_buffer[head % KBD_BUFFER_SIZE] = c;
+    __atomic_store_n(&kbd_head, head + 1, __ATOMIC_RELEASE);
+    wake_up(&kbd_queue);
+}
+
+// Take the oldest character, 0 if the ring is empty
+static char kbd_take(void) {
+    uint32_t tail = __atomic_load_n(&kbd_tail, __ATOMIC_ACQUIRE);
+    while (tail != __atomic_load_n(&kbd_head, __ATOMIC_ACQUIRE)) {
+        char c = kbd_buffer[tail % KBD_BUFFER_SIZE];   // the handler won't reuse the slot before we advance
+        if (__atomic_compare_exchange_n(&kbd_tail, &tail, tail + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return c;
+    }
+    return 0;
+}
+
+// Sleeps until a key is pressed, 0 if the task is killed meanwhile. The
+// queue lock is only there so a wakeup can't slip in between the last look
+// at the ring and going to sleep.
+char getpress() {
+    for (;;) {
+        char c = kbd_take();
+        if (c || task_killed()) return c;
+
+        spin_lock(&kbd_queue.lock);
+        if (kbd_head == kbd_tail && !task_killed()) sleep_on(&kbd_queue, &kbd_queue.lock);
+        spin_unlock(&kbd_queue.lock);
+    }
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef MEMBENCH_H
+#define MEMBENCH_H
+
+#include <stdint.h>
+#include "helpers/basics.h"
+#include "helpers/cpu.h"
+#include "helpers/heap.h"
+#include "helpers/serial.h"
+#include "helpers/timer.h"
+
+// Boot-time microbenchmark of the memcpy/memset/strlen variants in
+// helpers/basics.c, logged as bytes per cycle. Only run in a MEMBENCH=1 build. Each figure is the best of a
+// few runs, so an interrupt or a cold cache in one of them doesn't count.
+#define MEMBENCH_SIZE 65536
+#define MEMBENCH_RUNS 8
+
+typedef struct {
+    const char* name;
+    void* (*copy)(void*, const void*, size_t);
+    void* (*set)(void*, int, size_t);
+    int (*len)(const char*);
+} MemBenchVariant;
+
+static const MemBenchVariant membench_variants[] = {
+    { "bytes", memcpy_bytes, memset_bytes, strlen_bytes },
+    { "rep",   memcpy_rep,   memset_rep,   NULL },
+    { "sse2",  memcpy_sse2,  memset_sse2,  NULL },
+    { "word",  NULL,         NULL,         strlen },
+};
+
+static const uint32_t membench_sizes[] = { 64, 1024, 4096, MEMBENCH_SIZE };
+static volatile int membench_sink;   // keeps the strlen calls
+
+// "<whole>.<hundredths>" bytes per cycle
+static void membench_report(const char* op, const char* variant, uint32_t size, uint64_t cycles) {
+    char buf[12];
+    uint32_t rate = cycles ? (uint32_t)div_u64((uint64_t)size * 100, (uint32_t)cycles) : 0;
+    log("membench: ");
+    log(op);
+    log(" ");
+    log(variant);
+    log(" ");
+    int_to_chars(size, buf, sizeof(buf)); log(buf);
+    log(" B: ");
+    int_to_chars(rate / 100, buf, sizeof(buf)); log(buf);
+    log(".");
+    if (rate % 100 < 10) log("0");
+    int_to_chars(rate % 100, buf, sizeof(buf)); log(buf);
+    log(" B/cycle\n");
+}
+
+#define MEMBENCH_TIME(best, expr) do {                        \
+        (best) = ~0ull;                                       \
+        for (int run = 0; run < MEMBENCH_RUNS; run++) {       \
+            uint64_t start = rdtsc();                         \
+            expr;                                             \
+            uint64_t took = rdtsc() - start;                  \
+            if (took < (best)) (best) = took;                 \
+        }                                                     \
+    } while (0)
+
+void mem_benchmark(void) {
+    uint8_t* src = kmalloc(MEMBENCH_SIZE + 16);
+    uint8_t* dst = kmalloc(MEMBENCH_SIZE + 16);
+    if (!src || !dst) {
+        log("membench: no memory\n");
+        if (src) kfree(src);
+        if (dst) kfree(dst);
+        return;
+    }
+    // An unterminated run of bytes for strlen, ended at each size below
+    memset_rep(src, 'a', MEMBENCH_SIZE + 16);
+    uint32_t has_sse2 = (read_cr4() & CR4_OSFXSR) != 0;
+
+    for (uint32_t v = 0; v < sizeof(membench_variants) / sizeof(membench_variants[0]); v++) {
+        const MemBenchVariant* m = &membench_variants[v];
+        if (m->copy == memcpy_sse2 && !has_sse2) continue;
+        for (uint32_t i = 0; i < sizeof(membench_sizes) / sizeof(membench_sizes[0]); i++) {
+            uint32_t size = membench_sizes[i];
+            uint64_t best;
+            if (m->copy) {
+                MEMBENCH_TIME(best, m->copy(dst, src, size));
+                membench_report("memcpy", m->name, size, best);
+            }
+            if (m->set) {
+                MEMBENCH_TIME(best, m->set(dst, 0, size));
+                membench_report("memset", m->name, size, best);
+            }
+            if (m->len) {
+                src[size] = '\0';
+                MEMBENCH_TIME(best, membench_sink = m->len((const char*)src));
+                membench_report("strlen", m->name, size, best);
+                src[size] = 'a';
+            }
+        }
+    }
+    log("membench: using ");
+    log(mem_variant);
+    log("\n");
+    kfree(src);
+    kfree(dst);
+}
+
+#endif
@@ -0,0 +1,368 @@
+#ifndef PAGING_H
+#define PAGING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "helpers/basics.h"
+#include "helpers/cpu.h"
+#include "helpers/pmm.h"
+#include "helpers/percpu.h"
+#include "helpers/spinlock.h"
+#include "structs/registers.h"
+
+#define USER_PROG_LOAD_ADDR 0x400000
+#define USER_STACK_TOP      0x800000
+#define USER_STACK_MAX      0x100000     // stack pages are faulted in on demand below the top
+#define USER_IO_RING_ADDR   0xC00000     // io_setup rings
+#define USER_SHM_BASE       0x10000000   // shared memory segment i at + i * SHM_MAX_SIZE
+#define USER_SPACE_END      PHYS_MAP_BASE
+
+#define PTE_PRESENT  0x001
+#define PTE_WRITE    0x002
+#define PTE_USER     0x004
+#define PTE_PWT      0x008
+#define PTE_PCD      0x010
+#define PTE_ACCESSED 0x020
+#define PTE_DIRTY    0x040
+#define PDE_LARGE    0x080               // 4 MB page (PSE)
+#define PDE_PAT      0x1000              // selects PAT entries 4-7 in a 4 MB page
+#define PTE_GLOBAL   0x100
+#define PTE_COW      0x200               // available bit: read-only until the first write copies it
+#define PTE_SHARED   0x400               // available bit: shared memory, stays writable across fork
+
+#define PF_PRESENT 0x1                   // page fault error code bits
+#define PF_WRITE   0x2
+#define PF_USER    0x4
+
+#define PDE_INDEX(va) ((va) >> 22)
+#define PTE_INDEX(va) (((va) >> 12) & 0x3FF)
+#define LARGE_PAGE_SIZE 0x400000
+
+// Kernel mappings are 4 MB global pages: the low 4 MB identity (kernel image,
+// VGA, boot data) and all managed RAM at PHYS_MAP_BASE. Every address space
+// shares these PDEs by value, and with CR4.PGE they stay in the TLB across
+// CR3 switches. Device MMIO (APIC, framebuffer) goes in kernel PDEs too; ones
+// added after an address space was copied reach it on its first fault there.
+static uint32_t kernel_page_dir[1024] __attribute__((aligned(PAGE_SIZE)));
+static uint32_t kernel_pde_flags = PTE_PRESENT | PTE_WRITE | PDE_LARGE;
+uint32_t physmap_end;   // physical addresses below this are reachable through phys_to_virt
+
+#define current_page_dir (this_cpu()->page_dir)
+
+static inline int is_kernel_pde(uint32_t index) {
+    return index == 0 || index >= PDE_INDEX(PHYS_MAP_BASE);
+}
+
+static inline uint32_t page_dir_phys(uint32_t* pd) {
+    return virt_to_phys(pd);
+}
+
+void switch_address_space(uint32_t* pd) {
+    Cpu* cpu = this_cpu();
+    if (pd == cpu->page_dir) return;
+    cpu->page_dir = pd;
+    write_cr3(page_dir_phys(pd));
+}
+
+void paging_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    if (!(d & CPUID_EDX_PSE)) panic("paging: CPU lacks 4 MB pages (PSE)\n");
+
+    uint32_t cr4 = read_cr4() | CR4_PSE;
+    if (d & CPUID_EDX_PGE) {
+        cr4 |= CR4_PGE;
+        kernel_pde_flags |= PTE_GLOBAL;
+    }
+
+    memset(kernel_page_dir, 0, sizeof(kernel_page_dir));
+    kernel_page_dir[0] = 0 | kernel_pde_flags;
+
+    uint32_t top = align_up(frame_to_phys(frame_count), LARGE_PAGE_SIZE);
+    if (top > PMM_MAX_PHYS) top = PMM_MAX_PHYS;
+    for (uint32_t phys = 0; phys < top; phys += LARGE_PAGE_SIZE)
+        kernel_page_dir[PDE_INDEX(PHYS_MAP_BASE + phys)] = phys | kernel_pde_flags;
+    physmap_end = top;
+
+    write_cr4(cr4);
+    write_cr3(page_dir_phys(kernel_page_dir));
+    write_cr0(read_cr0() | CR0_PG | CR0_WP);   // WP: the kernel honours read-only user pages too
+    this_cpu()->page_dir = kernel_page_dir;
+}
+
+// Device memory below PHYS_MAP_BASE + PMM_MAX_PHYS can't be identity mapped
+// in the kernel half, so it's given PDEs from the unused top of the physmap
+// window, handed out downwards
+static uint32_t device_window = PHYS_MAP_BASE + PMM_MAX_PHYS;
+static Spinlock device_window_lock = SPINLOCK_INIT;
+
+// Map device memory [phys, phys + size) with the given caching bits, in 4 MB
+// pages, and return where it is. High MMIO (APIC) is identity mapped.
+static void* map_device(uint32_t phys, uint32_t size, uint32_t cache) {
+    uint32_t first = PDE_INDEX(phys);
+    uint32_t last = PDE_INDEX(phys + size - 1);   // the window may end at 4 GB
+    if (size == 0 || last < first) return NULL;
+
+    uint32_t va = phys;
+    spin_lock(&device_window_lock);
+    if (phys < PHYS_MAP_BASE + PMM_MAX_PHYS) {
+        uint32_t span = (last - first + 1) * LARGE_PAGE_SIZE;
+        if (device_window - (PHYS_MAP_BASE + physmap_end) < span) {
+            spin_unlock(&device_window_lock);
+            return NULL;
+        }
+        device_window -= span;
+        va = device_window + (phys & (LARGE_PAGE_SIZE - 1));
+    }
+    for (uint32_t i = first; i <= last; i++) {
+        uint32_t index = PDE_INDEX(va) + (i - first);
+        if (!(kernel_page_dir[index] & PTE_PRESENT))
+            kernel_page_dir[index] = (i << 22) | kernel_pde_flags | cache;
+        invlpg(index << 22);
+    }
+    spin_unlock(&device_window_lock);
+    return (void*)va;
+}
+
+// Registers: uncached
+void* paging_map_mmio(uint32_t phys, uint32_t size) {
+    return map_device(phys, size, PTE_PCD | PTE_PWT);
+}
+
+// Framebuffers: write-combining, so pixel stores go out in bursts. Uncached
+// when the CPU has no PAT.
+void* paging_map_wc(uint32_t phys, uint32_t size) {
+    return map_device(phys, size, pat_wc ? PDE_PAT : PTE_PCD | PTE_PWT);
+}
+
+// Address spaces copy the kernel PDEs when they're created; pick up any
+// device mapped since
+static int kernel_pde_fault(uint32_t va) {
+    uint32_t index = PDE_INDEX(va);
+    if (!is_kernel_pde(index) || !(kernel_page_dir[index] & PTE_PRESENT)) return -1;
+    if (current_page_dir[index] & PTE_PRESENT) return -1;
+    current_page_dir[index] = kernel_page_dir[index];
+    return 0;
+}
+
+// Find the PTE for `va`, allocating a zeroed page table if asked to
+uint32_t* get_pte(uint32_t* pd, uint32_t va, int create) {
+    uint32_t* pde = &pd[PDE_INDEX(va)];
+    if (!(*pde & PTE_PRESENT)) {
+        if (!create) return NULL;
+        uint32_t table = pmm_alloc_frame();
+        if (!table) return NULL;
+        memset(phys_to_virt(table), 0, PAGE_SIZE);
+        *pde = table | PTE_PRESENT | PTE_WRITE | PTE_USER;
+    }
+    if (*pde & PDE_LARGE) return NULL;
+
+    uint32_t* pt = (uint32_t*)phys_to_virt(*pde & ~0xFFF);
+    return &pt[PTE_INDEX(va)];
+}
+
+int map_page(uint32_t* pd, uint32_t va, uint32_t phys, uint32_t flags) {
+    uint32_t* pte = get_pte(pd, va, 1);
+    if (!pte) return -1;
+    *pte = (phys & ~0xFFF) | flags | PTE_PRESENT;
+    if (pd == current_page_dir) invlpg(va);
+    return 0;
+}
+
+// Back [va, va + size) with fresh zeroed frames
+int map_user_range(uint32_t* pd, uint32_t va, uint32_t size, uint32_t flags) {
+    for (uint32_t page = align_down(va, PAGE_SIZE); page < va + size; page += PAGE_SIZE) {
+        uint32_t* pte = get_pte(pd, page, 0);
+        if (pte && (*pte & PTE_PRESENT)) continue;
+
+        uint32_t frame = pmm_alloc_frame();
+        if (!frame) return -1;
+        memset(phys_to_virt(frame), 0, PAGE_SIZE);
+        if (map_page(pd, page, frame, flags | PTE_USER) != 0) {
+            pmm_free_frame(frame);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Copy into another address space's pages through the physmap, so the
+// caller's CR3 stays put even if it sleeps midway. The range must be mapped.
+int copy_to_address_space(uint32_t* pd, uint32_t va, const void* src, uint32_t size) {
+    const uint8_t* from = (const uint8_t*)src;
+    while (size > 0) {
+        uint32_t* pte = get_pte(pd, va, 0);
+        if (!pte || !(*pte & PTE_PRESENT)) return -1;
+        uint32_t offset = va & (PAGE_SIZE - 1);
+        uint32_t chunk = PAGE_SIZE - offset;
+        if (chunk > size) chunk = size;
+        memcpy((uint8_t*)phys_to_virt(*pte & ~0xFFF) + offset, from, chunk);
+        va += chunk;
+        from += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+uint32_t* create_address_space(void) {
+    uint32_t phys = pmm_alloc_frame();
+    if (!phys) return NULL;
+
+    uint32_t* pd = (uint32_t*)phys_to_virt(phys);
+    for (uint32_t i = 0; i < 1024; i++)
+        pd[i] = is_kernel_pde(i) ? kernel_page_dir[i] : 0;
+    return pd;
+}
+
+// Free every user frame and page table, then the directory itself
+void destroy_address_space(uint32_t* pd) {
+    if (!pd || pd == kernel_page_dir) return;
+    if (pd == current_page_dir) switch_address_space(kernel_page_dir);
+
+    for (uint32_t i = 0; i < 1024; i++) {
+        if (is_kernel_pde(i) || !(pd[i] & PTE_PRESENT)) continue;
+
+        uint32_t* pt = (uint32_t*)phys_to_virt(pd[i] & ~0xFFF);
+        for (int j = 0; j < 1024; j++) {
+            if (pt[j] & PTE_PRESENT) pmm_frame_put(pt[j] & ~0xFFF);
+        }
+        pmm_free_frame(pd[i] & ~0xFFF);
+    }
+    pmm_free_frame(page_dir_phys(pd));
+}
+
+// Child address space for fork. Page tables are copied, frames are shared:
+// writable pages become read-only + COW in both parent and child.
+uint32_t* fork_address_space(uint32_t* src) {
+    uint32_t* pd = create_address_space();
+    if (!pd) return NULL;
+
+    for (uint32_t i = 0; i < 1024; i++) {
+        if (is_kernel_pde(i) || !(src[i] & PTE_PRESENT)) continue;
+
+        uint32_t table = pmm_alloc_frame();
+        if (!table) {
+            destroy_address_space(pd);
+            return NULL;
+        }
+        uint32_t* spt = (uint32_t*)phys_to_virt(src[i] & ~0xFFF);
+        uint32_t* dpt = (uint32_t*)phys_to_virt(table);
+        for (int j = 0; j < 1024; j++) {
+            uint32_t pte = spt[j];
+            if (pte & PTE_PRESENT) {
+                if ((pte & PTE_WRITE) && !(pte & PTE_SHARED)) {
+                    pte = (pte & ~PTE_WRITE) | PTE_COW;
+                    spt[j] = pte;
+                }
+                pmm_frame_get(pte & ~0xFFF);
+            }
+            dpt[j] = pte;
+        }
+        pd[i] = table | (src[i] & 0xFFF);
+    }
+
+    // The parent lost write access, drop its stale TLB entries (kernel ones are global)
+    if (src == current_page_dir) write_cr3(page_dir_phys(src));
+    return pd;
+}
+
+// Write to a COW page: copy it, or take it over if nobody else maps it anymore
+static int cow_fault(uint32_t va) {
+    uint32_t* pte = get_pte(current_page_dir, va, 0);
+    if (!pte || !(*pte & PTE_COW)) return -1;
+
+    uint32_t page = align_down(va, PAGE_SIZE);
+    uint32_t old = *pte & ~0xFFF;
+    uint32_t flags = (*pte & 0xFFF & ~PTE_COW) | PTE_WRITE;
+
+    if (frames[phys_to_frame(old)].refcount == 1) {
+        *pte = old | flags;
+    } else {
+        uint32_t copy = pmm_alloc_frame();
+        if (!copy) return -1;
+        memcpy(phys_to_virt(copy), phys_to_virt(old), PAGE_SIZE);
+        *pte = copy | flags;
+        pmm_frame_put(old);
+    }
+    invlpg(page);
+    return 0;
+}
+
+static int in_user_stack(uint32_t va) {
+    return va < USER_STACK_TOP && va >= USER_STACK_TOP - USER_STACK_MAX;
+}
+
+// The current task may touch the page at `va`: mapped for user mode, and
+// writable or copy-on-write if `write`. Stack pages not backed yet count,
+// the fault handler maps them.
+static int user_page_ok(uint32_t va, int write) {
+    uint32_t* pte = get_pte(current_page_dir, va, 0);
+    if (!pte || !(*pte & PTE_PRESENT)) return in_user_stack(va);
+    if (!(*pte & PTE_USER)) return 0;
+    return !write || (*pte & (PTE_WRITE | PTE_COW));
+}
+
+// access_ok for syscall arguments: all of [addr, addr + size) is user
+// memory the current task could access the same way itself. The kernel
+// then touches it without faulting (or only to resolve COW and the stack).
+int user_range_ok(uint32_t addr, uint32_t size, int write) {
+    if (size == 0) return 1;
+    if (addr >= USER_SPACE_END || size > USER_SPACE_END - addr) return 0;
+    for (uint32_t page = align_down(addr, PAGE_SIZE); page < addr + size; page += PAGE_SIZE)
+        if (!user_page_ok(page, write)) return 0;
+    return 1;
+}
+
+// Copy a user string into dst[max], checking each page before reading it.
+// Longer strings are cut to max - 1 characters, as file names are.
+int user_string_copy(char* dst, uint32_t src, uint32_t max) {
+    for (uint32_t i = 0; i < max - 1; i++) {
+        uint32_t va = src + i;
+        if ((i == 0 || va % PAGE_SIZE == 0) && !user_range_ok(va, 1, 0)) return -1;
+        dst[i] = *(const char*)va;
+        if (!dst[i]) return 0;
+    }
+    dst[max - 1] = '\0';
+    return 0;
+}
+
+// Returns 0 when the fault was resolved and the access can be retried
+int handle_page_fault(uint32_t va, uint32_t err) {
+    // Also reached from the kernel writing to user buffers, since CR0.WP is set
+    if ((err & PF_PRESENT) && (err & PF_WRITE) && va < USER_SPACE_END)
+        return cow_fault(va);
+
+    // Stack pages are only backed once they're touched
+    if (!(err & PF_PRESENT) && in_user_stack(va))
+        return map_user_range(current_page_dir, va, 1, PTE_WRITE);
+
+    if (!(err & PF_PRESENT) && !(err & PF_USER) && va >= USER_SPACE_END)
+        return kernel_pde_fault(va);
+
+    return -1;
+}
+
+void user_fault_kill(void);   // posix.h: terminate the current task
+
+void page_fault_handler(struct registers* r) {
+    uint32_t va = read_cr2();
+    if (handle_page_fault(va, r->err_code) == 0) return;
+
+    char buf[12];
+    print("PAGE FAULT at ");
+    int_to_chars(va, buf, sizeof(buf));
+    print_buffer(buf);
+    print(" eip ");
+    int_to_chars(r->eip, buf, sizeof(buf));
+    print_buffer(buf);
+    print("\n");
+
+    if (r->err_code & PF_USER) {
+        print("Segmentation fault, killing task\n");
+        user_fault_kill();
+        return;
+    }
+    panic("Unhandled kernel page fault");
+}
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include <stdint.h>
+#include "helpers/basics.h"
+#include "helpers/cpu.h"
+#include "helpers/gdt.h"
+#include "helpers/spinlock.h"
+#include "structs/structs.h"
+#include "structs/interrupts.h"
+
+#define MAX_CPUS 8
+#define SCHED_PRIORITIES 32
+
+// Everything one CPU owns. %gs is based here on every CPU (PERCPU_SEL), so
+// this_cpu() is a single load.
+typedef struct Cpu {
+    struct Cpu* self;           // must stay first: %gs:0
+    int id;                     // index in cpus[]
+    uint8_t apic_id;
+    volatile int started;       // AP reached cpu_idle
+    uint32_t stack_top;         // idle/boot stack
+
+    Task* current;
+    Task* prev;                 // just switched away from, released in sched_finish_switch
+    uint32_t* page_dir;         // loaded in CR3
+    Task idle_task;             // cpu_idle on the boot stack, runs when the queues are empty
+
+    // Ready tasks of this CPU: one FIFO per priority, bit p set while queue p is non-empty
+    Spinlock rq_lock;
+    Task* run_head[SCHED_PRIORITIES];
+    Task* run_tail[SCHED_PRIORITIES];
+    uint32_t run_bitmap;
+    volatile uint32_t nr_running;
+
+    // Context switch statistics, in TSC cycles
+    uint64_t switch_start_tsc;
+    uint32_t switch_count;
+    uint32_t switch_cycles_last;
+    uint32_t switch_cycles_min;
+    uint32_t switch_cycles_max;
+    uint32_t switch_cycles_avg;
+    uint32_t preemptions;
+    uint32_t idle_halts;
+    uint64_t idle_ns;           // time spent halted
+    uint32_t steals;            // tasks taken from other CPUs' queues
+    Task* fpu_owner;            // whose FPU state the registers hold (fpu.h), only ever compared
+    uint32_t fpu_loads;         // #NM traps taken
+
+    // Interrupt accounting (irq.h)
+    IrqStat irq_stats[MAX_INTERRUPTS];
+    int irq_vector;             // being handled, -1 for none
+    uint64_t irq_start;         // when its cycles started counting
+
+    struct GDTEntry gdt[GDT_ENTRIES];
+    struct GDTDescriptor gdtp;
+    struct TSS tss;
+} Cpu;
+
+Cpu cpus[MAX_CPUS];
+int cpu_count = 1;
+int pat_wc;     // PAT entry 4 is write-combining (PDE_PAT in paging.h)
+int fpu_fxsr;   // fxsave/fxrstor and SSE are on, else only fnsave/frstor
+
+static inline Cpu* this_cpu(void) {
+    Cpu* c;
+    // volatile: a task can wake up on another CPU after schedule()
+    __asm__ volatile ("mov %%gs:0, %0" : "=r"(c));
+    return c;
+}
+
+#define current_task (this_cpu()->current->id)
+
+// Kernel stack used for the next trap out of user mode on this CPU
+void tss_set_kernel_stack(uint32_t esp0) {
+    this_cpu()->tss.esp0 = esp0;
+}
+
+extern void sysenter_entry();   // syscall_entry.asm
+
+// sysenter loads cs/ss from the MSRs and esp from MSR_SYSENTER_ESP, which
+// can't follow the running task. It points at this CPU's TSS instead and the
+// entry stub loads tss.esp0 from there, so task switches don't touch the MSR.
+static void sysenter_init(Cpu* c) {
+    uint32_t a, b, cx, d;
+    cpuid(1, &a, &b, &cx, &d);
+    if (!(d & CPUID_EDX_SEP)) return;   // user code checks the same bit and stays on int 0x80
+
+    wrmsr(MSR_SYSENTER_CS, KERNEL_CS);  // sysexit derives the user cs/ss from it: 0x1B/0x23
+    wrmsr(MSR_SYSENTER_ESP, (uint32_t)&c->tss);
+    wrmsr(MSR_SYSENTER_EIP, (uint32_t)sysenter_entry);
+}
+
+// Power-on PAT with entry 4 (PAT bit set, PCD/PWT clear) turned from
+// write-back into write-combining. Entries 0-3, which mappings without the
+// PAT bit use, keep their meaning. Every CPU has to agree on it.
+#define PAT_WC_VALUE 0x0007040100070406ull
+
+static void pat_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    if (!(d & CPUID_EDX_PAT)) return;
+    wrmsr(MSR_PAT, PAT_WC_VALUE);
+    pat_wc = 1;
+}
+
+// x87 and SSE on for this CPU, for tasks (lazily, fpu.h) and for the
+// kernel's memcpy/memset. CR0.TS is left set: nobody owns the FPU yet.
+static void fpu_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    write_cr0((read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+    __asm__ volatile ("fninit");
+    if ((d & CPUID_EDX_FXSR) && (d & CPUID_EDX_SSE)) {
+        write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+        fpu_fxsr = 1;
+    }
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+// Load the CPU's own GDT/TSS and point %gs at its struct. The idle task
+// stands for whatever is running on the boot stack until the first switch.
+void cpu_setup(int id, uint32_t stack_top) {
+    Cpu* c = &cpus[id];
+    c->self = c;
+    c->id = id;
+    c->stack_top = stack_top;
+    c->idle_task.id = -1;
+    c->idle_task.state = TASK_RUNNABLE;
+    c->idle_task.cpu = id;
+    c->idle_task.on_cpu = 1;
+    c->current = &c->idle_task;
+    c->switch_cycles_min = 0xFFFFFFFF;
+    c->irq_vector = -1;
+    gdt_install(c->gdt, &c->gdtp, &c->tss, (uint32_t)c, sizeof(Cpu), stack_top);
+    sysenter_init(c);
+    pat_init();
+    fpu_init();
+}
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef PIC_H
+#define PIC_H
+
+#include <stdint.h>
+#include "helpers/port_io.h"
+
+#define PIC1_CMD  0x20
+#define PIC1_DATA 0x21
+#define PIC2_CMD  0xA0
+#define PIC2_DATA 0xA1
+#define PIC_EOI   0x20
+
+#define IRQ_BASE 0x20                  // IRQ n arrives on vector IRQ_BASE + n
+#define IRQ_TIMER 0
+#define IRQ_KEYBOARD 1
+#define IRQ_COM1 4
+#define IRQ_ATA_PRIMARY 14
+
+// Move the 8259s off the CPU exception vectors (IRQ0 would otherwise look
+// like a double fault) and mask every line until a driver unmasks it
+void pic_remap(void) {
+    outb(PIC1_CMD, 0x11);              // ICW1: init, expect ICW4
+    outb(PIC2_CMD, 0x11);
+    outb(PIC1_DATA, IRQ_BASE);         // ICW2: vector offsets
+    outb(PIC2_DATA, IRQ_BASE + 8);
+    outb(PIC1_DATA, 0x04);             // ICW3: slave on IRQ2
+    outb(PIC2_DATA, 0x02);
+    outb(PIC1_DATA, 0x01);             // ICW4: 8086 mode
+    outb(PIC2_DATA, 0x01);
+
+    outb(PIC1_DATA, 0xFB);             // everything masked except the cascade
+    outb(PIC2_DATA, 0xFF);
+}
+
+void pic_unmask(uint8_t irq) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) & ~(1 << (irq & 7)));
+}
+
+void pic_mask(uint8_t irq) {
+    uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+    outb(port, inb(port) | (1 << (irq & 7)));
+}
+
+// The IOAPIC takes over: keep the 8259s remapped but silent
+void pic_disable(void) {
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+}
+
+// In-service bits of both chips, slave in the high byte. An IRQ 7 or 15
+// without its bit set is spurious.
+uint16_t pic_read_isr(void) {
+    outb(PIC1_CMD, 0x0B);              // OCW3: read ISR
+    outb(PIC2_CMD, 0x0B);
+    return ((uint16_t)inb(PIC2_CMD) << 8) | inb(PIC1_CMD);
+}
+
+void pic_send_eoi(uint8_t irq) {
+    if (irq >= 8) outb(PIC2_CMD, PIC_EOI);
+    outb(PIC1_CMD, PIC_EOI);
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef PIT_H
+#define PIT_H
+
+#include <stdint.h>
+#include "helpers/port_io.h"
+
+#define PIT_CHANNEL0 0x40
+#define PIT_CHANNEL2 0x42
+#define PIT_GATE2    0x61              // bit 0 gates channel 2, bit 5 reads its output
+#define PIT_CMD      0x43
+#define PIT_BASE_HZ  1193182
+#define PIT_HZ       1000              // 1 ms ticks
+
+volatile uint32_t timer_ticks = 0;     // boot CPU ticks, they pause in tickless idle: clock_ns() tells time
+
+// Channel 0, rate generator, firing IRQ0 `hz` times a second
+void pit_init(uint32_t hz) {
+    uint32_t divisor = PIT_BASE_HZ / hz;
+    if (divisor > 0xFFFF) divisor = 0xFFFF;
+    outb(PIT_CMD, 0x34);               // channel 0, lobyte/hibyte, mode 2
+    outb(PIT_CHANNEL0, divisor & 0xFF);
+    outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
+}
+
+// Busy-wait on channel 2 in one-shot mode. For boot-time delays (AP startup,
+// timer calibration) that run before any interrupt is enabled.
+void pit_delay_us(uint32_t us) {
+    while (us > 0) {
+        uint32_t chunk = us > 50000 ? 50000 : us;      // the counter is 16 bits, ~54 ms
+        uint32_t count = chunk * (PIT_BASE_HZ / 1000) / 1000;
+        if (count == 0) count = 1;
+
+        uint8_t gate = inb(PIT_GATE2) & ~0x03;         // gate low, speaker off
+        outb(PIT_GATE2, gate);
+        outb(PIT_CMD, 0xB0);                           // channel 2, lobyte/hibyte, mode 0
+        outb(PIT_CHANNEL2, count & 0xFF);
+        outb(PIT_CHANNEL2, (count >> 8) & 0xFF);
+        outb(PIT_GATE2, gate | 0x01);                  // start counting
+        while (!(inb(PIT_GATE2) & 0x20)) ;            // output goes high at zero
+
+        us -= chunk;
+    }
+}
+
+#endif
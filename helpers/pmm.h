@@ -0,0 +1,313 @@
+#ifndef PMM_H
+#define PMM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "helpers/basics.h"
+#include "helpers/spinlock.h"
+#include "structs/structs.h"
+
+#define PAGE_SIZE 4096
+#define PAGE_SHIFT 12
+#define PMM_MAX_ORDER 11                // blocks of 1 .. 1024 pages (4 MB)
+#define PMM_MAX_PHYS 0x30000000u        // manage at most the first 768 MB
+#define PMM_LOW_LIMIT 0x100000u         // never hand out the first 1 MB
+#define PMM_META_LIMIT 0x400000u        // frame metadata must sit in the first 4 MB
+#define PMM_NONE 0xFFFFFFFFu
+#define PHYS_MAP_BASE 0xC0000000u       // all managed RAM is mapped here once paging is on
+
+#define FRAME_RESERVED 0x01             // not managed (hole, kernel, boot data)
+#define FRAME_FREE     0x02             // head of a free buddy block
+#define FRAME_SLAB     0x04             // part of a slab, `owner` is the slab header
+#define FRAME_KMALLOC  0x08             // head of a page-sized kmalloc block
+
+typedef struct {
+    uint32_t next;      // free list links, frame indices
+    uint32_t prev;
+    uint8_t order;      // order of the block this frame heads
+    uint8_t flags;
+    uint16_t refcount;  // mappings of a user frame, shared after fork
+    uint32_t owner;     // physical address of the slab this frame belongs to
+} PageFrame;
+
+typedef struct {
+    uint32_t head;
+    uint32_t count;
+} FreeArea;
+
+extern char kernel_end[];
+
+PageFrame* frames = NULL;               // one entry per physical frame
+uint32_t frame_count = 0;
+FreeArea free_area[PMM_MAX_ORDER];
+uint32_t pmm_total_frames = 0;          // frames handed to the allocator at boot
+uint32_t pmm_free_frames = 0;
+Spinlock pmm_lock;                      // free lists and counters
+
+static inline uint32_t frame_to_phys(uint32_t frame) { return frame << PAGE_SHIFT; }
+static inline uint32_t phys_to_frame(uint32_t phys) { return phys >> PAGE_SHIFT; }
+
+// Kernel-visible address of a physical frame, through the physmap window
+static inline void* phys_to_virt(uint32_t phys) { return (void*)(phys + PHYS_MAP_BASE); }
+
+// Physmap addresses and the identity-mapped low 4 MB (kernel image) both work
+static inline uint32_t virt_to_phys(const void* virt) {
+    uint32_t v = (uint32_t)virt;
+    return (v >= PHYS_MAP_BASE) ? v - PHYS_MAP_BASE : v;
+}
+
+static inline uint32_t align_up(uint32_t v, uint32_t a) { return (v + a - 1) & ~(a - 1); }
+static inline uint32_t align_down(uint32_t v, uint32_t a) { return v & ~(a - 1); }
+
+static void free_list_push(uint32_t order, uint32_t frame) {
+    PageFrame* f = &frames[frame];
+    f->order = order;
+    f->flags = FRAME_FREE;
+    f->prev = PMM_NONE;
+    f->next = free_area[order].head;
+    if (f->next != PMM_NONE) frames[f->next].prev = frame;
+    free_area[order].head = frame;
+    free_area[order].count++;
+}
+
+static void free_list_remove(uint32_t order, uint32_t frame) {
+    PageFrame* f = &frames[frame];
+    if (f->prev != PMM_NONE) frames[f->prev].next = f->next;
+    else free_area[order].head = f->next;
+    if (f->next != PMM_NONE) frames[f->next].prev = f->prev;
+    f->flags = 0;
+    free_area[order].count--;
+}
+
+// Allocate 2^order physically contiguous, naturally aligned frames.
+// Returns the physical address, or 0 when no block is large enough.
+uint32_t pmm_alloc_pages(uint32_t order) {
+    if (order >= PMM_MAX_ORDER) return 0;
+
+    spin_lock(&pmm_lock);
+    uint32_t o = order;
+    while (o < PMM_MAX_ORDER && free_area[o].head == PMM_NONE) o++;
+    if (o == PMM_MAX_ORDER) {
+        spin_unlock(&pmm_lock);
+        return 0;
+    }
+
+    uint32_t frame = free_area[o].head;
+    free_list_remove(o, frame);
+
+    // Split down, returning the upper halves to the smaller free lists
+    while (o > order) {
+        o--;
+        free_list_push(o, frame + (1u << o));
+    }
+
+    frames[frame].order = order;
+    frames[frame].refcount = 1;
+    pmm_free_frames -= 1u << order;
+    spin_unlock(&pmm_lock);
+    return frame_to_phys(frame);
+}
+
+void pmm_free_pages(uint32_t phys, uint32_t order) {
+    uint32_t frame = phys_to_frame(phys);
+    if (frame >= frame_count || (frames[frame].flags & (FRAME_RESERVED | FRAME_FREE))) {
+        log("pmm: bad free\n");
+        return;
+    }
+
+    spin_lock(&pmm_lock);
+    pmm_free_frames += 1u << order;
+
+    // Coalesce with the buddy for as long as it's a free block of the same order
+    while (order < PMM_MAX_ORDER - 1) {
+        uint32_t buddy = frame ^ (1u << order);
+        if (buddy + (1u << order) > frame_count) break;
+        if (!(frames[buddy].flags & FRAME_FREE) || frames[buddy].order != order) break;
+
+        free_list_remove(order, buddy);
+        frame &= ~(1u << order);
+        order++;
+    }
+    free_list_push(order, frame);
+    spin_unlock(&pmm_lock);
+}
+
+// Single frames are the common case and come straight off the order-0 list
+uint32_t pmm_alloc_frame(void) {
+    return pmm_alloc_pages(0);
+}
+
+void pmm_free_frame(uint32_t phys) {
+    pmm_free_pages(phys, 0);
+}
+
+// User frames can be mapped by several address spaces, the last unmap frees
+// it. Parent and child may fault on the same frame from different CPUs.
+void pmm_frame_get(uint32_t phys) {
+    __atomic_add_fetch(&frames[phys_to_frame(phys)].refcount, 1, __ATOMIC_RELAXED);
+}
+
+void pmm_frame_put(uint32_t phys) {
+    if (__atomic_sub_fetch(&frames[phys_to_frame(phys)].refcount, 1, __ATOMIC_ACQ_REL) == 0)
+        pmm_free_frame(phys);
+}
+
+// Smallest order that covers `count` frames
+uint32_t pmm_order_for(uint32_t count) {
+    uint32_t order = 0;
+    while ((1u << order) < count) order++;
+    return order;
+}
+
+// Physically contiguous run of at least `count` frames, e.g. for DMA buffers
+uint32_t pmm_alloc_contiguous(uint32_t count) {
+    return pmm_alloc_pages(pmm_order_for(count));
+}
+
+void pmm_free_contiguous(uint32_t phys, uint32_t count) {
+    pmm_free_pages(phys, pmm_order_for(count));
+}
+
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+} PhysRange;
+
+#define PMM_MAX_RESERVED 16
+static PhysRange pmm_reserved[PMM_MAX_RESERVED];
+static int pmm_reserved_count = 0;
+
+static void pmm_reserve(uint32_t start, uint32_t end) {
+    if (pmm_reserved_count < PMM_MAX_RESERVED && end > start) {
+        pmm_reserved[pmm_reserved_count].start = align_down(start, PAGE_SIZE);
+        pmm_reserved[pmm_reserved_count].end = align_up(end, PAGE_SIZE);
+        pmm_reserved_count++;
+    }
+}
+
+// Hand an available range to the buddy lists, skipping reserved ranges and
+// inserting each piece as the largest aligned blocks that fit
+static void pmm_add_range(uint32_t start, uint32_t end) {
+    start = align_up(start, PAGE_SIZE);
+    end = align_down(end, PAGE_SIZE);
+
+    for (int i = 0; i < pmm_reserved_count && start < end; i++) {
+        PhysRange* r = &pmm_reserved[i];
+        if (r->end <= start || r->start >= end) continue;
+        // Split around the reserved range
+        if (r->start > start) pmm_add_range(start, r->start);
+        start = r->end;
+    }
+    if (start >= end) return;
+
+    uint32_t frame = phys_to_frame(start);
+    uint32_t last = phys_to_frame(end);
+    while (frame < last) {
+        uint32_t order = 0;
+        while (order + 1 < PMM_MAX_ORDER &&
+               (frame & ((1u << (order + 1)) - 1)) == 0 &&
+               frame + (1u << (order + 1)) <= last)
+            order++;
+
+        for (uint32_t f = frame; f < frame + (1u << order); f++) frames[f].flags = 0;
+        frames[frame].order = order;
+        pmm_total_frames += 1u << order;
+        pmm_free_pages(frame_to_phys(frame), order);
+        frame += 1u << order;
+    }
+}
+
+// Clip a memory map entry to what the allocator manages
+static int pmm_clip(uint64_t addr, uint64_t len, uint32_t* start, uint32_t* end) {
+    uint64_t s = addr, e = addr + len;
+    if (s < PMM_LOW_LIMIT) s = PMM_LOW_LIMIT;
+    if (e > PMM_MAX_PHYS) e = PMM_MAX_PHYS;
+    if (s >= e) return 0;
+    *start = (uint32_t)s;
+    *end = (uint32_t)e;
+    return 1;
+}
+
+void pmm_init(multiboot_info_t* mb_info) {
+    // Find the top of usable memory
+    uint32_t top = PMM_LOW_LIMIT + mb_info->mem_upper * 1024;
+    if (mb_info->flags & MULTIBOOT_INFO_MEM_MAP) {
+        top = 0;
+        uint32_t addr = mb_info->mmap_addr;
+        while (addr < mb_info->mmap_addr + mb_info->mmap_length) {
+            multiboot_mmap_entry_t* e = (multiboot_mmap_entry_t*)addr;
+            uint32_t s, end;
+            if (e->type == MULTIBOOT_MEMORY_AVAILABLE && pmm_clip(e->addr, e->len, &s, &end) && end > top)
+                top = end;
+            addr += e->size + 4;
+        }
+    }
+    if (top > PMM_MAX_PHYS) top = PMM_MAX_PHYS;
+
+    // Boot data that must survive: the kernel image, modules, and the info
+    // structures GRUB handed us
+    pmm_reserve(PMM_LOW_LIMIT, (uint32_t)kernel_end);
+    pmm_reserve((uint32_t)mb_info, (uint32_t)mb_info + sizeof(multiboot_info_t));
+    if (mb_info->flags & MULTIBOOT_INFO_MEM_MAP)
+        pmm_reserve(mb_info->mmap_addr, mb_info->mmap_addr + mb_info->mmap_length);
+    if (mb_info->flags & MULTIBOOT_INFO_MODS) {
+        multiboot_module_t* mods = (multiboot_module_t*)mb_info->mods_addr;
+        pmm_reserve(mb_info->mods_addr, mb_info->mods_addr + mb_info->mods_count * sizeof(multiboot_module_t));
+        for (uint32_t i = 0; i < mb_info->mods_count; i++)
+            pmm_reserve(mods[i].mod_start, mods[i].mod_end);
+    }
+
+    // Place metadata above everything reserved so far in the low 4 MB,
+    // so filling it in can't clobber boot data we still have to read
+    uint32_t placement = (uint32_t)kernel_end;
+    for (int i = 0; i < pmm_reserved_count; i++) {
+        if (pmm_reserved[i].start < PMM_META_LIMIT && pmm_reserved[i].end > placement)
+            placement = pmm_reserved[i].end;
+    }
+
+    // Frame metadata goes right after the boot data. Clamp the managed range
+    // if the array wouldn't fit below PMM_META_LIMIT.
+    placement = align_up(placement, PAGE_SIZE);
+    if (placement >= PMM_META_LIMIT) panic("pmm: no room for frame metadata\n");
+    frame_count = phys_to_frame(top);
+    uint32_t max_frames = (PMM_META_LIMIT - placement) / sizeof(PageFrame);
+    if (frame_count > max_frames) {
+        log("pmm: clamping managed memory to fit frame metadata\n");
+        frame_count = max_frames;
+    }
+    // Identity address: valid before paging and through the low 4 MB mapping after
+    frames = (PageFrame*)placement;
+    uint32_t meta_end = placement + frame_count * sizeof(PageFrame);
+    pmm_reserve(placement, meta_end);
+
+    for (uint32_t i = 0; i < frame_count; i++) {
+        frames[i].flags = FRAME_RESERVED;
+        frames[i].order = 0;
+    }
+    for (int o = 0; o < PMM_MAX_ORDER; o++) {
+        free_area[o].head = PMM_NONE;
+        free_area[o].count = 0;
+    }
+
+    uint32_t limit = frame_to_phys(frame_count);
+    if (mb_info->flags & MULTIBOOT_INFO_MEM_MAP) {
+        uint32_t addr = mb_info->mmap_addr;
+        while (addr < mb_info->mmap_addr + mb_info->mmap_length) {
+            multiboot_mmap_entry_t* e = (multiboot_mmap_entry_t*)addr;
+            uint32_t s, end;
+            if (e->type == MULTIBOOT_MEMORY_AVAILABLE && pmm_clip(e->addr, e->len, &s, &end))
+                pmm_add_range(s, end < limit ? end : limit);
+            addr += e->size + 4;
+        }
+    } else {
+        pmm_add_range(PMM_LOW_LIMIT, top < limit ? top : limit);
+    }
+
+    log("pmm: ");
+    char buf[12];
+    int_to_chars(pmm_free_frames, buf, sizeof(buf));
+    log_buffer(buf);
+    log(" free frames\n");
+}
+
+#endif
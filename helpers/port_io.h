@@ -23,5 +23,14 @@ static inline uint16_t inw(uint16_t port) {
     return ret;
 }
 
+// Move `count` 16-bit words between a port and memory in one rep string op
+static inline void insw(uint16_t port, void* addr, uint32_t count) {
+    __asm__ volatile ("rep insw" : "+D"(addr), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void* addr, uint32_t count) {
+    __asm__ volatile ("rep outsw" : "+S"(addr), "+c"(count) : "d"(port) : "memory");
+}
+
 #endif
 
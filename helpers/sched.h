@@ -0,0 +1,644 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "helpers/basics.h"
+#include "helpers/cpu.h"
+#include "helpers/heap.h"
+#include "helpers/gdt.h"
+#include "helpers/paging.h"
+#include "helpers/percpu.h"
+#include "helpers/apic.h"
+#include "helpers/pit.h"
+#include "helpers/timer.h"
+#include "helpers/kdata.h"
+#include "helpers/irq.h"
+#include "helpers/fpu.h"
+#include "helpers/spinlock.h"
+#include "structs/structs.h"
+
+#define SCHED_DEFAULT_PRIORITY 16        // of SCHED_PRIORITIES (percpu.h), 0 runs first
+#define SCHED_TIMESLICE_MS 10
+
+void isr_return(void);                   // isr_common_stub.asm: pops a struct registers and irets
+void context_switch(uint32_t* old_esp, uint32_t new_esp);   // context_switch.asm
+void fs_sync(void);                      // filesystem.h, flushed before halting
+void fs_exit_sync(void);                 // filesystem.h, flushed as a task exits
+void shm_release_all(Task* t);           // shm.h, before the address space goes
+void pipe_release_all(Task* t);          // posix.h, closes the pipe ends it holds
+
+// The task table grows on demand, tasks come from their own slab cache
+Task** tasks = NULL;
+int task_capacity = 0;
+KmemCache task_cache;
+static int task_free_hint = 0;           // no free slot below this index
+Spinlock task_lock;                      // the table, and kill() looking tasks up in it
+volatile uint32_t nr_tasks = 0;          // tasks that haven't exited
+int sched_started = 0;                   // set once tasks run and may sleep
+static volatile int sched_halting = 0;
+
+uint32_t sched_timeslice_ticks = SCHED_TIMESLICE_MS * PIT_HZ / 1000;
+
+void switch_to_user_mode_with_task(int task_id);
+static void task_first_run(void);
+void schedule(void);
+
+static void task_alloc_stack(Task* t) {
+    uint32_t phys = pmm_alloc_contiguous(STACK_SIZE / PAGE_SIZE);
+    t->stack = phys ? (uint8_t*)phys_to_virt(phys) : NULL;
+}
+
+// A task's stack is allocated once per slab object and reused with it. If
+// that fails the object is cached without one and task_create tries again.
+void task_ctor(void* obj) {
+    Task* t = (Task*)obj;
+    memset(t, 0, sizeof(Task));
+    task_alloc_stack(t);
+}
+
+void task_dtor(void* obj) {
+    Task* t = (Task*)obj;
+    if (t->stack) pmm_free_contiguous(virt_to_phys(t->stack), STACK_SIZE / PAGE_SIZE);
+}
+
+// Run queue operations, with c->rq_lock held
+static void run_enqueue(Cpu* c, Task* t) {
+    uint32_t p = t->priority;
+    t->run_next = NULL;
+    t->run_prev = c->run_tail[p];
+    if (c->run_tail[p]) c->run_tail[p]->run_next = t;
+    else c->run_head[p] = t;
+    c->run_tail[p] = t;
+    c->run_bitmap |= 1u << p;
+    c->nr_running++;
+    t->on_rq = 1;
+    t->cpu = c->id;
+}
+
+static void run_dequeue(Cpu* c, Task* t) {
+    uint32_t p = t->priority;
+    if (t->run_prev) t->run_prev->run_next = t->run_next;
+    else c->run_head[p] = t->run_next;
+    if (t->run_next) t->run_next->run_prev = t->run_prev;
+    else c->run_tail[p] = t->run_prev;
+    t->run_next = t->run_prev = NULL;
+    if (!c->run_head[p]) c->run_bitmap &= ~(1u << p);
+    c->nr_running--;
+    t->on_rq = 0;
+}
+
+// Head of the most urgent non-empty queue: one bit scan, whatever the task count
+static Task* run_pick(Cpu* c) {
+    if (!c->run_bitmap) return NULL;
+    Task* t = c->run_head[__builtin_ctz(c->run_bitmap)];
+    run_dequeue(c, t);
+    return t;
+}
+
+// An idle CPU takes the most urgent waiting task from the first other CPU
+// that has one. Tasks still being switched out there are left alone.
+static Task* steal_task(Cpu* self) {
+    for (int i = 1; i < cpu_count; i++) {
+        Cpu* c = &cpus[(self->id + i) % cpu_count];
+        if (!c->nr_running) continue;
+
+        Task* t = NULL;
+        spin_lock(&c->rq_lock);
+        for (uint32_t bits = c->run_bitmap; bits && !t; bits &= bits - 1) {
+            for (Task* q = c->run_head[__builtin_ctz(bits)]; q; q = q->run_next) {
+                if (!q->on_cpu) {
+                    t = q;
+                    break;
+                }
+            }
+        }
+        if (t) run_dequeue(c, t);
+        spin_unlock(&c->rq_lock);
+
+        if (t) {
+            self->steals++;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+// Queue a runnable task on its CPU, and kick that CPU out of hlt if it's
+// idle. The target's `current` is only changed under its rq_lock, so either
+// its schedule() sees the task or we see it idle.
+static void enqueue_task(Task* t) {
+    Cpu* c = &cpus[t->cpu];
+    spin_lock(&c->rq_lock);
+    if (!t->on_rq) run_enqueue(c, t);
+    int idle = c->current == &c->idle_task;
+    spin_unlock(&c->rq_lock);
+    if (idle && c != this_cpu() && apic_enabled) lapic_send_ipi(c->apic_id, RESCHED_VECTOR);
+}
+
+static Cpu* least_loaded_cpu(void) {
+    Cpu* best = NULL;
+    uint32_t best_load = 0;
+    for (int i = 0; i < cpu_count; i++) {
+        Cpu* c = &cpus[i];
+        uint32_t load = c->nr_running + (c->current != &c->idle_task);
+        if (!best || load < best_load) {
+            best = c;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+// New task with no address space yet, exec() or fork() gives it one.
+// It doesn't run until task_start().
+int task_create(void (*entry)(void)) {
+    spin_lock(&task_lock);
+    int i = task_free_hint;
+    while (i < task_capacity && tasks[i]) i++;
+    if (i == task_capacity && grow_table((void***)&tasks, &task_capacity) != 0) {
+        spin_unlock(&task_lock);
+        return -1; // No memory for a bigger table
+    }
+
+    Task* t = kmem_cache_alloc(&task_cache);
+    if (t && !t->stack) task_alloc_stack(t);
+    if (!t || !t->stack) {
+        kmem_cache_free(&task_cache, t);
+        spin_unlock(&task_lock);
+        return -1;
+    }
+
+    t->entry = entry;
+    t->state = TASK_RUNNABLE;
+    t->id = i;
+    t->page_dir = NULL;
+    t->slice_left = sched_timeslice_ticks;
+    t->priority = SCHED_DEFAULT_PRIORITY;
+    t->killed = 0;
+    t->wait_lock = (Spinlock)SPINLOCK_INIT;
+    t->waiting_on = NULL;
+    t->wait_next = NULL;
+    t->cpu = 0;
+    t->on_rq = 0;
+    t->on_cpu = 0;
+    t->ring_entries = 0;
+    t->task_data = NULL;
+    t->shm_attached = 0;
+    t->fpu_state = NULL;
+    t->fpu_cpu = -1;
+    memset(t->pipe_ends, 0, sizeof(t->pipe_ends));
+    memset(&t->user_regs, 0, sizeof(t->user_regs));
+
+    // Zero out the stack (optional)
+    memset(t->stack, 0, STACK_SIZE);
+
+    // The first switch to the task pops this frame and "returns" into
+    // task_first_run. The top is left free for the user-mode frame.
+    uint32_t* sp = (uint32_t*)(t->stack + STACK_SIZE - sizeof(struct registers));
+    *--sp = (uint32_t)task_first_run;
+    *--sp = 0;    // ebp
+    *--sp = 0;    // ebx
+    *--sp = 0;    // esi
+    *--sp = 0;    // edi
+    t->kernel_esp = (uint32_t)sp;
+
+    tasks[i] = t;
+    task_free_hint = i + 1;
+    spin_unlock(&task_lock);
+    __atomic_add_fetch(&nr_tasks, 1, __ATOMIC_RELAXED);
+    return i;
+}
+
+// Hand a fully set up task to the least busy CPU
+void task_start(int id) {
+    Task* t = tasks[id];
+    t->cpu = least_loaded_cpu()->id;
+    enqueue_task(t);
+}
+
+static void task_release(Task* t) {
+    spin_lock(&task_lock);
+    tasks[t->id] = NULL;
+    if (t->id < task_free_hint) task_free_hint = t->id;
+    spin_unlock(&task_lock);
+    kfree(t->fpu_state);
+    kmem_cache_free(&task_cache, t);
+}
+
+// Undo task_create for a task that was never started
+void task_abort(int id) {
+    __atomic_sub_fetch(&nr_tasks, 1, __ATOMIC_RELAXED);
+    task_release(tasks[id]);
+}
+
+// Enter user mode with the task's saved registers, on its own kernel stack
+void switch_to_user_mode_with_task(int task_id) {
+    Task *t = tasks[task_id];
+    switch_address_space(t->page_dir);
+    uint8_t* top = t->stack + STACK_SIZE;
+    tss_set_kernel_stack((uint32_t)top);
+
+    struct registers* frame = (struct registers*)(top - sizeof(struct registers));
+    memcpy(frame, &t->user_regs, sizeof(struct registers));
+
+    asm volatile (
+        "mov %0, %%esp\n"
+        "jmp isr_return\n"
+        :
+        : "r" (frame)
+    );
+    __builtin_unreachable();
+}
+
+// On a task stack with the scheduler running, as opposed to boot code or
+// the idle loop, which have nothing to put to sleep
+static inline int can_sleep(void) {
+    return sched_started && this_cpu()->current->id >= 0;
+}
+
+void wait_queue_init(WaitQueue* wq) {
+    wq->head = wq->tail = NULL;
+    wq->lock.locked = 0;
+}
+
+// Block until the queue is woken. `held` is the caller's lock over the
+// condition it just checked, possibly &wq->lock itself: it's only dropped
+// once we're on the queue, so a waker on another CPU can't slip in between,
+// and it's held again on return. Callers loop on their condition: wakeups
+// are broadcast and may be early.
+void sleep_on(WaitQueue* wq, Spinlock* held) {
+    Task* t = this_cpu()->current;
+    if (held != &wq->lock) spin_lock(&wq->lock);
+    t->state = TASK_BLOCKED;
+    spin_lock(&t->wait_lock);
+    t->waiting_on = wq;
+    spin_unlock(&t->wait_lock);
+    t->wait_next = NULL;
+    if (wq->tail) wq->tail->wait_next = t;
+    else wq->head = t;
+    wq->tail = t;
+    spin_unlock(&wq->lock);
+    if (held != &wq->lock) spin_unlock(held);
+
+    schedule();
+    spin_lock(held);
+}
+
+// The task is already off its wait queue, whose lock is held
+static void wake_task(Task* t) {
+    spin_lock(&t->wait_lock);
+    t->waiting_on = NULL;
+    spin_unlock(&t->wait_lock);
+    t->wait_next = NULL;
+    t->state = TASK_RUNNABLE;
+    enqueue_task(t);
+}
+
+// With wq->lock held
+static void wake_locked(WaitQueue* wq, int all) {
+    while (wq->head) {
+        Task* t = wq->head;
+        wq->head = t->wait_next;
+        if (!wq->head) wq->tail = NULL;
+        wake_task(t);
+        if (!all) break;
+    }
+}
+
+void wake_up(WaitQueue* wq) {
+    spin_lock(&wq->lock);
+    wake_locked(wq, 1);
+    spin_unlock(&wq->lock);
+}
+
+void wake_up_one(WaitQueue* wq) {
+    spin_lock(&wq->lock);
+    wake_locked(wq, 0);
+    spin_unlock(&wq->lock);
+}
+
+// Pull a blocked task off whatever it sleeps on, e.g. when it's killed.
+// The queue may live on the sleeper's stack (sleep_until) and is only
+// certain to exist while t->waiting_on points at it under t->wait_lock:
+// clearing it is the first thing a wakeup does. Wakers take the queue's
+// lock before wait_lock, so here the queue's is only tried, and on failure
+// both are let go so that waker can finish.
+static void wake_if_blocked(Task* t) {
+    while (1) {
+        spin_lock(&t->wait_lock);
+        WaitQueue* wq = t->waiting_on;
+        if (!wq) {
+            spin_unlock(&t->wait_lock);
+            return;
+        }
+        if (spin_trylock(&wq->lock)) {
+            spin_unlock(&t->wait_lock);
+            // t can't be woken, and wq can't go, while we hold wq->lock
+            Task* prev = NULL;
+            for (Task* w = wq->head; w; prev = w, w = w->wait_next) {
+                if (w != t) continue;
+                if (prev) prev->wait_next = t->wait_next;
+                else wq->head = t->wait_next;
+                if (wq->tail == t) wq->tail = prev;
+                break;
+            }
+            wake_task(t);
+            spin_unlock(&wq->lock);
+            return;
+        }
+        spin_unlock(&t->wait_lock);
+        __asm__ volatile ("pause");
+    }
+}
+
+// Sleeping lock that the owner may take again. Boot code runs before
+// there's anyone to contend with, so it skips the bookkeeping.
+void mutex_init(KMutex* m) {
+    m->owner = -1;
+    m->depth = 0;
+    wait_queue_init(&m->waiters);
+}
+
+void mutex_lock(KMutex* m) {
+    if (!can_sleep()) return;
+    int self = current_task;
+    spin_lock(&m->waiters.lock);
+    while (m->depth && m->owner != self) sleep_on(&m->waiters, &m->waiters.lock);
+    m->owner = self;
+    m->depth++;
+    spin_unlock(&m->waiters.lock);
+}
+
+void mutex_unlock(KMutex* m) {
+    if (!can_sleep()) return;
+    spin_lock(&m->waiters.lock);
+    if (m->depth && --m->depth == 0) {
+        m->owner = -1;
+        wake_locked(&m->waiters, 0);
+    }
+    spin_unlock(&m->waiters.lock);
+}
+
+// Set by kill() on another task, acted on at the task's next safe point
+int task_killed(void) {
+    return sched_started && this_cpu()->current->killed;
+}
+
+static void sched_record_switch(Cpu* cpu) {
+    uint32_t cycles = (uint32_t)(rdtsc() - cpu->switch_start_tsc);
+    cpu->switch_cycles_last = cycles;
+    if (cycles < cpu->switch_cycles_min) cpu->switch_cycles_min = cycles;
+    if (cycles > cpu->switch_cycles_max) cpu->switch_cycles_max = cycles;
+    // Running average over roughly the last 16 switches
+    cpu->switch_cycles_avg = cpu->switch_count
+        ? cpu->switch_cycles_avg - cpu->switch_cycles_avg / 16 + cycles / 16 : cycles;
+    cpu->switch_count++;
+}
+
+// Runs on the new task's stack right after a switch. Only now is the old
+// task's context saved: another CPU may run it from here on, or, if it
+// exited, its stack can be freed.
+static void sched_finish_switch(void) {
+    Cpu* cpu = this_cpu();
+    Task* prev = cpu->prev;
+    sched_record_switch(cpu);
+    __atomic_store_n(&prev->on_cpu, 0, __ATOMIC_RELEASE);
+    if (prev->state == TASK_ZOMBIE) task_release(prev);
+}
+
+void kill(int id);
+
+static void task_first_run(void) {
+    sched_finish_switch();
+    if (task_killed()) kill(current_task);
+    switch_to_user_mode_with_task(current_task);
+}
+
+void sched_dump_stats(void) {
+    char buf[12];
+    for (int i = 0; i < cpu_count; i++) {
+        Cpu* c = &cpus[i];
+        log("sched: cpu ");
+        int_to_chars(i, buf, sizeof(buf)); log_buffer(buf);
+        log(" switches ");
+        int_to_chars(c->switch_count, buf, sizeof(buf)); log_buffer(buf);
+        log(" preemptions ");
+        int_to_chars(c->preemptions, buf, sizeof(buf)); log_buffer(buf);
+        log(" steals ");
+        int_to_chars(c->steals, buf, sizeof(buf)); log_buffer(buf);
+        log(" idle halts ");
+        int_to_chars(c->idle_halts, buf, sizeof(buf)); log_buffer(buf);
+        log(" idle ms ");
+        int_to_chars((uint32_t)div_u64(c->idle_ns, 1000000), buf, sizeof(buf)); log_buffer(buf);
+        log(" cycles last/min/avg/max ");
+        int_to_chars(c->switch_cycles_last, buf, sizeof(buf)); log_buffer(buf);
+        log("/");
+        int_to_chars(c->switch_count ? c->switch_cycles_min : 0, buf, sizeof(buf)); log_buffer(buf);
+        log("/");
+        int_to_chars(c->switch_cycles_avg, buf, sizeof(buf)); log_buffer(buf);
+        log("/");
+        int_to_chars(c->switch_cycles_max, buf, sizeof(buf)); log_buffer(buf);
+        log(" fpu loads ");
+        int_to_chars(c->fpu_loads, buf, sizeof(buf)); log_buffer(buf);
+        log("\n");
+    }
+}
+
+void sched_set_timeslice(uint32_t ms) {
+    uint32_t ticks = ms * PIT_HZ / 1000;
+    sched_timeslice_ticks = ticks ? ticks : 1;
+}
+
+int sched_set_priority(int id, int priority) {
+    if (priority < 0 || priority >= SCHED_PRIORITIES) return -2;
+    spin_lock(&task_lock);
+    Task* t = (id >= 0 && id < task_capacity) ? tasks[id] : NULL;
+    if (!t) {
+        spin_unlock(&task_lock);
+        return -1;
+    }
+
+    // A queued task can be stolen by another CPU until we hold its queue's lock
+    Cpu* c;
+    while (1) {
+        c = &cpus[t->cpu];
+        spin_lock(&c->rq_lock);
+        if (t->cpu == c->id) break;
+        spin_unlock(&c->rq_lock);
+    }
+    int queued = t->on_rq;
+    if (queued) run_dequeue(c, t);
+    t->priority = priority;
+    if (queued) run_enqueue(c, t);
+    spin_unlock(&c->rq_lock);
+    spin_unlock(&task_lock);
+    return 0;
+}
+
+// Give the CPU to the most urgent runnable task: from this CPU's queues,
+// else stolen from another CPU, else the idle loop. A runnable caller goes
+// to the back of its priority's queue. Returns once the caller is picked
+// again, never for a zombie.
+void schedule(void) {
+    Cpu* cpu = this_cpu();
+    Task* prev = cpu->current;
+    Task* idle = &cpu->idle_task;
+
+    spin_lock(&cpu->rq_lock);
+    if (prev != idle && prev->state == TASK_RUNNABLE && !prev->on_rq) run_enqueue(cpu, prev);
+    Task* t = run_pick(cpu);
+    if (!t && cpu_count > 1) {
+        spin_unlock(&cpu->rq_lock);
+        t = steal_task(cpu);
+        spin_lock(&cpu->rq_lock);
+        if (!t) t = run_pick(cpu);   // somebody may have queued work meanwhile
+    }
+    if (!t) t = idle;
+    cpu->current = t;
+    spin_unlock(&cpu->rq_lock);
+
+    t->slice_left = sched_timeslice_ticks;
+    if (t == prev) return;
+
+    // Stolen or woken while its last CPU is still saving its context
+    while (t->on_cpu) cpu_relax();
+    t->on_cpu = 1;
+    t->cpu = cpu->id;
+
+    cpu->switch_start_tsc = rdtsc();
+    cpu->prev = prev;
+    if (t == idle) {
+        switch_address_space(kernel_page_dir);
+    } else {
+        switch_address_space(t->page_dir);
+        tss_set_kernel_stack((uint32_t)(t->stack + STACK_SIZE));
+        kdata_switch_in(t, cpu);
+    }
+    irq_account_switch(cpu);
+    fpu_switch_out(prev);
+    context_switch(&prev->kernel_esp, t->kernel_esp);
+    sched_finish_switch();
+}
+
+void sched_yield() {
+    schedule();
+}
+
+static void sched_halt(void) {
+    // Only one CPU gets to sync and report
+    if (__atomic_exchange_n(&sched_halting, 1, __ATOMIC_ACQ_REL))
+        while (1) asm volatile("cli; hlt");
+
+    sched_started = 0;   // the final sync polls the disk
+    sched_dump_stats();
+    irq_dump_stats();
+    fs_sync();
+    if (serial_dropped) {
+        char buf[12];
+        log("serial: dropped ");
+        int_to_chars(serial_dropped, buf, sizeof(buf)); log(buf);
+        log(" bytes\n");
+    }
+    serial_flush();   // nothing drains the ring once we halt
+    print("No tasks left. Halting.\n");
+    while (1) asm volatile("cli; hlt");
+}
+
+// Every CPU ends up here on its boot stack: run whatever is queued here or
+// can be stolen, otherwise halt with the tick stopped until the next timer
+// deadline or an interrupt (device, reschedule IPI from enqueue_task)
+void cpu_idle(void) {
+    Cpu* cpu = this_cpu();
+    while (1) {
+        if (sched_started && nr_tasks == 0) sched_halt();
+        schedule();
+
+        uint64_t start = clock_ns();
+        timer_idle_enter();
+        asm volatile("sti; hlt; cli");
+        timer_idle_exit();
+        cpu->idle_halts++;
+        cpu->idle_ns += clock_ns() - start;
+    }
+}
+
+static void sleep_timer_fn(Timer* t) {
+    wake_up((WaitQueue*)t->data);
+}
+
+// Sleep until clock_ns() reaches `deadline`: 0 then, -1 if killed first.
+// The timer is armed before taking the queue's lock, the callback takes
+// them in the opposite order.
+int sleep_until(uint64_t deadline) {
+    WaitQueue wq;
+    Timer timer;
+    wait_queue_init(&wq);
+    timer_init(&timer, sleep_timer_fn, &wq);
+    if (timer_add(&timer, deadline) != 0) return -2;
+
+    spin_lock(&wq.lock);
+    while (clock_ns() < deadline && !task_killed()) sleep_on(&wq, &wq.lock);
+    spin_unlock(&wq.lock);
+    timer_cancel(&timer);
+    return task_killed() ? -1 : 0;
+}
+
+// Timer tick on any CPU: charge the running task and preempt it once its
+// slice is used up. Kernel code runs with interrupts off, so this only
+// lands in user mode (or the idle hlt, which is left alone).
+void sched_tick(struct registers* r) {
+    Cpu* cpu = this_cpu();
+    Task* t = cpu->current;
+    if (!sched_started || t == &cpu->idle_task || (r->cs & 3) != 3) return;
+    if (t->killed) kill(t->id);
+    if (t->slice_left > 1) {
+        t->slice_left--;
+        return;
+    }
+    cpu->preemptions++;
+    schedule();
+    if (task_killed()) kill(current_task);
+}
+
+// Killing the current task never returns. Any other task may be in the
+// middle of a syscall holding locks, or running on another CPU, so it's
+// flagged, woken if blocked, and exits at its next safe point (end of
+// syscall, timer tick, first run).
+void kill(int id) {
+    Task* self = this_cpu()->current;
+    spin_lock(&task_lock);
+    Task* t = (id >= 0 && id < task_capacity) ? tasks[id] : NULL;
+    if (!t || t->state == TASK_ZOMBIE) {
+        spin_unlock(&task_lock);
+        return;
+    }
+
+    if (t != self) {
+        t->killed = 1;
+        wake_if_blocked(t);
+        spin_unlock(&task_lock);
+        return;
+    }
+    spin_unlock(&task_lock);
+
+    shm_release_all(t);
+    pipe_release_all(t);
+    fs_exit_sync();
+    fpu_release(t);
+    destroy_address_space(t->page_dir);
+    t->page_dir = NULL;
+    t->task_data = NULL;
+
+    // We're still on its kernel stack, the next task frees it
+    t->state = TASK_ZOMBIE;
+    __atomic_sub_fetch(&nr_tasks, 1, __ATOMIC_RELAXED);
+    schedule();
+}
+
+// A user access the page fault handler couldn't resolve
+void user_fault_kill(void) {
+    kill(current_task);
+}
+
+#endif
@@ -4,9 +4,27 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "basics.h"
+#include "helpers/port_io.h"
+#include "helpers/spinlock.h"
+#include "structs/registers.h"
 
 #define COM1 0x3F8
 
+#define SERIAL_IER_THRE 0x02     // interrupt when the transmit FIFO runs empty
+#define SERIAL_LSR_THRE 0x20     // transmit FIFO empty
+#define SERIAL_FIFO_SIZE 16      // bytes the 16550 takes per THRE
+#define SERIAL_TX_SIZE 8192      // power of two
+
+// log() only appends here; the FIFO is refilled from the IRQ4 handler, or
+// straight away when the transmitter is idle. Bytes that don't fit are
+// dropped and counted rather than making the caller wait on the UART.
+static char serial_tx[SERIAL_TX_SIZE];
+static uint32_t serial_tx_head;          // next byte to queue
+static uint32_t serial_tx_tail;          // next byte to send
+static Spinlock serial_lock = SPINLOCK_INIT;
+static int serial_irq_on;                // until then log writes synchronously
+volatile uint32_t serial_dropped;
+
 void serial_init() {
     outb(0x3F8 + 1, 0x00);    // Disable interrupts
     outb(0x3F8 + 3, 0x80);    // Enable DLAB
@@ -19,7 +37,7 @@ void serial_init() {
 
 
 int serial_is_transmit_ready() {
-    return inb(COM1 + 5) & 0x20;
+    return inb(COM1 + 5) & SERIAL_LSR_THRE;
 }
 
 void serial_write(char a) {
@@ -27,26 +45,68 @@ void serial_write(char a) {
     outb(COM1, a);
 }
 
-void log(const char* str) {
-    while (*str) {
-        char c = *str++;
-        serial_write(c);    
+// Hand the UART as much of the ring as its FIFO takes, if it has gone empty.
+// Caller holds serial_lock.
+static void serial_kick(void) {
+    if (serial_tx_tail == serial_tx_head || !serial_is_transmit_ready()) return;
+    for (int i = 0; i < SERIAL_FIFO_SIZE && serial_tx_tail != serial_tx_head; i++) {
+        outb(COM1, serial_tx[serial_tx_tail & (SERIAL_TX_SIZE - 1)]);
+        serial_tx_tail++;
     }
 }
 
 void log_buffer_n(const char *buffer, int len) {
-    for (int i = 0; i < len; i++) {
-        serial_write(buffer[i]);
+    if (!serial_irq_on) {
+        for (int i = 0; i < len; i++) serial_write(buffer[i]);
+        return;
+    }
+    spin_lock(&serial_lock);
+    uint32_t room = SERIAL_TX_SIZE - (serial_tx_head - serial_tx_tail);
+    if ((uint32_t)len > room) {
+        serial_dropped += len - room;
+        len = room;
     }
+    // At most two copies: up to the end of the ring, then from its start
+    uint32_t at = serial_tx_head & (SERIAL_TX_SIZE - 1);
+    uint32_t first = SERIAL_TX_SIZE - at;
+    if (first > (uint32_t)len) first = len;
+    memcpy(&serial_tx[at], buffer, first);
+    memcpy(serial_tx, buffer + first, len - first);
+    serial_tx_head += len;
+    serial_kick();
+    spin_unlock(&serial_lock);
+}
+
+void log(const char* str) {
+    log_buffer_n(str, strlen(str));
 }
 
 void log_buffer(const char *buffer) {
-    while (*buffer != '\0') {
-        char str[2];
-        char c = *buffer++;
-        char_to_string(c,str);
-        log(str);
+    log(buffer);
+}
+
+// IRQ4: the FIFO ran dry. Reading IIR clears the THRE interrupt.
+void serial_irq_handler(struct registers *r) {
+    inb(COM1 + 2);
+    spin_lock(&serial_lock);
+    serial_kick();
+    spin_unlock(&serial_lock);
+}
+
+// Switch log() over to the ring once IRQ4 can be taken
+void serial_irq_start(void) {
+    serial_irq_on = 1;
+    outb(COM1 + 1, SERIAL_IER_THRE);
+}
+
+// Push out everything queued by polling the UART, for panics and halts.
+// Doesn't take serial_lock: the panicking CPU may be the one holding it.
+void serial_flush(void) {
+    while (serial_tx_tail != serial_tx_head) {
+        serial_write(serial_tx[serial_tx_tail & (SERIAL_TX_SIZE - 1)]);
+        serial_tx_tail++;
     }
+    serial_irq_on = 0;   // anything after this is written directly
 }
 
 #endif
@@ -0,0 +1,98 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include "helpers/basics.h"
+#include "helpers/serial.h"
+#include "helpers/cpu.h"
+#include "helpers/pmm.h"
+#include "helpers/paging.h"
+#include "helpers/percpu.h"
+#include "helpers/acpi.h"
+#include "helpers/apic.h"
+#include "helpers/pit.h"
+#include "helpers/idt.h"
+#include "helpers/sched.h"
+
+#define AP_TRAMPOLINE_ADDR 0x8000        // AP_BASE in ap_trampoline.asm, below 1 MB and page aligned
+#define AP_STACK_SIZE 16384
+
+// ap_trampoline.asm
+extern char ap_trampoline_start[], ap_trampoline_end[];
+extern uint32_t ap_boot_cr3, ap_boot_cr4, ap_boot_stack, ap_boot_entry, ap_boot_cpu;
+
+// A trampoline variable in the low-memory copy the AP actually runs
+static volatile uint32_t* trampoline_var(uint32_t* var) {
+    uint32_t offset = (uint8_t*)var - (uint8_t*)ap_trampoline_start;
+    return (volatile uint32_t*)phys_to_virt(AP_TRAMPOLINE_ADDR + offset);
+}
+
+// First C code on an AP, on the stack smp_boot gave it with paging already on
+static void ap_main(int id) {
+    Cpu* c = &cpus[id];
+    cpu_setup(id, c->stack_top);
+    idt_load();
+    c->page_dir = kernel_page_dir;
+    lapic_enable();
+    lapic_timer_start();
+    __atomic_store_n(&c->started, 1, __ATOMIC_RELEASE);
+
+    char buf[12];
+    log("smp: cpu ");
+    int_to_chars(id, buf, sizeof(buf)); log(buf);
+    log(" in cpu_idle\n");
+    cpu_idle();
+}
+
+// Start every other CPU the MADT lists, one at a time since they share the
+// trampoline. Each gets its own stack, GDT and TSS, and from cpu_idle pulls
+// work off the other CPUs' queues.
+void smp_boot(void) {
+    if (!apic_enabled || acpi_cpu_count < 2) return;
+
+    memcpy(phys_to_virt(AP_TRAMPOLINE_ADDR), ap_trampoline_start, ap_trampoline_end - ap_trampoline_start);
+    *trampoline_var(&ap_boot_cr3) = page_dir_phys(kernel_page_dir);
+    *trampoline_var(&ap_boot_cr4) = read_cr4();
+    *trampoline_var(&ap_boot_entry) = (uint32_t)ap_main;
+
+    for (int i = 0; i < acpi_cpu_count && cpu_count < MAX_CPUS; i++) {
+        uint8_t apic_id = acpi_apic_ids[i];
+        if (apic_id == this_cpu()->apic_id) continue;
+
+        uint32_t stack = pmm_alloc_contiguous(AP_STACK_SIZE / PAGE_SIZE);
+        if (!stack) break;
+
+        Cpu* c = &cpus[cpu_count];
+        c->apic_id = apic_id;
+        c->stack_top = (uint32_t)phys_to_virt(stack) + AP_STACK_SIZE;
+        *trampoline_var(&ap_boot_stack) = c->stack_top;
+        *trampoline_var(&ap_boot_cpu) = cpu_count;
+
+        // INIT, then the startup IPI twice as the MP spec asks. The vector
+        // is the trampoline's page number.
+        lapic_send_ipi(apic_id, ICR_INIT | ICR_ASSERT);
+        pit_delay_us(10000);
+        for (int n = 0; n < 2 && !c->started; n++) {
+            lapic_send_ipi(apic_id, ICR_STARTUP | (AP_TRAMPOLINE_ADDR >> 12));
+            pit_delay_us(200);
+        }
+        for (int ms = 0; ms < 100 && !c->started; ms++) pit_delay_us(1000);
+
+        if (!c->started) {
+            // Park it again so a late start can't run on a freed stack
+            lapic_send_ipi(apic_id, ICR_INIT | ICR_ASSERT);
+            pmm_free_contiguous(stack, AP_STACK_SIZE / PAGE_SIZE);
+            memset(c, 0, sizeof(Cpu));
+            log("smp: a CPU didn't start\n");
+            continue;
+        }
+        cpu_count++;
+    }
+
+    char buf[12];
+    log("smp: ");
+    int_to_chars(cpu_count, buf, sizeof(buf)); log_buffer(buf);
+    log(" CPUs online\n");
+}
+
+#endif
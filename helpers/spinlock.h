@@ -0,0 +1,29 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+
+// Kernel code runs with interrupts off, so a plain test-and-set lock is
+// enough: an IRQ handler can't interrupt a holder on the same CPU.
+typedef struct {
+    volatile uint32_t locked;
+} Spinlock;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spin_lock(Spinlock* l) {
+    while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE)) {
+        // Spin on a plain read so waiters don't bounce the cache line
+        while (l->locked) __asm__ volatile ("pause");
+    }
+}
+
+static inline int spin_trylock(Spinlock* l) {
+    return !__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_unlock(Spinlock* l) {
+    __atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "helpers/basics.h"
+#include "helpers/serial.h"
+#include "helpers/cpu.h"
+#include "helpers/pit.h"
+#include "helpers/heap.h"
+#include "helpers/spinlock.h"
+#include "helpers/percpu.h"
+#include "helpers/apic.h"
+
+#define NSEC_PER_SEC  1000000000u
+#define NSEC_PER_USEC 1000u
+#define NSEC_PER_TICK (NSEC_PER_SEC / PIT_HZ)
+#define TIMER_NEVER   0xFFFFFFFFFFFFFFFFull
+#define TIMER_IDLE_MAX_NS NSEC_PER_SEC        // longest one-shot sleep of an idle CPU
+#define CLOCK_CALIBRATE_US 50000
+#define CPUID_EDX_TSC (1u << 4)
+
+#define CLOCK_MONOTONIC 1
+
+struct timespec {
+    uint32_t tv_sec;
+    uint32_t tv_nsec;
+};
+
+// Armed timers sit in a min-heap on their deadline. The callback runs in
+// interrupt context with timer_lock held: it must be short and can't touch
+// timers itself.
+typedef struct Timer {
+    uint64_t deadline;          // clock_ns() value
+    void (*fn)(struct Timer*);
+    void* data;
+    int index;                  // heap slot, -1 when not armed
+} Timer;
+
+// Clocksource: the TSC, calibrated against the PIT once at boot.
+// ns = cycles * tsc_ns_mult >> 24.
+uint32_t tsc_khz = 0;
+uint32_t tsc_ns_mult = 0;
+uint64_t clock_base_tsc = 0;
+
+static Timer** timer_heap = NULL;
+static int timer_capacity = 0;
+static volatile int timer_count = 0;
+Spinlock timer_lock;
+uint32_t timers_fired = 0;
+
+// 64 by 32 bit division, two divl steps since libgcc isn't linked
+static inline uint64_t div_u64(uint64_t n, uint32_t d) {
+    uint32_t hi = (uint32_t)(n >> 32), lo = (uint32_t)n;
+    uint32_t q_hi = hi / d, r = hi % d, q_lo;
+    __asm__ ("divl %4" : "=a"(q_lo), "=d"(r) : "a"(lo), "d"(r), "rm"(d));
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
+
+static inline uint64_t tsc_to_ns(uint64_t cycles) {
+    uint64_t lo = (uint64_t)(uint32_t)cycles * tsc_ns_mult;
+    uint64_t hi = (uint64_t)(uint32_t)(cycles >> 32) * tsc_ns_mult;
+    return (hi << 8) + (lo >> 24);
+}
+
+// Nanoseconds since clock_init. Without a TSC it falls back to PIT ticks.
+uint64_t clock_ns(void) {
+    if (tsc_ns_mult) return tsc_to_ns(rdtsc() - clock_base_tsc);
+    return (uint64_t)timer_ticks * NSEC_PER_TICK;
+}
+
+void clock_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    if (!(d & CPUID_EDX_TSC)) {
+        log("clock: no TSC, using PIT ticks\n");
+        return;
+    }
+
+    uint64_t start = rdtsc();
+    pit_delay_us(CLOCK_CALIBRATE_US);
+    uint64_t end = rdtsc();
+
+    tsc_khz = (uint32_t)(end - start) / (CLOCK_CALIBRATE_US / 1000);
+    tsc_ns_mult = (uint32_t)div_u64((uint64_t)1000000 << 24, tsc_khz);
+    clock_base_tsc = end;
+
+    char buf[12];
+    log("clock: TSC at ");
+    int_to_chars(tsc_khz, buf, sizeof(buf)); log_buffer(buf);
+    log(" kHz\n");
+}
+
+// Busy-wait, for the short hardware delays that aren't worth a sleep
+void udelay(uint32_t us) {
+    uint64_t end = clock_ns() + (uint64_t)us * NSEC_PER_USEC;
+    while (clock_ns() < end) cpu_relax();
+}
+
+void timer_init(Timer* t, void (*fn)(Timer*), void* data) {
+    t->deadline = 0;
+    t->fn = fn;
+    t->data = data;
+    t->index = -1;
+}
+
+static void timer_heap_set(int i, Timer* t) {
+    timer_heap[i] = t;
+    t->index = i;
+}
+
+static void timer_sift_up(int i) {
+    Timer* t = timer_heap[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (timer_heap[parent]->deadline <= t->deadline) break;
+        timer_heap_set(i, timer_heap[parent]);
+        i = parent;
+    }
+    timer_heap_set(i, t);
+}
+
+static void timer_sift_down(int i) {
+    Timer* t = timer_heap[i];
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= timer_count) break;
+        if (child + 1 < timer_count && timer_heap[child + 1]->deadline < timer_heap[child]->deadline)
+            child++;
+        if (t->deadline <= timer_heap[child]->deadline) break;
+        timer_heap_set(i, timer_heap[child]);
+        i = child;
+    }
+    timer_heap_set(i, t);
+}
+
+// With timer_lock held
+static void timer_heap_remove(Timer* t) {
+    int i = t->index;
+    Timer* last = timer_heap[--timer_count];
+    t->index = -1;
+    if (last == t) return;
+
+    timer_heap_set(i, last);
+    if (i > 0 && timer_heap[(i - 1) / 2]->deadline > last->deadline) timer_sift_up(i);
+    else timer_sift_down(i);
+}
+
+// Arm (or re-arm) `t` to fire once clock_ns() reaches `deadline`
+int timer_add(Timer* t, uint64_t deadline) {
+    spin_lock(&timer_lock);
+    if (t->index >= 0) timer_heap_remove(t);
+    if (timer_count == timer_capacity && grow_table((void***)&timer_heap, &timer_capacity) != 0) {
+        spin_unlock(&timer_lock);
+        return -1;
+    }
+    t->deadline = deadline;
+    timer_heap[timer_count] = t;
+    t->index = timer_count++;
+    timer_sift_up(t->index);
+    spin_unlock(&timer_lock);
+    return 0;
+}
+
+// Once this returns the callback isn't running and won't run
+void timer_cancel(Timer* t) {
+    spin_lock(&timer_lock);
+    if (t->index >= 0) timer_heap_remove(t);
+    spin_unlock(&timer_lock);
+}
+
+uint64_t timer_next_deadline(void) {
+    spin_lock(&timer_lock);
+    uint64_t next = timer_count ? timer_heap[0]->deadline : TIMER_NEVER;
+    spin_unlock(&timer_lock);
+    return next;
+}
+
+// From the tick (or the idle one-shot) on any CPU
+void timer_run_expired(void) {
+    if (timer_count == 0) return;
+    uint64_t now = clock_ns();
+    spin_lock(&timer_lock);
+    while (timer_count && timer_heap[0]->deadline <= now) {
+        Timer* t = timer_heap[0];
+        timer_heap_remove(t);
+        t->fn(t);
+        timers_fired++;
+    }
+    spin_unlock(&timer_lock);
+}
+
+// Tickless idle: instead of waking every tick, stop the periodic LAPIC
+// timer and program a one-shot for the next deadline. With nothing armed
+// only an interrupt (device, reschedule IPI) wakes the CPU. The PIT
+// fallback keeps ticking.
+void timer_idle_enter(void) {
+    if (!apic_enabled) return;
+
+    uint64_t next = timer_next_deadline();
+    if (next == TIMER_NEVER) {
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+        lapic_write(LAPIC_TIMER_INIT, 0);
+        return;
+    }
+
+    uint64_t now = clock_ns();
+    uint64_t delta = next > now ? next - now : 0;
+    if (delta > TIMER_IDLE_MAX_NS) delta = TIMER_IDLE_MAX_NS;
+    uint32_t counts = (uint32_t)div_u64(delta * lapic_timer_count, NSEC_PER_TICK);
+    lapic_write(LAPIC_LVT_TIMER, APIC_TIMER_VECTOR);     // one-shot
+    lapic_write(LAPIC_TIMER_INIT, counts ? counts : 1);
+}
+
+void timer_idle_exit(void) {
+    if (apic_enabled) lapic_timer_start();
+}
+
+#endif
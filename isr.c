@@ -3,18 +3,31 @@
 #include "helpers/basics.h"
 #include "structs/registers.h" // make sure this exists and defines `struct registers`
 
+int irq_dispatch(struct registers *r);   // helpers/irq.h: acknowledges, counts and runs handlers
+
+static const char* exception_names[32] = {
+    "Divide error", "Debug", "NMI", "Breakpoint", "Overflow", "Bound range",
+    "Invalid opcode", "Device not available", "Double fault", "Coprocessor overrun",
+    "Invalid TSS", "Segment not present", "Stack fault", "General protection",
+    "Page fault", "Reserved", "x87 error", "Alignment check", "Machine check",
+    "SIMD error", "Virtualization", "Control protection", "Reserved", "Reserved",
+    "Reserved", "Reserved", "Reserved", "Reserved", "Hypervisor injection",
+    "VMM communication", "Security", "Reserved",
+};
+
 char buffer_hex[12];
 
-void isr_handler(struct registers **r) {
-    if ((*r)->int_no == 14) {
-        uint32_t cr2;
-        asm volatile("mov %%cr2, %0" : "=r"(cr2));
-    
-        print("PAGE FAULT at ");
-        int_to_chars(cr2, buffer_hex, sizeof(buffer_hex));
-        print_buffer(buffer_hex);
-        print("\n");
-        panic("Unhandled page fault");
-    }
-}
+void isr_handler(struct registers *r) {
+    if (irq_dispatch(r)) return;
 
+    print("EXCEPTION: ");
+    print(r->int_no < 32 ? exception_names[r->int_no] : "unknown");
+    print(" err ");
+    int_to_chars(r->err_code, buffer_hex, sizeof(buffer_hex));
+    print_buffer(buffer_hex);
+    print(" eip ");
+    int_to_chars(r->eip, buffer_hex, sizeof(buffer_hex));
+    print_buffer(buffer_hex);
+    print("\n");
+    panic("Unhandled exception");
+}
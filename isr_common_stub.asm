@@ -2,30 +2,37 @@
 extern isr_handler
 
 global isr_common_stub
+global isr_return
 
+; Stack on entry: error code and vector on top of the CPU's frame.
+; Builds a struct registers underneath them.
 isr_common_stub:
+    cld                  ; the C code expects it, user code may have set DF
     pusha
-    push ds
-    push es
-    push fs
-    push gs
+    mov ax, ds
+    push eax             ; Save the interrupted data segment
 
     ; Set up segment registers
     mov ax, 0x10
     mov ds, ax
     mov es, ax
     mov fs, ax
+    mov ax, 0x30        ; per-CPU data segment
     mov gs, ax
 
     push esp             ; Pass pointer to registers
     call isr_handler     ; Call the C ISR handler
     add esp, 4
 
-    pop gs
-    pop fs
-    pop es
-    pop ds
+; Also entered directly with esp pointing at a struct registers to start or
+; resume a task in user mode
+isr_return:
+    pop eax
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov ax, 0x30        ; iret to ring 3 nulls it again
+    mov gs, ax
     popa
-    add esp, 4           ; pop error code or fake placeholder
+    add esp, 8           ; pop vector and error code
     iret
-
@@ -1,12 +1,100 @@
 global isr_stub_table
+global irq_stub_table
+global isr64
+global isr240
+global isr255
 extern isr_common_stub
 
+; The CPU pushes an error code for some exceptions, the rest get a dummy 0
+; so every frame has the same layout
+%macro ISR_NOERR 1
+isr%1:
+    push dword 0
+    push dword %1
+    jmp isr_common_stub
+%endmacro
+
+%macro ISR_ERR 1
+isr%1:
+    push dword %1
+    jmp isr_common_stub
+%endmacro
+
 section .text
+ISR_NOERR 0
+ISR_NOERR 1
+ISR_NOERR 2
+ISR_NOERR 3
+ISR_NOERR 4
+ISR_NOERR 5
+ISR_NOERR 6
+ISR_NOERR 7
+ISR_ERR   8
+ISR_NOERR 9
+ISR_ERR   10
+ISR_ERR   11
+ISR_ERR   12
+ISR_ERR   13
+ISR_ERR   14
+ISR_NOERR 15
+ISR_NOERR 16
+ISR_ERR   17
+ISR_NOERR 18
+ISR_NOERR 19
+ISR_NOERR 20
+ISR_ERR   21
+ISR_NOERR 22
+ISR_NOERR 23
+ISR_NOERR 24
+ISR_NOERR 25
+ISR_NOERR 26
+ISR_NOERR 27
+ISR_NOERR 28
+ISR_ERR   29
+ISR_ERR   30
+ISR_NOERR 31
+
+; Hardware IRQs after the PIC remap, vector 0x20 + n
+%macro IRQ 1
+irq%1:
+    push dword 0
+    push dword 32 + %1
+    jmp isr_common_stub
+%endmacro
+
+IRQ 0
+IRQ 1
+IRQ 2
+IRQ 3
+IRQ 4
+IRQ 5
+IRQ 6
+IRQ 7
+IRQ 8
+IRQ 9
+IRQ 10
+IRQ 11
+IRQ 12
+IRQ 13
+IRQ 14
+IRQ 15
+
+; Local APIC vectors: timer, reschedule IPI, spurious
+ISR_NOERR 64
+ISR_NOERR 240
+ISR_NOERR 255
+
+section .data
 isr_stub_table:
 %assign i 0
 %rep 32
-    push byte i
-    jmp isr_common_stub
+    dd isr%+i
 %assign i i+1
 %endrep
 
+irq_stub_table:
+%assign i 0
+%rep 16
+    dd irq%+i
+%assign i i+1
+%endrep
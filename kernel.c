@@ -1,5 +1,9 @@
+#define MULTIBOOT_HEADER_FLAGS 0x00000007 // page-align modules, provide memory info + map, video mode
+
 __attribute__((section(".multiboot"))) volatile unsigned long header[] = {
-    0x1BADB002, 0x0, -(0x1BADB002)
+    0x1BADB002, MULTIBOOT_HEADER_FLAGS, -(0x1BADB002 + MULTIBOOT_HEADER_FLAGS),
+    0, 0, 0, 0, 0,     // load addresses, only used for a.out kernels
+    0, 1024, 768, 32   // linear framebuffer, preferred size and depth
 };
 
 #include <stdint.h>
@@ -9,25 +13,33 @@ __attribute__((section(".multiboot"))) volatile unsigned long header[] = {
 #include "helpers/serial.h"
 #include "helpers/disk.h"
 #include "structs/structs.h"
+#include "helpers/pmm.h"
+#include "helpers/cpu.h"
+#include "helpers/gdt.h"
+#include "helpers/paging.h"
+#include "helpers/fbcon.h"
+#include "helpers/percpu.h"
+#include "helpers/pic.h"
+#include "helpers/apic.h"
+#include "helpers/timer.h"
+#include "helpers/kdata.h"
+#include "helpers/membench.h"
+#include "helpers/irq.h"
 #include "filesystem/filesystem.h"
 #include "posix/posix.h"
 #include "helpers/idt.h"
+#include "helpers/smp.h"
 #include "structs/interrupts.h"
 
-#define USER_PROG_LOAD_ADDR 0x400000
-#define USER_STACK_TOP      0x800000
 #define MAX_INPUT 64
-#define MAX_BLOCKS 4096
 #define ATA_SR_BSY 0x80
 #define ATA_SR_DRQ 0x08
 #define FD_PIPE_READ(pipe_id)  (1000 + (pipe_id) * 2)
 #define FD_PIPE_WRITE(pipe_id) (1000 + (pipe_id) * 2 + 1)
 #define FS_MAGIC 0x5346 // 'SF' in little endian
-#define MAX_INTERRUPTS 256
 
 // At the top of kernel.c:
 void register_interrupt_handler(int n, void (*handler)(struct registers*));
-int load_user_program(const char* filename);
 extern void syscall_entry();  // defined in assembly or C stub
 
 
@@ -49,7 +61,6 @@ int ata_read_sector(uint32_t lba, void* buffer);
 int ata_write_sector(uint32_t lba, const void* buffer);
 void init_filesystem_if_empty(void);
 void dump_block_0(void);
-void initialize_next_free_block(void);
 
 char input_buffer[MAX_INPUT];
 extern char _text_start[];
@@ -59,36 +70,10 @@ int filesystem_initialized = 0;
 char mem_buf[24];
 extern uint32_t magic_number;
 extern uint32_t mb_info_ptr;
-static void (*interrupt_handlers[MAX_INTERRUPTS])(struct registers *);
-
-void register_interrupt_handler(int n, void (*handler)(struct registers *r)) {
-    if (n >= 0 && n < MAX_INTERRUPTS) {
-        interrupt_handlers[n] = handler;
-    }
-}
-
-int task_create(void (*entry)(void)) {
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if (!tasks[i].active) {
-            tasks[i].entry = entry;
-            tasks[i].active = 1;
-
-            // Zero out the stack (optional)
-            for (int j = 0; j < STACK_SIZE; j++)
-                tasks[i].stack[j] = 0;
-
-            return i;
-        }
-    }
-    return -1; // No slot
-}
+extern char boot_stack_top[];
 
 void clear_screen() {
-    volatile char *video = (volatile char*)0xB8000;
-    for (int i = 0; i < 80 * 25; i++) {
-        video[i * 2] = ' ';       // Character
-        video[i * 2 + 1] = 0x07;  // Attribute: light gray on black
-    }
+    console_clear();
 }
 
 void debug_sector_data(const void* buffer, const char* label) {
@@ -132,7 +117,12 @@ void init_filesystem(void) {
         print("Valid filesystem found. Loading...\n");
         memcpy(&superblock, disk_sb, sizeof(Superblock));
         load_file_table();
+        load_allocation_summary();
         filesystem_initialized = 1;
+
+        print("Next free block: ");
+        int_to_chars(next_free_block, buffer, sizeof(buffer));
+        print_buffer(buffer); print("\n");
         return;
     }
     
@@ -146,6 +136,10 @@ void init_filesystem(void) {
     sb->file_table_start = 1;
     sb->file_table_length = MAX_FILE_ENTRIES;
     sb->data_start = FILE_TABLE_BLOCKS + 1;
+    sb->summary_magic = FS_SUMMARY_MAGIC;
+    sb->state = FS_STATE_CLEAN;
+    sb->free_blocks = sb->total_blocks - sb->data_start;
+    sb->high_water = 0;
     
     // Write the superblock to disk
     if (ata_write_sector(0, sector) != 0) {
@@ -158,30 +152,17 @@ void init_filesystem(void) {
     
     // Initialize empty file table
     print("Initializing empty file table...\n");
-    memset(file_table, 0, sizeof(file_table));
+    if (alloc_file_table(FILE_TABLE_BLOCKS) != 0) {
+        print("Out of memory for file table\n");
+        return;
+    }
     save_file_table();
+    load_allocation_summary();
     filesystem_initialized = 1;
     print("Filesystem initialized successfully!\n");
 }
 
 
-void initialize_next_free_block() {
-    next_free_block = 0;
-
-    for (int i = 0; i < superblock.file_table_length; i++) {
-        if (!file_table[i].active) continue;
-
-        uint32_t end_block = file_table[i].start_block + (file_table[i].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-        if (end_block > next_free_block) {
-            next_free_block = end_block;
-        }
-    }
-
-    print("Next free block: ");
-    int_to_chars(next_free_block, buffer, sizeof(buffer));
-    print_buffer(buffer); print("\n");
-}
-
 void dump_block_0() {
     uint8_t buf[BLOCK_SIZE];
     disk_read_block(0, buf);
@@ -225,75 +206,396 @@ void switch_to_user_mode(void* entry_point, void* user_stack_top) {
 
 
 
-void syscall_handler(struct registers *r) {
-    switch (r->eax) {
-        case 1: // sys_exit
-            print("Process exited\n");
-            kill(current_task);
-            r->eax = 0;
-            break;
+// System calls. Each one takes the trap frame and returns the value for eax;
+// int 0x80 and sysenter both end up in syscall_handler, which indexes
+// syscall_table by the number in eax.
+static int sys_exit(struct registers *r) {
+    print("Process exited\n");
+    kill(current_task);
+    return 0;
+}
 
-        case 2: // sys_write(filename, data, size)
-            r->eax = write((const char*)r->ebx, (const void*)r->ecx, r->edx, DEFAULT_PERMS);
-            break;
+// sys_write(filename, data, size)
+static int sys_write(struct registers *r) {
+    return write((const char*)r->ebx, (const void*)r->ecx, r->edx, DEFAULT_PERMS);
+}
 
-        case 3: // sys_read(filename, buffer, max_size)
-            r->eax = read((const char*)r->ebx, (void*)r->ecx, r->edx);
-            break;
+// sys_read(filename, buffer, max_size)
+static int sys_read(struct registers *r) {
+    return read((const char*)r->ebx, (void*)r->ecx, r->edx);
+}
 
-        case 4: // sys_unlink(filename)
-            r->eax = unlink((const char*)r->ebx);
-            break;
+static int sys_unlink(struct registers *r) {
+    return unlink((const char*)r->ebx);
+}
 
-        case 5: // sys_rename(oldname, newname)
-            r->eax = rename((const char*)r->ebx, (const char*)r->ecx);
-            break;
+// sys_rename(oldname, newname)
+static int sys_rename(struct registers *r) {
+    return rename((const char*)r->ebx, (const char*)r->ecx);
+}
 
-        case 6: // sys_truncate(filename, len)
-            r->eax = truncate((const char*)r->ebx, (int)r->ecx);
-            break;
+// sys_truncate(filename, len)
+static int sys_truncate(struct registers *r) {
+    return truncate((const char*)r->ebx, (int)r->ecx);
+}
 
-        case 7: // sys_chmod(filename, new_perms)
-            r->eax = chmod((const char*)r->ebx, (uint8_t)r->ecx);
-            break;
+// sys_chmod(filename, new_perms)
+static int sys_chmod(struct registers *r) {
+    return chmod((const char*)r->ebx, (uint8_t)r->ecx);
+}
 
-        case 8: // sys_pipe(pipe_fds)
-            r->eax = pipe((int*)r->ebx);
-            break;
+// sys_pipe(pipe_fds)
+static int sys_pipe(struct registers *r) {
+    return pipe((int*)r->ebx);
+}
 
-        case 9: // sys_sched_yield()
-            sched_yield();
-            r->eax = 0;
-            break;
+static int sys_sched_yield(struct registers *r) {
+    sched_yield();
+    return 0;
+}
 
-        case 10: // sys_getchar()
-            r->eax = (uint32_t)getpress(); // blocking read from keyboard
-            break;
+static int sys_getchar(struct registers *r) {
+    return getpress();   // blocking read from keyboard
+}
 
-        case 11: // sys_kill(task_id)
-            kill((int)r->ebx);
-            r->eax = 0;
-            break;
+// sys_kill(task_id)
+static int sys_kill(struct registers *r) {
+    kill((int)r->ebx);
+    return 0;
+}
+
+static int sys_fork(struct registers *r) {
+    return fork(r);
+}
+
+// sys_exec(filename)
+static int sys_exec(struct registers *r) {
+    int ret = exec(current_task, (const char*)r->ebx);
+    if (ret == 0) {
+        // Start the new image on return from this syscall
+        *r = tasks[current_task]->user_regs;
+        switch_address_space(tasks[current_task]->page_dir);
+    }
+    return ret;
+}
+
+// sys_setpriority(task_id, priority)
+static int sys_setpriority(struct registers *r) {
+    return sched_set_priority((int)r->ebx, (int)r->ecx);
+}
+
+// sys_nanosleep(const struct timespec* req)
+static int sys_nanosleep(struct registers *r) {
+    return nanosleep((const struct timespec*)r->ebx);
+}
+
+// sys_clock_gettime(clock, struct timespec* tp)
+static int sys_clock_gettime(struct registers *r) {
+    return clock_gettime((int)r->ebx, (struct timespec*)r->ecx);
+}
+
+// sys_readv(filename, const struct iovec* iov, iovcnt)
+static int sys_readv(struct registers *r) {
+    return readv((const char*)r->ebx, (const struct iovec*)r->ecx, (int)r->edx);
+}
+
+// sys_writev(filename, const struct iovec* iov, iovcnt)
+static int sys_writev(struct registers *r) {
+    return writev((const char*)r->ebx, (const struct iovec*)r->ecx, (int)r->edx, DEFAULT_PERMS);
+}
 
-        default:
-            print("Unknown syscall: ");
-            int_to_chars(r->eax, buffer, sizeof(buffer));
-            print(buffer);
-            print("\n");
-            r->eax = -1;
+// sys_splice(src, dst, len)
+static int sys_splice(struct registers *r) {
+    return splice((const char*)r->ebx, (const char*)r->ecx, r->edx);
+}
+
+// sys_sendfile(src, dst, struct file_range* range): range->offset is advanced
+static int sys_sendfile(struct registers *r) {
+    struct file_range* range = (struct file_range*)r->edx;
+    return sendfile((const char*)r->ebx, (const char*)r->ecx, &range->offset, range->len);
+}
+
+// sys_close(pipe_fd)
+static int sys_close(struct registers *r) {
+    return close((const char*)r->ebx);
+}
+
+// sys_shm_create(name, size)
+static int sys_shm_create(struct registers *r) {
+    return shm_create((const char*)r->ebx, r->ecx);
+}
+
+// sys_shm_attach(name)
+static int sys_shm_attach(struct registers *r) {
+    return shm_attach((const char*)r->ebx);
+}
+
+// sys_shm_detach(addr)
+static int sys_shm_detach(struct registers *r) {
+    return shm_detach(r->ebx);
+}
+
+// sys_shm_notify(addr)
+static int sys_shm_notify(struct registers *r) {
+    return shm_notify(r->ebx);
+}
+
+// sys_shm_wait(addr, seen_seq)
+static int sys_shm_wait(struct registers *r) {
+    return shm_wait(r->ebx, r->ecx);
+}
+
+// sys_irq_stats(vector, IrqStat* out): counts and cycles over all CPUs
+static int sys_irq_stats(struct registers *r) {
+    return irq_get_stats(r->ebx, (IrqStat*)r->ecx);
+}
+
+// sys_io_setup(entries)
+static int sys_io_setup(struct registers *r) {
+    return io_setup(r->ebx);
+}
+
+static int sys_io_enter(struct registers *r);
+
+// Syscalls that touch the filesystem hold fs_lock, since the disk may put
+// the caller to sleep halfway through an update. SYS_NAMED ones only do when
+// ebx names a file rather than a pipe. SYS_RING ones can be queued on the
+// io_setup rings. SYS_FRAME ones get the trap frame itself, not a copy.
+#define SYS_FS    0x1
+#define SYS_NAMED 0x2
+#define SYS_RING  0x4
+#define SYS_FRAME 0x8
+
+// What ebx/ecx/edx hold, checked against the caller's page tables before
+// the call. Strings and iovec arrays are copied into the kernel and the
+// register pointed at the copy. A buffer's or array's length is in the next
+// register, a struct's is given with ARG_IN/ARG_OUT.
+#define ARG_VAL     0x0
+#define ARG_STR     0x1
+#define ARG_BUF_IN  0x2   // read by the kernel
+#define ARG_BUF_OUT 0x3   // written by the kernel
+#define ARG_IOV_IN  0x4
+#define ARG_IOV_OUT 0x5
+#define ARG_OBJ_IN  0x6
+#define ARG_OBJ_OUT 0x7   // written, and maybe read first
+#define ARG_KIND    0xF
+#define ARG_IN(type)  (ARG_OBJ_IN | sizeof(type) << 4)
+#define ARG_OUT(type) (ARG_OBJ_OUT | sizeof(type) << 4)
+
+#define SYS_BAD_ADDR -14  // like EFAULT: an argument isn't the caller's memory
+
+typedef struct {
+    int (*fn)(struct registers *r);
+    uint32_t flags;
+    uint16_t args[3];
+} SyscallEntry;
+
+static const SyscallEntry syscall_table[] = {
+    [1]  = { sys_exit,          0 },
+    [2]  = { sys_write,         SYS_FS | SYS_NAMED | SYS_RING, { ARG_STR, ARG_BUF_IN } },
+    [3]  = { sys_read,          SYS_FS | SYS_NAMED | SYS_RING, { ARG_STR, ARG_BUF_OUT } },
+    [4]  = { sys_unlink,        SYS_FS | SYS_RING,             { ARG_STR } },
+    [5]  = { sys_rename,        SYS_FS | SYS_RING,             { ARG_STR, ARG_STR } },
+    [6]  = { sys_truncate,      SYS_FS | SYS_RING,             { ARG_STR } },
+    [7]  = { sys_chmod,         SYS_FS | SYS_RING,             { ARG_STR } },
+    [8]  = { sys_pipe,          SYS_RING,                      { ARG_OUT(int[2]) } },
+    [9]  = { sys_sched_yield,   0 },
+    [10] = { sys_getchar,       0 },
+    [11] = { sys_kill,          0 },
+    [12] = { sys_fork,          SYS_FRAME },
+    [13] = { sys_exec,          SYS_FS | SYS_FRAME,            { ARG_STR } },   // exec copies the name itself
+    [14] = { sys_setpriority,   0 },
+    [15] = { sys_nanosleep,     0,                             { ARG_IN(struct timespec) } },
+    [16] = { sys_clock_gettime, 0,                             { ARG_VAL, ARG_OUT(struct timespec) } },
+    [17] = { sys_io_setup,      0 },
+    [18] = { sys_io_enter,      0 },
+    [19] = { sys_readv,         SYS_FS | SYS_NAMED | SYS_RING, { ARG_STR, ARG_IOV_OUT } },
+    [20] = { sys_writev,        SYS_FS | SYS_NAMED | SYS_RING, { ARG_STR, ARG_IOV_IN } },
+    [21] = { sys_splice,        SYS_RING,                      { ARG_STR, ARG_STR } },   // takes fs_lock itself, only around disk I/O
+    [22] = { sys_shm_create,    0,                             { ARG_STR } },
+    [23] = { sys_shm_attach,    0,                             { ARG_STR } },
+    [24] = { sys_shm_detach,    0 },
+    [25] = { sys_shm_notify,    SYS_RING },
+    [26] = { sys_shm_wait,      0 },
+    [27] = { sys_irq_stats,     0,                             { ARG_VAL, ARG_OUT(IrqStat) } },
+    [28] = { sys_sendfile,      SYS_RING,                      { ARG_STR, ARG_STR, ARG_OUT(struct file_range) } },   // like splice
+    [29] = { sys_close,         SYS_RING,                      { ARG_STR } },
+};
+
+#define NR_SYSCALLS (sizeof(syscall_table) / sizeof(syscall_table[0]))
+
+// Kernel copies of a call's strings and iovec array
+typedef struct {
+    char str[2][MAX_FILENAME_LEN];
+    struct iovec iov[IOV_MAX];
+} SyscallArgs;
+
+// Check the pointer arguments in r against the caller's address space and
+// swap in kernel copies where the table asks for them. Returns 0 if the call
+// can go ahead.
+static int syscall_import_args(const SyscallEntry* sys, struct registers* r, SyscallArgs* copy) {
+    uint32_t* regs[3] = { &r->ebx, &r->ecx, &r->edx };
+    int strings = 0;
+    for (int i = 0; i < 3; i++) {
+        uint32_t kind = sys->args[i] & ARG_KIND;
+        uint32_t v = *regs[i];
+        uint32_t next = i < 2 ? *regs[i + 1] : 0;
+        switch (kind) {
+        case ARG_STR:
+            if (user_string_copy(copy->str[strings], v, MAX_FILENAME_LEN) != 0) return -1;
+            *regs[i] = (uint32_t)copy->str[strings++];
             break;
+        case ARG_BUF_IN:
+        case ARG_BUF_OUT:
+            if (!user_range_ok(v, next, kind == ARG_BUF_OUT)) return -1;
+            break;
+        case ARG_IOV_IN:
+        case ARG_IOV_OUT:
+            if (next == 0 || next > IOV_MAX || !user_range_ok(v, next * sizeof(struct iovec), 0)) return -1;
+            memcpy(copy->iov, (const void*)v, next * sizeof(struct iovec));
+            for (uint32_t j = 0; j < next; j++)
+                if (!user_range_ok((uint32_t)copy->iov[j].iov_base, copy->iov[j].iov_len, kind == ARG_IOV_OUT))
+                    return -1;
+            *regs[i] = (uint32_t)copy->iov;
+            break;
+        case ARG_OBJ_IN:
+        case ARG_OBJ_OUT:
+            if (!user_range_ok(v, sys->args[i] >> 4, kind == ARG_OBJ_OUT)) return -1;
+            break;
+        }
+    }
+    return 0;
+}
+
+static int syscall_needs_fs(const SyscallEntry* sys, uint32_t arg1) {
+    if (!(sys->flags & SYS_FS)) return 0;
+    return !(sys->flags & SYS_NAMED) || pipe_fd_from_name((const char*)arg1) < 0;
+}
+
+// sys_io_enter(to_submit): run up to `to_submit` queued requests, in order,
+// and return how many were consumed. Runs of filesystem requests share one
+// fs_lock hold, and their file table updates go to disk together when it's
+// dropped. A request is only taken while its completion has room.
+static int sys_io_enter(struct registers *r) {
+    Task* t = tasks[current_task];
+    uint32_t entries = t->ring_entries;   // the copy in the ring is the task's to scribble on
+    if (!entries) return -1;
+
+    IoRing* ring = (IoRing*)USER_IO_RING_ADDR;
+    IoSqe* sq = io_ring_sqes(ring, entries);
+    IoCqe* cq = io_ring_cqes(ring, entries);
+    uint32_t sq_head = ring->sq_head, cq_tail = ring->cq_tail;
+    uint32_t sq_tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+    int fs_held = 0, done = 0;
+
+    while ((uint32_t)done < r->ebx && sq_head != sq_tail && !task_killed()) {
+        if (cq_tail - __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE) >= entries) break;
+
+        IoSqe sqe = sq[sq_head & (entries - 1)];
+        const SyscallEntry* sys = sqe.op < NR_SYSCALLS ? &syscall_table[sqe.op] : NULL;
+        int res = -1;
+        if (sys && (sys->flags & SYS_RING)) {
+            struct registers regs;
+            SyscallArgs copy;
+            memset(&regs, 0, sizeof(regs));
+            regs.eax = sqe.op;
+            regs.ebx = sqe.args[0];
+            regs.ecx = sqe.args[1];
+            regs.edx = sqe.args[2];
+            if (syscall_import_args(sys, &regs, &copy) != 0) {
+                res = SYS_BAD_ADDR;
+            } else {
+                int fs_call = syscall_needs_fs(sys, regs.ebx);
+                if (fs_call && !fs_held) {
+                    mutex_lock(&fs_lock);
+                    fs_batch_begin();
+                } else if (!fs_call && fs_held) {
+                    fs_batch_end();   // a pipe request may block, don't hold up other tasks' file I/O
+                    mutex_unlock(&fs_lock);
+                }
+                fs_held = fs_call;
+                res = sys->fn(&regs);
+            }
+        }
+
+        cq[cq_tail & (entries - 1)].user_data = sqe.user_data;
+        cq[cq_tail & (entries - 1)].res = res;
+        cq_tail++;
+        sq_head++;
+        __atomic_store_n(&ring->cq_tail, cq_tail, __ATOMIC_RELEASE);
+        __atomic_store_n(&ring->sq_head, sq_head, __ATOMIC_RELEASE);
+        done++;
     }
+
+    if (fs_held) {
+        fs_batch_end();
+        fs_sync_if_stale();
+        mutex_unlock(&fs_lock);
+    }
+    return done;
 }
 
-void user_task_entry() {
-    load_user_program("init");
+void syscall_handler(struct registers *r) {
+    const SyscallEntry* sys = r->eax < NR_SYSCALLS ? &syscall_table[r->eax] : NULL;
+    if (!sys || !sys->fn) {
+        print("Unknown syscall: ");
+        int_to_chars(r->eax, buffer, sizeof(buffer));
+        print(buffer);
+        print("\n");
+        r->eax = -1;
+        return;
+    }
+
+    // The call sees a copy of the frame with its pointers checked and its
+    // strings moved into the kernel, so the user's registers come back as they were
+    struct registers args = *r;
+    SyscallArgs copy;
+    if (syscall_import_args(sys, &args, &copy) != 0) {
+        r->eax = SYS_BAD_ADDR;
+        return;
+    }
+
+    int fs_call = syscall_needs_fs(sys, args.ebx);
+    if (fs_call) mutex_lock(&fs_lock);
+
+    r->eax = sys->fn((sys->flags & SYS_FRAME) ? r : &args);
+
+    if (fs_call) {
+        fs_sync_if_stale();
+        mutex_unlock(&fs_lock);
+    }
+    if (task_killed()) kill(current_task);   // killed by another task meanwhile
+}
+
+// PIT on IRQ0, only used when there's no local APIC
+void timer_handler(struct registers *r) {
+    timer_ticks++;
+    kdata_tick();
+    console_tick();
+    timer_run_expired();
+    sched_tick(r);
+}
+
+// Local APIC timer: the scheduler tick on every busy CPU, or the one-shot
+// an idle CPU programmed for the next timer deadline
+void lapic_timer_handler(struct registers *r) {
+    if (this_cpu()->id == 0) {
+        timer_ticks++;
+        kdata_tick();
+        console_tick();
+    }
+    timer_run_expired();
+    sched_tick(r);
 }
 
 void kernel_main() {
     multiboot_info_t* mb_info = (multiboot_info_t*)mb_info_ptr;
     serial_init();
     clear_screen();
-    idt_install(); 
+    cpu_setup(0, (uint32_t)boot_stack_top);
+    mem_init();   // memcpy/memset variant for this CPU
+    idt_install();
+    idt_set_gate(0x80, (uint32_t)syscall_entry, 0x08, 0xEE);   // DPL 3 so user code can int 0x80
     print_buffer("Total Memory (MB): ");
     int_to_chars(((mb_info->mem_lower + mb_info->mem_upper) / 1024), mem_buf, sizeof(mem_buf));
     print_buffer(mem_buf);
@@ -305,6 +607,22 @@ void kernel_main() {
     print_buffer(buffer);
     print("\n");
 
+    pmm_init(mb_info);
+    paging_init();
+    fbcon_init(mb_info);   // keeps VGA text mode if GRUB gave us no usable framebuffer
+    clock_init();
+    register_interrupt_handler(7, fpu_nm_handler);   // lazy FPU switching
+    register_interrupt_handler(14, page_fault_handler);
+    heap_init();
+    init_object_caches();
+#ifdef MEMBENCH
+    mem_benchmark();
+#endif
+    print("Free Memory (MB): ");
+    int_to_chars(pmm_free_frames / (1024 * 1024 / PAGE_SIZE), buffer, sizeof(buffer));
+    print_buffer(buffer);
+    print("\n");
+
     // Test ATA drive before filesystem operations
     if (ata_identify_drive() != 0) {
         print("WARNING: No ATA drive detected. Filesystem operations will fail.\n");
@@ -320,7 +638,6 @@ void kernel_main() {
 
     log("Dumping block 0:\n");
     dump_block_0();
-    initialize_next_free_block();
     print("superblock.file_table_length: ");
     int_to_chars(superblock.file_table_length, buffer, sizeof(buffer));
     print(buffer);
@@ -345,11 +662,42 @@ void kernel_main() {
     print_bear("()=-() ()-=()\n");
                         // <- Set up IDT
     register_interrupt_handler(0x80, syscall_handler);  // <- syscalls
-    
-    int user_task_id = task_create(user_task_entry);
+
+    // Preemption: a periodic tick on every CPU, from the local APIC timer
+    // when there is one, otherwise IRQ0 from the PIT on the only CPU
+    pic_remap();
+    pit_init(PIT_HZ);
+    if (apic_init() == 0) {
+        register_interrupt_handler(APIC_TIMER_VECTOR, lapic_timer_handler);
+        lapic_timer_start();
+    } else {
+        register_interrupt_handler(IRQ_BASE + IRQ_TIMER, timer_handler);
+        irq_unmask(IRQ_TIMER);
+    }
+
+    // Devices that wake sleeping tasks
+    register_interrupt_handler(IRQ_BASE + IRQ_KEYBOARD, keyboard_irq_handler);
+    irq_unmask(IRQ_KEYBOARD);
+    register_interrupt_handler(IRQ_BASE + IRQ_ATA_PRIMARY, ata_irq_handler);
+    ata_enable_irq();
+    irq_unmask(IRQ_ATA_PRIMARY);
+    register_interrupt_handler(IRQ_BASE + IRQ_COM1, serial_irq_handler);
+    serial_irq_start();   // log() stops waiting on the UART from here on
+    irq_unmask(IRQ_COM1);
+
+    smp_boot();
+    kdata_init();   // user pages carry the clock calibration and CPU count
+
+    int user_task_id = task_create(NULL);
+    if (user_task_id >= 0 && exec(user_task_id, "init") != 0) {
+        print("Failed to load init\n");
+        task_abort(user_task_id);
+        user_task_id = -1;
+    }
     if (user_task_id >= 0) {
-        current_task = user_task_id;
-        switch_to_user_mode_with_task(user_task_id);
+        sched_started = 1;
+        task_start(user_task_id);
+        cpu_idle();
     }
 
     while (1); // fallback halt
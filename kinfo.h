@@ -0,0 +1,46 @@
+#ifndef KINFO_H
+#define KINFO_H
+
+#include <stdint.h>
+#include "structs/kernel_data.h"
+
+// Reads from the pages the kernel maps into every task (structs/kernel_data.h),
+// no syscall involved
+#define KDATA    ((const KernelData*)USER_KDATA_ADDR)
+#define TASKDATA ((const TaskData*)USER_TASKDATA_ADDR)
+
+static inline uint64_t kinfo_rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Nanoseconds since boot, the clock clock_gettime(CLOCK_MONOTONIC) reads
+static inline uint64_t kinfo_clock_ns(void) {
+    const KernelData* k = KDATA;
+    if (!k->tsc_ns_mult) return (uint64_t)k->ticks * k->tick_ns;
+
+    uint64_t cycles = kinfo_rdtsc() - k->clock_base_tsc;
+    uint64_t lo = (uint64_t)(uint32_t)cycles * k->tsc_ns_mult;
+    uint64_t hi = (uint64_t)(uint32_t)(cycles >> 32) * k->tsc_ns_mult;
+    return (hi << 8) + (lo >> 24);
+}
+
+static inline int kinfo_task_id(void) {
+    return TASKDATA->task_id;
+}
+
+// CPU the task last ran on, possibly stale by the time it's used
+static inline uint32_t kinfo_cpu(void) {
+    return TASKDATA->cpu;
+}
+
+static inline uint32_t kinfo_ticks(void) {
+    return KDATA->ticks;
+}
+
+static inline uint32_t kinfo_context_switches(void) {
+    return KDATA->context_switches;
+}
+
+#endif
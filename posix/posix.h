@@ -8,29 +8,34 @@
 #include "helpers/disk.h"
 #include "filesystem/filesystem.h"
 #include "structs/structs.h"
+#include "helpers/heap.h"
+#include "helpers/gdt.h"
+#include "helpers/paging.h"
+#include "helpers/sched.h"
+#include "helpers/timer.h"
+#include "structs/io_ring.h"
+#include "structs/uio.h"
+#include "posix/shm.h"
+#include "helpers/keyboard.h"
 
 #define DEFAULT_PERMS (PERM_READ | PERM_WRITE)
-#define MAX_PIPES 8
-#define MAX_TASKS 4
+#define SPLICE_CHUNK (8 * BLOCK_SIZE)   // file data moves through a kernel buffer this big
 
-uint32_t next_free_block = 0;
 char buffer[12];
-int pipe_count = 0;
-int current_task = 0;
-char scancode_to_ascii[128] = {
-    0, 27, '1','2','3','4','5','6','7','8','9','0','-','=', '\b',
-    '\t','q','w','e','r','t','y','u','i','o','p','[',']','\n',
-    0,'a','s','d','f','g','h','j','k','l',';','\'','`',
-    0,'\\','z','x','c','v','b','n','m',',','.','/',
-    0,'*',0,' ',
-};
 
+// Tables grow on demand, objects come from their own slab caches
+Pipe** pipe_table = NULL;
+int pipe_capacity = 0;
+KmemCache pipe_cache;
+Spinlock pipe_table_lock;               // slots and growth; each pipe has its own lock
 
-Pipe pipe_table[MAX_PIPES];
-Task tasks[MAX_TASKS];
+void init_object_caches(void) {
+    kmem_cache_init(&task_cache, "task", sizeof(Task), task_ctor, task_dtor);
+    kmem_cache_init(&pipe_cache, "pipe", sizeof(Pipe), NULL, NULL);
+}
 
 int is_pipe_fd(int fd) {
-    return fd >= 1000 && fd < 1000 + MAX_PIPES * 2;
+    return fd >= 1000 && fd < 1000 + pipe_capacity * 2;
 }
 int get_pipe_id(int fd) {
     return (fd - 1000) / 2;
@@ -39,77 +44,361 @@ int is_pipe_read_fd(int fd) {
     return (fd - 1000) % 2 == 0;
 }
 
-char getpress() {
-    char c = 0;
+// Pipe fds are passed in place of a file name, as a decimal string >= 1000
+int pipe_fd_from_name(const char* name) {
+    int fd = 0;
+    if (!name[0]) return -1;
+    for (int i = 0; name[i]; i++) {
+        if (name[i] < '0' || name[i] > '9' || i >= 9) return -1;
+        fd = fd * 10 + (name[i] - '0');
+    }
+    return fd >= 1000 ? fd : -1;
+}
+
+// Pipe whose read or write end is `fd`: the fd encodes its table slot
+static Pipe* pipe_find(int fd, int read_end) {
+    Pipe* found = NULL;
+    spin_lock(&pipe_table_lock);
+    if (is_pipe_fd(fd) && is_pipe_read_fd(fd) == read_end)
+        found = pipe_table[get_pipe_id(fd)];
+    spin_unlock(&pipe_table_lock);
+    return found;
+}
+
+// Copy in as much of `len` as there's room for, in at most two pieces
+// around the end of the ring. With p->lock held.
+static uint32_t pipe_put(Pipe* p, const uint8_t* src, uint32_t len) {
+    uint32_t room = p->capacity - p->used;
+    if (len > room) len = room;
+    uint32_t first = p->capacity - p->end;
+    if (first > len) first = len;
+    memcpy(p->buffer + p->end, src, first);
+    memcpy(p->buffer, src + first, len - first);
+    p->end += len;
+    if (p->end >= p->capacity) p->end -= p->capacity;
+    p->used += len;
+    return len;
+}
+
+// Take out up to `len` bytes, the same way
+static uint32_t pipe_get(Pipe* p, uint8_t* dst, uint32_t len) {
+    if (len > p->used) len = p->used;
+    uint32_t first = p->capacity - p->start;
+    if (first > len) first = len;
+    memcpy(dst, p->buffer + p->start, first);
+    memcpy(dst + first, p->buffer, len - first);
+    p->start += len;
+    if (p->start >= p->capacity) p->start -= p->capacity;
+    p->used -= len;
+    return len;
+}
+
+// Double a full pipe's buffer, up to PIPE_MAX_SIZE, so a producer that's
+// ahead of its consumer keeps going instead of switching on every buffer
+static int pipe_grow(Pipe* p) {
+    if (p->capacity >= PIPE_MAX_SIZE) return -1;
+    uint32_t capacity = p->capacity * 2;
+    uint8_t* buffer = kmalloc(capacity);
+    if (!buffer) return -1;
+
+    uint32_t used = pipe_get(p, buffer, p->used);
+    kfree(p->buffer);
+    p->buffer = buffer;
+    p->capacity = capacity;
+    p->start = 0;
+    p->end = used;
+    p->used = used;
+    return 0;
+}
 
-    while (1) {
-        uint8_t scancode = inb(0x60);
+static int pipe_is_empty(Pipe* p) {
+    spin_lock(&p->lock);
+    int empty = p->used == 0;
+    spin_unlock(&p->lock);
+    return empty;
+}
 
-        // Ignore releases and unknown keys
-        if (scancode >= 0x80 || scancode_to_ascii[scancode] == 0)
-            continue;
+// Put back `len` bytes that were taken from the front of the pipe, ahead of
+// anything written since. Returns how many fit.
+static uint32_t pipe_unget(Pipe* p, const uint8_t* src, uint32_t len) {
+    spin_lock(&p->lock);
+    while (p->capacity - p->used < len && pipe_grow(p) == 0)
+        ;
+    if (len > p->capacity - p->used) len = p->capacity - p->used;
+    p->start = (p->start + p->capacity - len) % p->capacity;
+    uint32_t first = p->capacity - p->start;
+    if (first > len) first = len;
+    memcpy(p->buffer + p->start, src, first);
+    memcpy(p->buffer, src + first, len - first);
+    p->used += len;
+    if (p->used == len) p->readable = 1;   // reopened, if this read had drained it after EOF
+    wake_up(&p->readers);
+    spin_unlock(&p->lock);
+    return len;
+}
 
-        // Translate scancode to ASCII
-        c = scancode_to_ascii[scancode];
-        break;
+// Copy the caller's iovec array and add up its length
+static int iov_import(struct iovec* dst, const struct iovec* iov, int iovcnt, uint32_t* total) {
+    if (iovcnt <= 0 || iovcnt > IOV_MAX) return -1;
+    uint32_t sum = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        dst[i] = iov[i];
+        if (sum + dst[i].iov_len < sum) return -1;
+        sum += dst[i].iov_len;
     }
+    *total = sum;
+    return 0;
+}
 
-    // Wait for key release (skip repeated presses)
-    while ((inb(0x60) & 0x80) == 0) {
-        // Wait for the release of the previous key
+// Writes every segment, growing the buffer or sleeping while it's full.
+// Readers are woken as soon as there's data, not only at the end. Returns
+// the bytes written: fewer if the task is killed meanwhile or the last
+// reader closes, -4 if nobody holds the read end to begin with.
+static int pipe_write(Pipe* p, const struct iovec* iov, int iovcnt) {
+    uint32_t written = 0;
+    spin_lock(&p->lock);
+    if (!p->readers_open) {
+        spin_unlock(&p->lock);
+        return -4;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        const uint8_t* src = (const uint8_t*)iov[i].iov_base;
+        uint32_t len = iov[i].iov_len;
+        while (len > 0) {
+            if (p->used == p->capacity && pipe_grow(p) != 0) {
+                if (task_killed() || !p->readers_open) goto out;
+                wake_up(&p->readers);
+                sleep_on(&p->writers, &p->lock);
+                continue;
+            }
+            uint32_t n = pipe_put(p, src, len);
+            src += n;
+            len -= n;
+            written += n;
+        }
     }
+out:
+    wake_up(&p->readers);
+    spin_unlock(&p->lock);
+    if (written == 0 && task_killed()) return -3;
+    return written;
+}
 
-    return c;
+// Blocks while the pipe is empty and still has a writer, then fills the
+// segments in order from what's buffered. Once the last writer has closed
+// and the buffer is drained it returns 0, and -5 after that.
+static int pipe_read(Pipe* p, const struct iovec* iov, int iovcnt) {
+    spin_lock(&p->lock);
+    while (p->used == 0 && p->writable && p->readable) {
+        if (task_killed()) {
+            spin_unlock(&p->lock);
+            return 0;
+        }
+        sleep_on(&p->readers, &p->lock);
+    }
+    if (!p->readable) {
+        spin_unlock(&p->lock);
+        return -5;
+    }
+
+    uint32_t total = 0;
+    for (int i = 0; i < iovcnt && p->used > 0; i++)
+        total += pipe_get(p, (uint8_t*)iov[i].iov_base, iov[i].iov_len);
+
+    // If no more data and no writers, mark unreadable
+    if (p->used == 0 && p->writable == 0)
+        p->readable = 0;
+
+    wake_up(&p->writers);
+    spin_unlock(&p->lock);
+    return total;
 }
 
-int write(const char* filename, const void* data, uint32_t size, uint8_t perms) {
+// Remember that `t` holds pipe end `fd`, so its exit closes it
+static int pipe_end_add(Task* t, int fd) {
+    for (int i = 0; i < TASK_PIPE_ENDS; i++) {
+        if (!t->pipe_ends[i]) {
+            t->pipe_ends[i] = fd;
+            return 0;
+        }
+    }
+    return -1;
+}
 
-    FileEntry* existing = find_file(filename);
-    uint32_t needed_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+static int pipe_free_ends(Task* t) {
+    int n = 0;
+    for (int i = 0; i < TASK_PIPE_ENDS; i++) n += !t->pipe_ends[i];
+    return n;
+}
 
-    int slot = -1;
-    log("FT length: ");
-    int_to_chars(superblock.file_table_length, buffer, sizeof(buffer));
-    log_buffer(buffer);
-    log("\n");
-    if (filename[0] >= '0' && filename[0] <= '9') {
-        int fd = 0;
-        for (int i = 0; filename[i] && i < 5; i++) {
-            if (filename[i] < '0' || filename[i] > '9') {
-                fd = -1;
-                break;
+// One holder of end `fd` is gone. The last writer going wakes the readers
+// so they see EOF, the last reader going wakes writers so they give up.
+static void pipe_end_drop(int fd) {
+    Pipe* p = pipe_find(fd, is_pipe_read_fd(fd));
+    if (!p) return;
+    spin_lock(&p->lock);
+    if (is_pipe_read_fd(fd)) {
+        if (--p->readers_open == 0) wake_up(&p->writers);
+    } else if (--p->writers_open == 0) {
+        p->writable = 0;
+        wake_up(&p->readers);
+    }
+    spin_unlock(&p->lock);
+}
+
+// Close one of the caller's pipe ends, named like the fds passed to read/write
+int close(const char* name) {
+    int fd = pipe_fd_from_name(name);
+    Task* t = tasks[current_task];
+    for (int i = 0; fd >= 0 && i < TASK_PIPE_ENDS; i++) {
+        if (t->pipe_ends[i] == fd) {
+            t->pipe_ends[i] = 0;
+            pipe_end_drop(fd);
+            return 0;
+        }
+    }
+    return -1;   // not a pipe end this task holds
+}
+
+// fork: the child holds everything the parent does
+void pipe_fork(Task* parent, Task* child) {
+    for (int i = 0; i < TASK_PIPE_ENDS; i++) {
+        int fd = parent->pipe_ends[i];
+        child->pipe_ends[i] = fd;
+        if (!fd) continue;
+        Pipe* p = pipe_find(fd, is_pipe_read_fd(fd));
+        if (!p) continue;
+        spin_lock(&p->lock);
+        if (is_pipe_read_fd(fd)) p->readers_open++;
+        else p->writers_open++;
+        spin_unlock(&p->lock);
+    }
+}
+
+// Exit: close whatever ends the task still holds
+void pipe_release_all(Task* t) {
+    for (int i = 0; i < TASK_PIPE_ENDS; i++) {
+        if (t->pipe_ends[i]) pipe_end_drop(t->pipe_ends[i]);
+        t->pipe_ends[i] = 0;
+    }
+}
+
+// Stream the segments to consecutive sectors from `lba`. Runs of whole
+// sectors go straight from the caller's buffers; pieces that straddle a
+// sector boundary are gathered in a bounce buffer, the last one zero-padded.
+static int write_segments(uint32_t lba, const struct iovec* iov, int iovcnt) {
+    uint8_t block_buffer[BLOCK_SIZE];
+    uint32_t used = 0;   // bytes gathered in block_buffer
+
+    for (int i = 0; i < iovcnt; i++) {
+        const uint8_t* src = (const uint8_t*)iov[i].iov_base;
+        uint32_t len = iov[i].iov_len;
+        while (len > 0) {
+            if (used == 0 && len >= BLOCK_SIZE) {
+                uint32_t blocks = len / BLOCK_SIZE;
+                if (ata_write_sectors(lba, blocks, src) != 0) return -1;
+                lba += blocks;
+                src += blocks * BLOCK_SIZE;
+                len -= blocks * BLOCK_SIZE;
+                continue;
+            }
+            uint32_t chunk = (BLOCK_SIZE - used < len) ? BLOCK_SIZE - used : len;
+            memcpy(block_buffer + used, src, chunk);
+            used += chunk;
+            src += chunk;
+            len -= chunk;
+            if (used == BLOCK_SIZE) {
+                if (ata_write_sector(lba++, block_buffer) != 0) return -1;
+                used = 0;
             }
-            fd = fd * 10 + (filename[i] - '0');
         }
+    }
 
-        if (fd >= 1000) {
-            for (int i = 0; i < pipe_count; i++) {
-                Pipe* p = &pipe_table[i];
-                if (p->write_fd == fd) {
-                    const uint8_t* bytes = (const uint8_t*)data;
-                    for (uint32_t j = 0; j < size; j++) {
-                        if (p->used >= PIPE_BUFFER_SIZE)
-                            return -3; // Pipe full
-                        p->buffer[p->end] = bytes[j];
-                        p->end = (p->end + 1) % PIPE_BUFFER_SIZE;
-                        p->used++;
-                    }
-                    return 0;
+    if (used > 0) {
+        memset(block_buffer + used, 0, BLOCK_SIZE - used);
+        if (ata_write_sector(lba, block_buffer) != 0) return -1;
+    }
+    return 0;
+}
+
+// Fill the segments in order with the first `size` bytes of the extent at
+// `lba`. Block-aligned runs are read directly into the caller's buffers.
+static int read_segments(uint32_t lba, const struct iovec* iov, int iovcnt, uint32_t size) {
+    uint8_t block_buffer[BLOCK_SIZE];
+    uint32_t cached = 0xFFFFFFFF;   // block currently in block_buffer
+    uint32_t pos = 0;
+
+    for (int i = 0; i < iovcnt && pos < size; i++) {
+        uint8_t* dst = (uint8_t*)iov[i].iov_base;
+        uint32_t len = (iov[i].iov_len < size - pos) ? iov[i].iov_len : size - pos;
+        while (len > 0) {
+            uint32_t block = pos / BLOCK_SIZE;
+            uint32_t offset = pos % BLOCK_SIZE;
+            uint32_t chunk;
+            if (offset == 0 && len >= BLOCK_SIZE) {
+                chunk = (len / BLOCK_SIZE) * BLOCK_SIZE;
+                if (ata_read_sectors(lba + block, chunk / BLOCK_SIZE, dst) != 0) return -1;
+            } else {
+                if (block != cached) {
+                    if (ata_read_sector(lba + block, block_buffer) != 0) return -1;
+                    cached = block;
                 }
+                chunk = (BLOCK_SIZE - offset < len) ? BLOCK_SIZE - offset : len;
+                memcpy(dst, block_buffer + offset, chunk);
             }
-            return -2; // Pipe not found
+            dst += chunk;
+            pos += chunk;
+            len -= chunk;
         }
     }
+    return pos;
+}
+
+// Replace the file with the concatenated segments: one extent allocation,
+// one data transfer per run of whole sectors and one file table update
+int writev(const char* filename, const struct iovec* iov, int iovcnt, uint8_t perms) {
+    struct iovec segs[IOV_MAX];
+    uint32_t size;
+    if (iov_import(segs, iov, iovcnt, &size) != 0) return -7;
+
+    // Pipes first: they don't hold fs_lock, so the file table is off limits
+    int fd = pipe_fd_from_name(filename);
+    if (fd >= 0) {
+        Pipe* p = pipe_find(fd, 0);
+        if (!p) return -2; // Pipe not found
+        return pipe_write(p, segs, iovcnt);
+    }
+
+    FileEntry* existing = find_file(filename);
+    uint32_t needed_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    int slot = -1;
+    log("FT length: ");
+    int_to_chars(superblock.file_table_length, buffer, sizeof(buffer));
+    log_buffer(buffer);
+    log("\n");
+    uint32_t start_block = 0;
+    uint32_t old_blocks = 0;
+    int fresh = 1;   // the data goes to a newly allocated extent
     if (existing) {
-        // Overwrite existing file
-        slot = existing - file_table;
-        next_free_block = existing->start_block; // Optionally reuse space
+        // Overwrite existing file, keeping its extent when the new data still fits
+        slot = file_entry_index(existing);
+        old_blocks = blocks_for_size(existing->size);
+        start_block = existing->start_block;
+        fresh = 0;
+
+        if (needed_blocks > old_blocks &&
+            (old_blocks == 0 || fs_extend_blocks(start_block, old_blocks, needed_blocks) != 0)) {
+            // Allocate before freeing so a full disk leaves the old file intact
+            if (fs_alloc_blocks(needed_blocks, &start_block) != 0) return -6;
+            fresh = 1;
+        }
     } 
     
     else {
         // Find new slot
         for (int i = 0; i < superblock.file_table_length; i++) {
-            if (!file_table[i].active) {
+            if (!file_entry(i)->active) {
                 log("Found empty slot at index: ");
                 int_to_chars(i, buffer, sizeof(buffer));
                 log_buffer(buffer); 
@@ -122,47 +411,39 @@ int write(const char* filename, const void* data, uint32_t size, uint8_t perms)
                 int_to_chars(i, buffer, sizeof(buffer));
                 log_buffer(buffer);
                 log(": occupied by ");
-                log(file_table[i].filename);
+                log(file_entry(i)->filename);
                 log("\n");
             }
         }
 
         if (slot == -1) return -4;
+        if (fs_alloc_blocks(needed_blocks, &start_block) != 0) return -6; // Disk full
     }
-    log("About to write file data: ");
-    log_buffer(data);
-    log("\n");
-    int_to_chars(slot, buffer, sizeof(buffer));
-    log_buffer(buffer);
-    const uint8_t* data_bytes = (const uint8_t*)data;
-    uint8_t block_buffer[BLOCK_SIZE];
-    for (uint32_t i = 0; i < needed_blocks; i++) {
-        uint32_t block_num = superblock.data_start + next_free_block + i;
-        uint32_t bytes_left = size - i * BLOCK_SIZE;
-        uint32_t chunk_size = (bytes_left < BLOCK_SIZE) ? bytes_left : BLOCK_SIZE;
-
-        memset(block_buffer, 0, BLOCK_SIZE);
-        memcpy(block_buffer, data_bytes + i * BLOCK_SIZE, chunk_size);
-
-        disk_write_block(block_num, block_buffer);
-        log("Writing to block: ");
-        int_to_chars(block_num, buffer, sizeof(buffer));
-        log_buffer(buffer);
-        log("\n");
-
+    uint32_t first_block = superblock.data_start + start_block;
+    if (write_segments(first_block, segs, iovcnt) != 0) {
+        log("Error writing data blocks\n");
+        // Give back what this write allocated; the entry still describes the old file
+        if (fresh) fs_free_blocks(start_block, needed_blocks);
+        else if (needed_blocks > old_blocks) fs_free_blocks(start_block + old_blocks, needed_blocks - old_blocks);
+        return -5;
     }
-
-    FileEntry* fe = &file_table[slot];
-    strncpy(fe->filename, filename, MAX_FILENAME_LEN);
-    // Make sure it's null-terminated:
-    fe->filename[MAX_FILENAME_LEN - 1] = '\0';
-    fe->start_block = next_free_block;
+    // Only now is the old data unreachable
+    if (existing && fresh) fs_free_blocks(existing->start_block, old_blocks);
+    else if (existing && needed_blocks < old_blocks) fs_free_blocks(start_block + needed_blocks, old_blocks - needed_blocks);
+
+    FileEntry* fe = file_entry(slot);
+    if (!existing) {
+        strncpy(fe->filename, filename, MAX_FILENAME_LEN);
+        // Make sure it's null-terminated:
+        fe->filename[MAX_FILENAME_LEN - 1] = '\0';
+        name_index_insert(slot);
+    }
+    fe->start_block = start_block;
     fe->size = size;
     fe->active = 1;
     fe->permissions = perms;  // Save permissions
     
-    next_free_block += needed_blocks;
-    save_file_table();
+    save_file_entry(fe);
     log("Writing file: ");
     log(filename);
     log("\n");
@@ -178,7 +459,7 @@ int write(const char* filename, const void* data, uint32_t size, uint8_t perms)
     log("\n");
 
     log("Start block: ");
-    int_to_chars(superblock.data_start + next_free_block, buffer, sizeof(buffer));
+    int_to_chars(first_block, buffer, sizeof(buffer));
     log_buffer(buffer);
     log("\n");
 
@@ -186,48 +467,28 @@ int write(const char* filename, const void* data, uint32_t size, uint8_t perms)
     
 }
 
+int write(const char* filename, const void* data, uint32_t size, uint8_t perms) {
+    struct iovec seg = { (void*)data, size };
+    return writev(filename, &seg, 1, perms);
+}
+
 int writedefper(const char* filename, const void* data, uint32_t size) {
     return write(filename, data, size, DEFAULT_PERMS);
 }
 
-int read(const char* filename, void* buffer, uint32_t max_size) {
+// Fill the segments in order from the start of the file, returns the bytes read
+int readv(const char* filename, const struct iovec* iov, int iovcnt) {
     char buffer_str[12];
+    struct iovec segs[IOV_MAX];
+    uint32_t max_size;
+    if (iov_import(segs, iov, iovcnt, &max_size) != 0) return -7;
 
     // Pipe check: see if filename is a pipe FD (pure number >= 1000)
-    int fd = 0;
-    bool is_pipe = true;
-
-    for (int i = 0; filename[i]; i++) {
-        if (filename[i] < '0' || filename[i] > '9') {
-            is_pipe = false;
-            break;
-        }
-    }
-
-    if (is_pipe) {
-        fd = simple_atoi(filename);
-        for (int i = 0; i < pipe_count; i++) {
-            if (pipe_table[i].read_fd == fd) {
-                Pipe* p = &pipe_table[i];
-
-                if (!p->readable || p->ref_count == 0) return -5;
-
-                uint32_t to_read = (p->used < max_size) ? p->used : max_size;
-
-                for (uint32_t j = 0; j < to_read; j++) {
-                    ((char*)buffer)[j] = p->buffer[p->start];
-                    p->start = (p->start + 1) % PIPE_BUFFER_SIZE;
-                    p->used--;
-                }
-
-                // If no more data and no writers, mark unreadable
-                if (p->used == 0 && p->writable == 0)
-                    p->readable = 0;
-
-                return to_read;
-            }
-        }
-        return -6; // Pipe not found
+    int fd = pipe_fd_from_name(filename);
+    if (fd >= 0) {
+        Pipe* p = pipe_find(fd, 1);
+        if (!p) return -6; // Pipe not found
+        return pipe_read(p, segs, iovcnt);
     }
 
     // Normal file read
@@ -235,9 +496,6 @@ int read(const char* filename, void* buffer, uint32_t max_size) {
     if (!file) return -1;
 
     uint32_t to_read = (file->size < max_size) ? file->size : max_size;
-    uint32_t bytes_read = 0;
-    uint8_t block_buffer[BLOCK_SIZE];
-
     uint32_t current_block = superblock.data_start + file->start_block;
 
     log("Reading ");
@@ -248,157 +506,488 @@ int read(const char* filename, void* buffer, uint32_t max_size) {
     log_buffer(buffer_str);
     log("\n");
 
-    while (bytes_read < to_read) {
-        int res = ata_read_sector(current_block, block_buffer);
-        if (res != 0) {
-            log("Error reading sector\n");
-            return -2;
-        }
+    int bytes_read = read_segments(current_block, segs, iovcnt, to_read);
+    if (bytes_read < 0) {
+        log("Error reading sector\n");
+        return -2;
+    }
+    return bytes_read;
+}
+
+int read(const char* filename, void* buffer, uint32_t max_size) {
+    struct iovec seg = { buffer, max_size };
+    return readv(filename, &seg, 1);
+}
 
-        uint32_t bytes_left = to_read - bytes_read;
-        uint32_t chunk = (bytes_left < BLOCK_SIZE) ? bytes_left : BLOCK_SIZE;
+// Make room for `new_blocks` blocks of the file: its extent extended in place when the
+// blocks after it are free, otherwise a new one with the data copied over.
+// *start is where the grown extent begins. The entry isn't changed until
+// grow_extent_end, so writes into the new space can still fail cleanly.
+static int grow_extent(FileEntry* fe, uint32_t old_blocks, uint32_t new_blocks, uint32_t* start) {
+    *start = fe->start_block;
+    if (old_blocks > 0 && fs_extend_blocks(fe->start_block, old_blocks, new_blocks) == 0) return 0;
 
-        log("Data bytes: ");
-        for (int i = 0; i < (chunk < 8 ? chunk : 8); i++) {
-            char hex[3];
-            int_to_hex(block_buffer[i], hex);
-            log_buffer(hex);
-            log(" ");
+    uint32_t new_start;
+    if (fs_alloc_blocks(new_blocks, &new_start) != 0) return -3;
+    uint8_t block_buffer[BLOCK_SIZE];
+    for (uint32_t i = 0; i < old_blocks; i++) {
+        if (ata_read_sector(superblock.data_start + fe->start_block + i, block_buffer) != 0 ||
+            ata_write_sector(superblock.data_start + new_start + i, block_buffer) != 0) {
+            fs_free_blocks(new_start, new_blocks);
+            return -2;
         }
-        log("\n");
+    }
+    *start = new_start;
+    return 0;
+}
+
+// After the writes into the grown extent: on success the file moves to it,
+// on failure its new blocks are freed and the file keeps its old extent
+static void grow_extent_end(FileEntry* fe, uint32_t old_blocks, uint32_t new_blocks, uint32_t start, int ok) {
+    if (start == fe->start_block) {
+        if (!ok) fs_free_blocks(start + old_blocks, new_blocks - old_blocks);
+    } else if (ok) {
+        fs_free_blocks(fe->start_block, old_blocks);
+        fe->start_block = start;
+    } else {
+        fs_free_blocks(start, new_blocks);
+    }
+}
 
-        memcpy((uint8_t*)buffer + bytes_read, block_buffer, chunk);
+// Write `size` bytes at byte `pos` of the extent at block `start`. Only the
+// block `pos` falls in is read back, to keep what's before it.
+static int write_from(uint32_t start, uint32_t pos, const uint8_t* data, uint32_t size) {
+    uint32_t lba = superblock.data_start + start + pos / BLOCK_SIZE;
+    uint32_t tail = pos % BLOCK_SIZE;
+    if (tail > 0) {
+        uint8_t block_buffer[BLOCK_SIZE];
+        uint32_t fill = (BLOCK_SIZE - tail < size) ? BLOCK_SIZE - tail : size;
+        if (ata_read_sector(lba, block_buffer) != 0) return -1;
+        memcpy(block_buffer + tail, data, fill);
+        memset(block_buffer + tail + fill, 0, BLOCK_SIZE - tail - fill);
+        if (ata_write_sector(lba++, block_buffer) != 0) return -1;
+        data += fill;
+        size -= fill;
+    }
+    if (size > 0) {
+        struct iovec seg = { (void*)data, size };
+        if (write_segments(lba, &seg, 1) != 0) return -1;
+    }
+    return 0;
+}
 
-        bytes_read += chunk;
-        current_block++;
+// Add `size` bytes at the end of the file, creating it if needed. The
+// extent grows to fit and only the old last block is read back, to fill
+// its free tail. Caller holds fs_lock.
+static int append_file(const char* filename, const uint8_t* data, uint32_t size) {
+    FileEntry* fe = find_file(filename);
+    if (!fe) {
+        struct iovec seg = { (void*)data, size };
+        return writev(filename, &seg, 1, DEFAULT_PERMS);
     }
 
-    return bytes_read;
+    uint32_t old_size = fe->size;
+    uint32_t old_blocks = blocks_for_size(old_size);
+    uint32_t new_blocks = blocks_for_size(old_size + size);
+    uint32_t start = fe->start_block;
+    if (new_blocks > old_blocks && grow_extent(fe, old_blocks, new_blocks, &start) != 0) return -6;
+
+    int ok = write_from(start, old_size, data, size) == 0;
+    if (new_blocks > old_blocks) grow_extent_end(fe, old_blocks, new_blocks, start, ok);
+    if (!ok) return -5;
+
+    fe->size = old_size + size;
+    return save_file_entry(fe);
 }
 
+// File to pipe: the file is read from `offset` a chunk at a time, each
+// chunk going into the pipe as soon as it's off the disk. fs_lock covers the
+// disk reads only, never a wait on the pipe.
+static int splice_from_file(const char* name, Pipe* out, uint32_t offset, uint32_t len, uint8_t* chunk) {
+    uint32_t moved = 0;
+    while (moved < len && !task_killed()) {
+        mutex_lock(&fs_lock);
+        FileEntry* fe = find_file(name);   // looked up again, the file may be rewritten between chunks
+        uint32_t skip = 0;
+        int n = -1;
+        if (fe) {
+            uint32_t pos = offset + moved;
+            uint32_t want = fe->size > pos ? fe->size - pos : 0;
+            if (want > len - moved) want = len - moved;
+            if (want > SPLICE_CHUNK) want = SPLICE_CHUNK;
+            if (want > 0) {
+                // read_segments starts at a block boundary, so read from there and skip the head
+                skip = pos % BLOCK_SIZE;
+                if (want > SPLICE_CHUNK - skip) want = SPLICE_CHUNK - skip;
+                struct iovec seg = { chunk, skip + want };
+                uint32_t lba = superblock.data_start + fe->start_block + pos / BLOCK_SIZE;
+                n = read_segments(lba, &seg, 1, skip + want);
+                if (n > 0) n -= skip;
+            } else {
+                n = 0;
+            }
+        }
+        mutex_unlock(&fs_lock);
+        if (n < 0) return moved ? (int)moved : (fe ? -2 : -1);
+        if (n == 0) break;
+
+        struct iovec seg = { chunk + skip, (uint32_t)n };
+        int written = pipe_write(out, &seg, 1);
+        if (written > 0) moved += written;
+        if (written < n) break;
+    }
+    return moved;
+}
 
-static void recompute_next_free_block(void) {
-    next_free_block = 0;
-    for (int i = 0; i < superblock.file_table_length; ++i) {
-        if (!file_table[i].active) continue;
-        uint32_t end = file_table[i].start_block +
-                       ((file_table[i].size + BLOCK_SIZE - 1) / BLOCK_SIZE);
-        if (end > next_free_block) next_free_block = end;
+// Move up to `len` bytes between a pipe and a file, or two pipes, without
+// passing through user space. From a file it streams from the start until
+// `len` or EOF; each call starts over, sendfile() is the one that carries
+// on where the last left off. From a pipe it blocks only until the first
+// data, like Linux splice: then it takes what's buffered, up to `len`, and
+// returns once the pipe runs empty. Bytes that can't be written out are put
+// back into the source pipe. A destination file is appended to, and
+// created if needed. Returns the bytes moved.
+int splice(const char* src, const char* dst, uint32_t len) {
+    int src_fd = pipe_fd_from_name(src);
+    int dst_fd = pipe_fd_from_name(dst);
+    if (src_fd < 0 && dst_fd < 0) return -1;   // file to file is a copy, not a splice
+
+    Pipe* in = src_fd >= 0 ? pipe_find(src_fd, 1) : NULL;
+    Pipe* out = dst_fd >= 0 ? pipe_find(dst_fd, 0) : NULL;
+    if ((src_fd >= 0 && !in) || (dst_fd >= 0 && !out)) return -6; // Pipe not found
+    if (len == 0) return 0;
+
+    uint8_t* chunk = kmalloc(SPLICE_CHUNK);
+    if (!chunk) return -3;
+    if (!in) {
+        int moved = splice_from_file(src, out, 0, len, chunk);
+        kfree(chunk);
+        return moved;
+    }
+
+    // Each chunk read from the pipe is written out before the next read
+    uint32_t moved = 0;
+    int ret = 0;
+    while (moved < len && !task_killed()) {
+        if (moved > 0 && pipe_is_empty(in)) break;
+        uint32_t want = (len - moved < SPLICE_CHUNK) ? len - moved : SPLICE_CHUNK;
+        struct iovec seg = { chunk, want };
+        int n = pipe_read(in, &seg, 1);
+        if (n <= 0) {
+            ret = n;   // 0 or -5: the writer is gone
+            break;
+        }
+        seg.iov_len = n;
+        int written;
+        if (out) {
+            written = pipe_write(out, &seg, 1);
+            if (written < 0) ret = written;
+        } else {
+            mutex_lock(&fs_lock);
+            ret = append_file(dst, chunk, n);
+            mutex_unlock(&fs_lock);
+            written = ret < 0 ? 0 : n;
+        }
+        if (written > 0) moved += written;
+        if (written < n) {
+            // The rest stays in the source pipe for the next reader
+            uint32_t from = written > 0 ? written : 0;
+            if (pipe_unget(in, chunk + from, n - from) < n - from)
+                log("splice: no room to put bytes back, dropped\n");
+            break;
+        }
     }
+    kfree(chunk);
+    return moved ? (int)moved : ret;
+}
+
+// Like splice() from a file, starting at *offset, which is advanced past the
+// bytes moved so the next call carries on from there
+int sendfile(const char* src, const char* dst, uint32_t* offset, uint32_t len) {
+    int dst_fd = pipe_fd_from_name(dst);
+    if (pipe_fd_from_name(src) >= 0 || dst_fd < 0) return -1;   // file to pipe only
+    Pipe* out = pipe_find(dst_fd, 0);
+    if (!out) return -6;
+    if (len == 0) return 0;
+
+    uint8_t* chunk = kmalloc(SPLICE_CHUNK);
+    if (!chunk) return -3;
+    int moved = splice_from_file(src, out, *offset, len, chunk);
+    kfree(chunk);
+    if (moved > 0) *offset += moved;
+    return moved;
 }
 
 int unlink(const char *filename) {
     FileEntry *fe = find_file(filename);
     if (!fe) return -1;
 
+    fs_free_blocks(fe->start_block, blocks_for_size(fe->size));
+    name_index_remove(file_entry_index(fe));
+
     fe->active       = 0;
     fe->filename[0]  = '\0';
     fe->size         = 0;
     fe->start_block  = 0;
 
-    save_file_table();
-    recompute_next_free_block();
-    save_superblock();
-    return 0;
+    return save_file_entry(fe);
 }
 
+// Metadata-only: the entry is renamed in place and its sector rewritten,
+// no file data is touched
 int rename(const char *oldname, const char *newname) {
-     FileEntry *fe = find_file(oldname);
-     if (!fe) return -1;
-     
-     int bytes_read = read(oldname, buffer, sizeof(buffer));
-     writedefper(newname, &bytes_read, sizeof(bytes_read));
-     unlink(oldname);
-     // add correct buffers and such as input to funcs
-     return 0;
+    FileEntry *fe = find_file(oldname);
+    if (!fe) return -1;
+    if (strcmp(oldname, newname) == 0) return 0;
+
+    // Like POSIX, an existing target is replaced
+    FileEntry *target = find_file(newname);
+    if (target && unlink(newname) != 0) return -2;
+
+    int index = file_entry_index(fe);
+    name_index_remove(index);
+    strncpy(fe->filename, newname, MAX_FILENAME_LEN);
+    fe->filename[MAX_FILENAME_LEN - 1] = '\0';
+    name_index_insert(index);
+
+    return save_file_entry(fe);
+}
+
+// Zero `count` data blocks starting at `block` (relative to data_start),
+// ZERO_BATCH blocks per disk command
+#define ZERO_BATCH 16
+static const uint8_t zero_batch[ZERO_BATCH * BLOCK_SIZE];
+
+static int zero_blocks(uint32_t block, uint32_t count) {
+    uint32_t lba = superblock.data_start + block;
+    while (count > 0) {
+        uint32_t n = count < ZERO_BATCH ? count : ZERO_BATCH;
+        if (ata_write_sectors(lba, n, zero_batch) != 0) return -1;
+        lba += n;
+        count -= n;
+    }
+    return 0;
 }
 
+// Shrinking hands the tail blocks back to the allocator. Growing extends the
+// extent in place when possible, and newly exposed bytes always read as zero.
 int truncate(const char *filename, int len) {
-     FileEntry *fe = find_file(filename);
-     if (!fe || len == 0)  return -1;
-     
-     fe->size        = len;
-     return 0;
-}
-
-void switch_to_user_mode_with_task(int task_id) {
-    Task *t = &tasks[task_id];
-
-    asm volatile (
-        "cli\n"
-        "mov $0x23, %%ax\n"        // User data segment
-        "mov %%ax, %%ds\n"
-        "mov %%ax, %%es\n"
-        "mov %%ax, %%fs\n"
-        "mov %%ax, %%gs\n"
-
-        "mov %0, %%esp\n"          // Set stack pointer
-        "pushl $0x23\n"
-        "pushl %%esp\n"
-        "pushf\n"
-        "pushl $0x1B\n"            // User code segment
-        "pushl %1\n"               // EIP (entry point)
-        "iret\n"
-        :
-        : "r" (&t->stack[STACK_SIZE - 1]), "r" (t->entry)
-    );
-}
-
-void sched_yield() {
-    for (int i = 1; i <= MAX_TASKS; i++) {
-        int next = (current_task + i) % MAX_TASKS;
-        if (tasks[next].active) {
-            current_task = next;
-            switch_to_user_mode_with_task(next); // set EIP and stack
-            return;
-        }
+    FileEntry *fe = find_file(filename);
+    if (!fe || len < 0) return -1;
+
+    uint32_t new_size = (uint32_t)len;
+    uint32_t old_blocks = blocks_for_size(fe->size);
+    uint32_t new_blocks = blocks_for_size(new_size);
+
+    // Clear stale bytes past the old EOF in its last block, also when the
+    // file only grows inside that block
+    uint32_t tail = fe->size % BLOCK_SIZE;
+    if (new_size > fe->size && tail > 0) {
+        uint8_t block_buffer[BLOCK_SIZE];
+        uint32_t lba = superblock.data_start + fe->start_block + old_blocks - 1;
+        if (ata_read_sector(lba, block_buffer) != 0) return -2;
+        memset(block_buffer + tail, 0, BLOCK_SIZE - tail);
+        if (ata_write_sector(lba, block_buffer) != 0) return -2;
+    }
+
+    if (new_blocks <= old_blocks) {
+        fs_free_blocks(fe->start_block + new_blocks, old_blocks - new_blocks);
+        if (new_blocks == 0) fe->start_block = 0;
+    } else {
+        uint32_t start;
+        int ret = grow_extent(fe, old_blocks, new_blocks, &start);
+        if (ret != 0) return ret;
+
+        int ok = zero_blocks(start + old_blocks, new_blocks - old_blocks) == 0;
+        grow_extent_end(fe, old_blocks, new_blocks, start, ok);
+        if (!ok) return -2;
     }
 
-    // No tasks left
-    print("No tasks left. Halting.\n");
-    while (1) asm volatile("hlt");
+    fe->size = new_size;
+    return save_file_entry(fe);
 }
 
+extern char _user_image_start[];
+extern char _user_image_end[];
+extern void load_user_program(void);     // entry of the built-in program, linked at USER_PROG_LOAD_ADDR
+// Replace the task's program with a flat binary loaded at USER_PROG_LOAD_ADDR.
+// A file on disk wins; "init" falls back to the image linked into the kernel.
+int exec(int task_id, const char* filename) {
+    Task* t = tasks[task_id];
+
+    // The name may live in the address space we're about to drop
+    char name[MAX_FILENAME_LEN];
+    strncpy(name, filename, MAX_FILENAME_LEN - 1);
+    name[MAX_FILENAME_LEN - 1] = '\0';
+
+    FileEntry* fe = find_file(name);
+    uint32_t size = fe ? fe->size : (uint32_t)(_user_image_end - _user_image_start);
+    if (!fe && strncmp(name, "init", 5) != 0) return -1;
+    if (size == 0 || size > USER_STACK_TOP - USER_STACK_MAX - USER_PROG_LOAD_ADDR) return -2;
+
+    uint32_t* pd = create_address_space();
+    if (!pd) return -3;
+    if (map_user_range(pd, USER_PROG_LOAD_ADDR, size, PTE_WRITE) != 0) {
+        destroy_address_space(pd);
+        return -3;
+    }
+
+    // Fill it in through the physmap. Disk reads may sleep, so don't rely on CR3.
+    int result = 0;
+    if (fe) {
+        uint8_t* image = kmalloc(size);
+        if (!image) result = -3;
+        else if (read(name, image, size) != (int)size) result = -4;
+        else result = copy_to_address_space(pd, USER_PROG_LOAD_ADDR, image, size);
+        kfree(image);
+    } else {
+        result = copy_to_address_space(pd, USER_PROG_LOAD_ADDR, _user_image_start, size);
+    }
+
+    if (result == 0 && kdata_map(t, pd) != 0) result = -3;
+    if (result != 0) {
+        destroy_address_space(pd);
+        return result;
+    }
 
-void kill(int id) {
-    tasks[id].active = 0;
-    if (current_task == id)
-        sched_yield();  // choose another task or halt
+    shm_release_all(t);
+    fpu_release(t);
+    destroy_address_space(t->page_dir);
+    t->page_dir = pd;
+    t->ring_entries = 0;
+    t->entry = fe ? (void (*)(void))USER_PROG_LOAD_ADDR : load_user_program;
+
+    // Start at the entry point on an empty stack
+    memset(&t->user_regs, 0, sizeof(t->user_regs));
+    t->user_regs.eip = (uint32_t)t->entry;
+    t->user_regs.cs = USER_CS;
+    t->user_regs.ds = USER_DS;
+    t->user_regs.ss = USER_DS;
+    t->user_regs.useresp = USER_STACK_TOP;
+    t->user_regs.eflags = 0x202;   // IF set, the timer can preempt
+    return 0;
+}
+
+// Child gets a COW copy of the parent's memory and resumes from the same
+// syscall with 0 in eax. Returns the child's task id to the parent.
+int fork(struct registers* r) {
+    Task* parent = tasks[current_task];
+    int id = task_create(parent->entry);
+    if (id < 0) return -1;
+
+    Task* child = tasks[id];
+    child->page_dir = fork_address_space(parent->page_dir);
+    if (!child->page_dir) {
+        task_abort(id);
+        return -2;
+    }
+
+    if (kdata_map(child, child->page_dir) != 0) {
+        destroy_address_space(child->page_dir);
+        task_abort(id);
+        return -2;
+    }
+
+    if (fpu_fork(parent, child) != 0) {
+        destroy_address_space(child->page_dir);
+        task_abort(id);
+        return -2;
+    }
+    shm_fork(parent, child);
+    pipe_fork(parent, child);
+    child->user_regs = *r;
+    child->user_regs.eax = 0;
+    child->ring_entries = parent->ring_entries;   // its copy of the rings is mapped at the same place
+    sched_set_priority(id, parent->priority);
+    task_start(id);
+    return id;
+}
+
+// Map zeroed submission/completion rings into the calling task. Returns
+// their user address; a task has at most one pair.
+int io_setup(uint32_t entries) {
+    Task* t = tasks[current_task];
+    if (entries == 0 || entries > IO_RING_MAX_ENTRIES || (entries & (entries - 1))) return -1;
+    if (t->ring_entries) return -2;
+    if (map_user_range(t->page_dir, USER_IO_RING_ADDR, io_ring_size(entries), PTE_WRITE) != 0) return -3;
+
+    IoRing* ring = (IoRing*)USER_IO_RING_ADDR;   // our own address space is loaded
+    ring->entries = entries;
+    t->ring_entries = entries;
+    return USER_IO_RING_ADDR;
 }
 
+// Relative sleep. 0 when the time is up, -1 if killed first, -3 on a bad request.
+int nanosleep(const struct timespec* req) {
+    if (req->tv_nsec >= NSEC_PER_SEC) return -3;
+    uint64_t ns = (uint64_t)req->tv_sec * NSEC_PER_SEC + req->tv_nsec;
+    return sleep_until(clock_ns() + ns);
+}
+
+// Only the monotonic clock exists: time since boot, from the TSC
+int clock_gettime(int clock, struct timespec* tp) {
+    if (clock != CLOCK_MONOTONIC) return -1;
+    uint64_t now = clock_ns();
+    uint32_t sec = (uint32_t)div_u64(now, NSEC_PER_SEC);
+    tp->tv_sec = sec;
+    tp->tv_nsec = (uint32_t)(now - (uint64_t)sec * NSEC_PER_SEC);
+    return 0;
+}
 
 int chmod(const char* filename, uint8_t new_perms) {
     FileEntry* file = find_file(filename);
     if (!file) return -1;
     file->permissions = new_perms;
-    save_file_table();
-    return 0;
+    return save_file_entry(file);
 }
 
 int pipe(int* fds) {
-    for (int i = 0; i < MAX_PIPES; i++) {
-        if (pipe_table[i].ref_count == 0) {
-            pipe_table[i].start = 0;
-            pipe_table[i].end = 0;
-            pipe_table[i].used = 0;
-            pipe_table[i].readable = 1;
-            pipe_table[i].writable = 1;
-            pipe_table[i].ref_count = 2;
-
-            int read_fd = 1000 + i * 2;
-            int write_fd = read_fd + 1;
-
-            pipe_table[i].read_fd = read_fd;
-            pipe_table[i].write_fd = write_fd;
-
-            fds[0] = read_fd;
-            fds[1] = write_fd;
+    Task* t = tasks[current_task];
+    if (pipe_free_ends(t) < 2) return -2;   // no room to hold both ends
+
+    spin_lock(&pipe_table_lock);
+    int i = 0;
+    while (i < pipe_capacity && pipe_table[i]) i++;
+    if (i == pipe_capacity && grow_table((void***)&pipe_table, &pipe_capacity) != 0) {
+        spin_unlock(&pipe_table_lock);
+        return -1; // No space for new pipe
+    }
 
-            if (i >= pipe_count) pipe_count = i + 1;
-            return 0;
-        }
+    Pipe* p = kmem_cache_alloc(&pipe_cache);
+    uint8_t* buffer = p ? kmalloc(PIPE_BUFFER_SIZE) : NULL;
+    if (!buffer) {
+        kmem_cache_free(&pipe_cache, p);
+        spin_unlock(&pipe_table_lock);
+        return -1;
     }
-    return -1; // No space for new pipe
+
+    p->buffer = buffer;
+    p->capacity = PIPE_BUFFER_SIZE;
+    p->start = 0;
+    p->end = 0;
+    p->used = 0;
+    p->readable = 1;
+    p->writable = 1;
+    p->readers_open = 1;
+    p->writers_open = 1;
+    wait_queue_init(&p->readers);
+    wait_queue_init(&p->writers);
+    p->lock.locked = 0;
+
+    int read_fd = 1000 + i * 2;
+    int write_fd = read_fd + 1;
+
+    p->read_fd = read_fd;
+    p->write_fd = write_fd;
+
+    pipe_table[i] = p;
+    spin_unlock(&pipe_table_lock);
+
+    pipe_end_add(t, read_fd);
+    pipe_end_add(t, write_fd);
+    fds[0] = read_fd;
+    fds[1] = write_fd;
+    return 0;
 }
 
 
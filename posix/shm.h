@@ -0,0 +1,211 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "helpers/basics.h"
+#include "helpers/heap.h"
+#include "helpers/pmm.h"
+#include "helpers/paging.h"
+#include "helpers/sched.h"
+#include "helpers/spinlock.h"
+#include "structs/structs.h"
+
+// Named shared memory. Segment i is mapped at the same address in every
+// task that attaches it, USER_SHM_BASE + i * SHM_MAX_SIZE, so pointers into
+// it are valid everywhere. It lives while some task has it attached.
+ShmSegment* shm_table[SHM_MAX_SEGMENTS];
+Spinlock shm_lock;                      // the table and attach counts
+
+static inline uint32_t shm_addr(int id) {
+    return USER_SHM_BASE + (uint32_t)id * SHM_MAX_SIZE;
+}
+
+// Segment the caller has attached at `addr`, or -1
+static int shm_id_of(uint32_t addr) {
+    if (addr < USER_SHM_BASE || addr >= USER_SHM_BASE + SHM_MAX_SEGMENTS * SHM_MAX_SIZE) return -1;
+    int id = (addr - USER_SHM_BASE) / SHM_MAX_SIZE;
+    if (!(this_cpu()->current->shm_attached & (1ull << id))) return -1;
+    return id;
+}
+
+// Mappings hold their own frame references and are marked shared, so fork
+// keeps them writable instead of turning them copy-on-write
+static int shm_map(uint32_t* pd, ShmSegment* seg, int id) {
+    for (uint32_t off = 0; off < seg->size; off += PAGE_SIZE) {
+        uint32_t frame = seg->frames[off / PAGE_SIZE];
+        if (map_page(pd, shm_addr(id) + off, frame, PTE_WRITE | PTE_USER | PTE_SHARED) != 0) return -1;
+        pmm_frame_get(frame);
+    }
+    return 0;
+}
+
+static void shm_unmap(uint32_t* pd, ShmSegment* seg, int id) {
+    for (uint32_t off = 0; off < seg->size; off += PAGE_SIZE) {
+        uint32_t* pte = get_pte(pd, shm_addr(id) + off, 0);
+        if (!pte || !(*pte & PTE_PRESENT)) continue;
+        pmm_frame_put(*pte & ~0xFFF);
+        *pte = 0;
+        if (pd == current_page_dir) invlpg(shm_addr(id) + off);
+    }
+}
+
+static void shm_free(ShmSegment* seg) {
+    for (uint32_t i = 0; i < seg->size / PAGE_SIZE; i++) {
+        if (seg->frames[i]) pmm_frame_put(seg->frames[i]);
+    }
+    kfree(seg->frames);
+    kfree(seg);
+}
+
+// Drop one attachment of segment `id`, freeing it with the last one. The
+// frames go when the last mapping does.
+static void shm_put(int id) {
+    ShmSegment* seg = NULL;
+    spin_lock(&shm_lock);
+    if (--shm_table[id]->attached == 0) {
+        seg = shm_table[id];
+        shm_table[id] = NULL;
+    }
+    spin_unlock(&shm_lock);
+    if (seg) shm_free(seg);
+}
+
+static ShmSegment* shm_lookup(const char* name, int* id) {
+    for (int i = 0; i < SHM_MAX_SEGMENTS; i++) {
+        if (shm_table[i] && strncmp(shm_table[i]->name, name, MAX_FILENAME_LEN) == 0) {
+            *id = i;
+            return shm_table[i];
+        }
+    }
+    return NULL;
+}
+
+// Create a zeroed segment of `size` bytes and attach it. Returns its address.
+int shm_create(const char* name, uint32_t size) {
+    Task* t = this_cpu()->current;
+    if (!name[0] || size == 0 || size > SHM_MAX_SIZE) return -1;
+    size = align_up(size, PAGE_SIZE);
+
+    ShmSegment* seg = kzalloc(sizeof(ShmSegment));
+    uint32_t* frames = kzalloc(size / PAGE_SIZE * sizeof(uint32_t));
+    if (!seg || !frames) {
+        kfree(seg);
+        kfree(frames);
+        return -3;
+    }
+    strncpy(seg->name, name, MAX_FILENAME_LEN);
+    seg->name[MAX_FILENAME_LEN - 1] = '\0';
+    seg->size = size;
+    seg->frames = frames;
+    seg->attached = 1;
+    wait_queue_init(&seg->waiters);
+    for (uint32_t i = 0; i < size / PAGE_SIZE; i++) {
+        frames[i] = pmm_alloc_frame();
+        if (!frames[i]) {
+            shm_free(seg);
+            return -3;
+        }
+        memset(phys_to_virt(frames[i]), 0, PAGE_SIZE);
+    }
+
+    int id;
+    spin_lock(&shm_lock);
+    if (shm_lookup(seg->name, &id)) {
+        spin_unlock(&shm_lock);
+        shm_free(seg);
+        return -2;   // name taken
+    }
+    for (id = 0; id < SHM_MAX_SEGMENTS && shm_table[id]; id++);
+    if (id == SHM_MAX_SEGMENTS) {
+        spin_unlock(&shm_lock);
+        shm_free(seg);
+        return -4;
+    }
+    shm_table[id] = seg;
+    spin_unlock(&shm_lock);
+
+    t->shm_attached |= 1ull << id;
+    if (shm_map(t->page_dir, seg, id) != 0) return -3;   // the pages that did map stay until detach
+    return shm_addr(id);
+}
+
+// Map an existing segment into the caller. Returns its address.
+int shm_attach(const char* name) {
+    Task* t = this_cpu()->current;
+    int id;
+    spin_lock(&shm_lock);
+    ShmSegment* seg = shm_lookup(name, &id);
+    if (!seg) {
+        spin_unlock(&shm_lock);
+        return -1;
+    }
+    if (t->shm_attached & (1ull << id)) {
+        spin_unlock(&shm_lock);
+        return shm_addr(id);
+    }
+    seg->attached++;
+    spin_unlock(&shm_lock);
+
+    t->shm_attached |= 1ull << id;
+    if (shm_map(t->page_dir, seg, id) != 0) return -3;
+    return shm_addr(id);
+}
+
+int shm_detach(uint32_t addr) {
+    Task* t = this_cpu()->current;
+    int id = shm_id_of(addr);
+    if (id < 0) return -1;
+    shm_unmap(t->page_dir, shm_table[id], id);
+    t->shm_attached &= ~(1ull << id);
+    shm_put(id);
+    return 0;
+}
+
+// Bump the segment's sequence number and wake everyone in shm_wait.
+// Returns the new sequence number.
+int shm_notify(uint32_t addr) {
+    int id = shm_id_of(addr);
+    if (id < 0) return -1;
+    ShmSegment* seg = shm_table[id];
+    spin_lock(&seg->waiters.lock);
+    uint32_t seq = ++seg->seq;
+    spin_unlock(&seg->waiters.lock);
+    wake_up(&seg->waiters);
+    return seq & 0x7FFFFFFF;
+}
+
+// Sleep until the sequence number differs from `seen`, the last value the
+// caller got from shm_notify or shm_wait. Returns the current one.
+int shm_wait(uint32_t addr, uint32_t seen) {
+    int id = shm_id_of(addr);
+    if (id < 0) return -1;
+    ShmSegment* seg = shm_table[id];
+    spin_lock(&seg->waiters.lock);
+    while ((seg->seq & 0x7FFFFFFF) == seen && !task_killed())
+        sleep_on(&seg->waiters, &seg->waiters.lock);
+    uint32_t seq = seg->seq;
+    spin_unlock(&seg->waiters.lock);
+    return seq & 0x7FFFFFFF;
+}
+
+// fork: the child's address space already maps the parent's segments
+void shm_fork(Task* parent, Task* child) {
+    child->shm_attached = parent->shm_attached;
+    spin_lock(&shm_lock);
+    for (int id = 0; id < SHM_MAX_SEGMENTS; id++) {
+        if (child->shm_attached & (1ull << id)) shm_table[id]->attached++;
+    }
+    spin_unlock(&shm_lock);
+}
+
+// The task's address space is about to go: drop its attachments, the
+// mappings themselves go with the page tables
+void shm_release_all(Task* t) {
+    for (int id = 0; id < SHM_MAX_SEGMENTS; id++) {
+        if (t->shm_attached & (1ull << id)) shm_put(id);
+    }
+    t->shm_attached = 0;
+}
+
+#endif
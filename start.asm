@@ -2,9 +2,11 @@ global _start
 extern kernel_main
 global magic_number
 global mb_info_ptr
+global boot_stack_top
 
 section .text
 _start:
+    mov esp, boot_stack_top   ; GRUB leaves esp undefined
     mov [magic_number], eax   ; Save magic number from GRUB
     mov [mb_info_ptr], ebx    ; Save multiboot info pointer from GRUB
     call kernel_main
@@ -17,3 +19,6 @@ section .bss
 magic_number  resd 1
 mb_info_ptr   resd 1
 
+align 16
+boot_stack:   resb 16384      ; kernel stack until the first task runs
+boot_stack_top:
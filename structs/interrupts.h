@@ -5,7 +5,15 @@
 #include <stdint.h>
 #include "registers.h"
 
+#define MAX_INTERRUPTS 256
+
+// Per vector and CPU; cycles cover the handler, not time switched away
+typedef struct {
+    uint32_t count;
+    uint32_t pad;
+    uint64_t cycles;
+} IrqStat;
+
 void register_interrupt_handler(int n, void (*handler)(struct registers*));
 
 #endif
-
@@ -0,0 +1,44 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <stdint.h>
+
+// Submission and completion rings shared by a task and the kernel. io_setup
+// maps them into the task, which fills sqes and advances sq_tail; io_enter
+// runs the queued requests in order and posts one cqe for each.
+#define IO_RING_MAX_ENTRIES 256
+
+typedef struct {
+    uint32_t op;          // syscall number: file, pipe, splice, sendfile and shm_notify calls
+    uint32_t args[3];     // what the syscall takes in ebx, ecx, edx
+    uint32_t user_data;   // handed back in the completion
+} IoSqe;
+
+typedef struct {
+    uint32_t user_data;
+    int32_t res;          // the syscall's return value
+} IoCqe;
+
+// Header at the start of the mapping, followed by the sqes and then the cqes
+typedef struct {
+    volatile uint32_t sq_head;   // advanced by the kernel
+    volatile uint32_t sq_tail;   // advanced by the task
+    volatile uint32_t cq_head;   // advanced by the task
+    volatile uint32_t cq_tail;   // advanced by the kernel
+    uint32_t entries;            // slots in each ring, a power of two
+} IoRing;
+
+static inline IoSqe* io_ring_sqes(IoRing* r, uint32_t entries) {
+    (void)entries;
+    return (IoSqe*)(r + 1);
+}
+
+static inline IoCqe* io_ring_cqes(IoRing* r, uint32_t entries) {
+    return (IoCqe*)(io_ring_sqes(r, entries) + entries);
+}
+
+static inline uint32_t io_ring_size(uint32_t entries) {
+    return sizeof(IoRing) + entries * (sizeof(IoSqe) + sizeof(IoCqe));
+}
+
+#endif
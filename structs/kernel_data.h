@@ -0,0 +1,31 @@
+#ifndef KERNEL_DATA_H
+#define KERNEL_DATA_H
+
+#include <stdint.h>
+
+// Read-only pages the kernel maps into every user task, so time and task
+// info can be read without a trap. The first is shared by all tasks, the
+// second belongs to the task it's mapped in.
+#define USER_KDATA_ADDR    0xBFE000
+#define USER_TASKDATA_ADDR 0xBFF000
+#define KDATA_VERSION 1
+
+typedef struct {
+    uint32_t version;                     // KDATA_VERSION
+    uint32_t tsc_khz;
+    uint32_t tsc_ns_mult;                 // ns = (tsc - clock_base_tsc) * tsc_ns_mult >> 24, 0 without a TSC
+    uint32_t tick_ns;                     // ns = ticks * tick_ns when there's no TSC
+    uint64_t clock_base_tsc;
+    uint32_t cpu_count;
+    volatile uint32_t ticks;              // boot CPU timer ticks
+    volatile uint32_t nr_tasks;           // as of the last tick
+    volatile uint32_t context_switches;   // on all CPUs
+} KernelData;
+
+typedef struct TaskData {
+    int32_t task_id;
+    volatile uint32_t cpu;                // CPU it last ran on
+    volatile uint32_t switches;           // times it was switched in
+} TaskData;
+
+#endif
@@ -3,44 +3,131 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "structs/registers.h"
+#include "helpers/spinlock.h"
 
-#define STACK_SIZE 4096
-#define PIPE_BUFFER_SIZE 512
+#define STACK_SIZE 8192   // per-task kernel stack
+#define PIPE_BUFFER_SIZE 4096   // initial pipe capacity
+#define PIPE_MAX_SIZE 65536     // a full pipe grows up to this before writers block
 #define MAX_FILENAME_LEN 32
+#define SHM_MAX_SEGMENTS 64     // one bit each in Task.shm_attached
+#define SHM_MAX_SIZE 0x400000
 #define PERM_READ   0x01  // 00000001
 #define PERM_WRITE  0x02  // 00000010
 #define PERM_EXEC   0x04  // 00000100
 
 
+#define MULTIBOOT_INFO_MEMORY   0x00000001
+#define MULTIBOOT_INFO_MODS     0x00000008
+#define MULTIBOOT_INFO_MEM_MAP  0x00000040
+#define MULTIBOOT_INFO_FRAMEBUFFER_INFO 0x00001000
+#define MULTIBOOT_FRAMEBUFFER_TYPE_RGB  1
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
 typedef struct {
     uint32_t flags;
     uint32_t mem_lower;
     uint32_t mem_upper;
-    // other fields omitted for now
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];         // a.out symbol table or ELF section header table
+    uint32_t mmap_length;
+    uint32_t mmap_addr;
+    uint32_t drives_length;
+    uint32_t drives_addr;
+    uint32_t config_table;
+    uint32_t boot_loader_name;
+    uint32_t apm_table;
+    uint32_t vbe_control_info;
+    uint32_t vbe_mode_info;
+    uint16_t vbe_mode;
+    uint16_t vbe_interface_seg;
+    uint16_t vbe_interface_off;
+    uint16_t vbe_interface_len;
+    uint64_t framebuffer_addr;
+    uint32_t framebuffer_pitch;    // bytes per scanline
+    uint32_t framebuffer_width;
+    uint32_t framebuffer_height;
+    uint8_t framebuffer_bpp;
+    uint8_t framebuffer_type;
+    uint8_t framebuffer_red_pos;   // color_info, for the RGB type
+    uint8_t framebuffer_red_size;
+    uint8_t framebuffer_green_pos;
+    uint8_t framebuffer_green_size;
+    uint8_t framebuffer_blue_pos;
+    uint8_t framebuffer_blue_size;
 } __attribute__((packed)) multiboot_info_t;
 
+// `size` does not count itself, the next entry is at (addr of size) + size + 4
+typedef struct {
+    uint32_t size;
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+} __attribute__((packed)) multiboot_mmap_entry_t;
+
+typedef struct {
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint32_t string;
+    uint32_t reserved;
+} __attribute__((packed)) multiboot_module_t;
+
 typedef struct {
     uint16_t magic;
     uint32_t total_blocks;
     uint32_t file_table_start;
     uint32_t file_table_length;
     uint32_t data_start;
+
+    // Allocation summary so mount doesn't have to scan the file table
+    uint32_t summary_magic;  // FS_SUMMARY_MAGIC once the fields below are maintained
+    uint32_t state;          // FS_STATE_CLEAN after a sync, FS_STATE_DIRTY while in use
+    uint32_t free_blocks;    // free data blocks
+    uint32_t high_water;     // first data block above every allocated extent
 } Superblock;
 
+struct Task;
+
+// Tasks sleeping on an event, linked through Task.wait_next
+typedef struct {
+    struct Task* head;
+    struct Task* tail;
+    Spinlock lock;      // guards the list; sleep_on can hand over the caller's own lock
+} WaitQueue;
+
 typedef struct {
     int read_fd;
     int write_fd;
 
-    char buffer[PIPE_BUFFER_SIZE];
-    int start;       // read position
-    int end;         // write position
-    int used;        // number of bytes currently in the buffer
+    uint8_t* buffer;    // ring of `capacity` bytes
+    uint32_t capacity;
+    uint32_t start;     // read position
+    uint32_t end;       // write position
+    uint32_t used;      // number of bytes currently in the buffer
 
     int readable;    // can be read?
-    int writable;    // can be written to?
-    int ref_count;   // number of endpoints still open
+    int writable;    // can be written to? Cleared when the last writer closes
+    int readers_open;   // tasks holding the read end
+    int writers_open;   // tasks holding the write end
+
+    WaitQueue readers;  // waiting for data
+    WaitQueue writers;  // waiting for room
+    Spinlock lock;      // buffer and flags, readers and writers may be on other CPUs
 } Pipe;
 
+// Named shared memory segment (shm.h)
+typedef struct {
+    char name[MAX_FILENAME_LEN];
+    uint32_t size;          // whole pages
+    uint32_t* frames;       // one reference each, dropped when the segment goes
+    int attached;           // tasks that map it
+    uint32_t seq;           // bumped by shm_notify, under waiters.lock
+    WaitQueue waiters;      // in shm_wait
+} ShmSegment;
+
 typedef struct {
     char filename[MAX_FILENAME_LEN];
     uint32_t start_block;
@@ -48,10 +135,42 @@ typedef struct {
     uint8_t active;
     uint8_t permissions;  // New field
 } FileEntry;
+#define TASK_PIPE_ENDS 16   // pipe ends one task can hold open
+#define TASK_RUNNABLE 1
+#define TASK_ZOMBIE   2   // exited, freed once we're off its kernel stack
+#define TASK_BLOCKED  3   // asleep on a wait queue
+
 typedef struct {
-    uint8_t stack[STACK_SIZE];
+    int owner;          // task id, -1 when free
+    int depth;          // the owner may lock again
+    WaitQueue waiters;
+} KMutex;
+
+typedef struct Task {
     void (*entry)(void);
-    int active;
+    uint8_t* stack;     // STACK_SIZE bytes, stays with the object across reuse
+    int state;
+    int id;
+    uint32_t* page_dir; // the task's address space
+    struct registers user_regs;  // user state for the first entry to user mode
+    uint32_t kernel_esp;         // saved by context_switch while switched out
+    uint32_t slice_left;         // timer ticks until preemption
+    uint32_t priority;           // run queue index, 0 runs first
+    int killed;                  // exit at the next safe point
+    struct Task* run_next;       // run queue links
+    struct Task* run_prev;
+    struct Task* wait_next;      // wait queue link
+    WaitQueue* waiting_on;       // set and cleared under wait_lock too, see wake_if_blocked
+    Spinlock wait_lock;          // taken inside a wait queue's lock, never around one
+    int cpu;                     // run queue it's on, or last ran on
+    int on_rq;                   // linked into cpus[cpu]'s run queue
+    volatile int on_cpu;         // running, or its context isn't saved yet
+    uint32_t ring_entries;       // io_setup ring size, 0 if it has none
+    struct TaskData* task_data;  // kernel view of its read-only info page (kdata.h)
+    uint64_t shm_attached;       // bit i: shared memory segment i is mapped
+    uint8_t* fpu_state;          // saved FPU/SSE registers, NULL until it first uses them (fpu.h)
+    int fpu_cpu;                 // CPU whose registers last held that state, -1 for none
+    int pipe_ends[TASK_PIPE_ENDS];  // pipe fds it holds, 0 for a free slot
 } Task;
 
 #endif
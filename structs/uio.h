@@ -0,0 +1,20 @@
+#ifndef UIO_H
+#define UIO_H
+
+#include <stdint.h>
+
+#define IOV_MAX 16   // segments per readv/writev
+
+// One buffer of a vectored read or write
+struct iovec {
+    void* iov_base;
+    uint32_t iov_len;
+};
+
+// sendfile(): where to start in the file, advanced past what was moved, and how much to move
+struct file_range {
+    uint32_t offset;
+    uint32_t len;
+};
+
+#endif
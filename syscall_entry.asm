@@ -2,26 +2,91 @@ extern syscall_handler
 
 [bits 32]
 global syscall_entry
+; int 0x80: same struct registers frame as the exception stubs, so the
+; handler's writes to r->eax come back as the return value
 syscall_entry:
+    push dword 0        ; err_code
+    push dword 0x80     ; int_no
     pusha
-    push ds
-    push es
-    push fs
-    push gs
+    mov ax, ds
+    push eax
 
-    pushad
-    mov eax, esp
-    push eax            ; Pass register state
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov ax, 0x30        ; per-CPU data segment
+    mov gs, ax
 
+    push esp            ; Pass register state
     call syscall_handler
     add esp, 4          ; Clean up parameter
 
-    popad
-
-    pop gs
-    pop fs
-    pop es
-    pop ds
+    pop eax
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov ax, 0x30        ; iret to ring 3 nulls it again
+    mov gs, ax
     popa
+    add esp, 8
     iret
 
+global sysenter_entry
+; sysenter: cs/ss come from MSR_SYSENTER_CS and esp points at this CPU's TSS
+; (percpu.h). User code passes the arguments in ebx, esi, edi, its return esp
+; in ecx and return eip in edx; sysexit takes the last two back from there.
+; Interrupts are off from here to the sti before sysexit.
+sysenter_entry:
+    mov esp, [esp + 4]  ; tss.esp0: the running task's kernel stack
+    cld
+
+    ; Build the same struct registers as int 0x80, with the arguments in the
+    ; ebx/ecx/edx slots, so fork and exec can copy or replace it as usual
+    push dword 0x23     ; ss
+    push ecx            ; useresp
+    push dword 0x202    ; eflags, for a child that leaves through iret
+    push dword 0x1B     ; cs
+    push edx            ; eip
+    push dword 0        ; err_code
+    push dword 0x80     ; int_no
+    push eax
+    push esi            ; ecx slot: 2nd argument
+    push edi            ; edx slot: 3rd argument
+    push ebx
+    push dword 0        ; esp slot, unused
+    push ebp
+    push esi
+    push edi
+    push dword 0x23     ; ds: the user data segments are flat, so they're left loaded
+
+    mov ax, 0x30        ; per-CPU data segment
+    mov gs, ax
+
+    push esp
+    call syscall_handler
+    add esp, 4
+
+    ; sysexit doesn't reload data segments: reset whatever the kernel left
+    ; in them, and don't hand the per-CPU segment to user mode
+    mov ax, 0x23
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    xor eax, eax
+    mov gs, ax
+
+    add esp, 4          ; ds
+    pop edi
+    pop esi
+    pop ebp
+    add esp, 4          ; esp slot
+    pop ebx
+    add esp, 8          ; edx, ecx slots: the caller treats them as clobbered
+    pop eax             ; return value
+    add esp, 8          ; int_no, err_code
+    pop edx             ; eip, possibly replaced by exec
+    add esp, 8          ; cs, eflags
+    pop ecx             ; useresp
+    sti                 ; takes effect after sysexit
+    sysexit
@@ -1,7 +1,15 @@
 #ifndef SYSCALLS_H
 #define SYSCALLS_H
 
-static inline int syscall(int num, int arg1, int arg2, int arg3) {
+#include "structs/io_ring.h"
+#include "structs/uio.h"
+#include "structs/interrupts.h"
+
+#define CPUID_EDX_SEP (1u << 11)
+
+static int syscall_use_sysenter = -1;   // -1 until CPUID has been asked
+
+static inline int syscall_int80(int num, int arg1, int arg2, int arg3) {
     int ret;
     asm volatile (
         "int $0x80"
@@ -15,4 +23,82 @@ static inline int syscall(int num, int arg1, int arg2, int arg3) {
     return ret;
 }
 
+// sysenter saves nothing, so the kernel returns with sysexit to the esp in
+// ecx and the eip in edx. The arguments move to ebx/esi/edi; the kernel puts
+// them back in the ebx/ecx/edx slots of its frame.
+static inline int syscall_sysenter(int num, int arg1, int arg2, int arg3) {
+    int ret;
+    asm volatile (
+        "mov %%esp, %%ecx\n"
+        "mov $1f, %%edx\n"
+        "sysenter\n"
+        "1:\n"
+        : "=a" (ret)
+        : "a" (num), "b" (arg1), "S" (arg2), "D" (arg3)
+        : "ecx", "edx", "memory", "cc"
+    );
+    return ret;
+}
+
+static inline int syscall(int num, int arg1, int arg2, int arg3) {
+    if (syscall_use_sysenter < 0) {
+        unsigned int a, b, c, d;
+        asm volatile ("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(1), "c"(0));
+        syscall_use_sysenter = (d & CPUID_EDX_SEP) != 0;
+    }
+    if (syscall_use_sysenter) return syscall_sysenter(num, arg1, arg2, arg3);
+    return syscall_int80(num, arg1, arg2, arg3);
+}
+
+// Submission/completion rings (structs/io_ring.h), NULL if they can't be set up
+static inline IoRing* io_ring_setup(uint32_t entries) {
+    int addr = syscall(17, entries, 0, 0);   // sys_io_setup
+    return addr < 0 ? 0 : (IoRing*)addr;
+}
+
+// Queue syscall `op` with its arguments. Returns -1 while the ring is full.
+static inline int io_ring_queue(IoRing* r, uint32_t op, int arg1, int arg2, int arg3, uint32_t user_data) {
+    uint32_t tail = r->sq_tail;
+    if (tail - r->sq_head >= r->entries) return -1;
+    IoSqe* sqe = &io_ring_sqes(r, r->entries)[tail & (r->entries - 1)];
+    sqe->op = op;
+    sqe->args[0] = arg1;
+    sqe->args[1] = arg2;
+    sqe->args[2] = arg3;
+    sqe->user_data = user_data;
+    __atomic_store_n(&r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Run up to `to_submit` queued requests in one trap, returns how many were taken
+static inline int io_ring_enter(uint32_t to_submit) {
+    return syscall(18, to_submit, 0, 0);   // sys_io_enter
+}
+
+// Take the oldest completion, -1 if there is none
+static inline int io_ring_complete(IoRing* r, IoCqe* out) {
+    uint32_t head = r->cq_head;
+    if (head == __atomic_load_n(&r->cq_tail, __ATOMIC_ACQUIRE)) return -1;
+    *out = io_ring_cqes(r, r->entries)[head & (r->entries - 1)];
+    __atomic_store_n(&r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Up to range->len bytes of file `src` from range->offset into pipe `dst`;
+// range->offset moves past them
+static inline int sendfile(const char* src, const char* dst, struct file_range* range) {
+    return syscall(28, (int)src, (int)dst, (int)range);
+}
+
+// Close a pipe end, given as its decimal fd like the other calls take it.
+// Readers see EOF once every task holding the write end closed it or exited.
+static inline int close(const char* pipe_fd) {
+    return syscall(29, (int)pipe_fd, 0, 0);
+}
+
+// Interrupt count and handler cycles for one vector, summed over all CPUs
+static inline int irq_stats(uint32_t vector, IrqStat* out) {
+    return syscall(27, vector, (int)out, 0);
+}
+
 #endif
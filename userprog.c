@@ -1,12 +1,18 @@
 #include "syscalls.h"
 
-extern char buffer[12];
+static char buffer[12];   // lives in the task's own address space
 
 void load_user_program() {
     const char* msg  = "Hello, kernel!\n";
     const char* name = "hello";
+
+    // The child shares our pages until one of us writes to them
+    if (syscall(12, 0, 0, 0) == 0) { // sys_fork
+        syscall(2, (int)"child", (int)"forked\n", sizeof("forked\n") - 1);
+        syscall(1,0,0,0);
+    }
+
     syscall(2, (int)name, (int)msg, sizeof("Hello, kernel!\n") - 1);
     syscall(3, (int)name, (int)buffer, sizeof(buffer) - 1);
     syscall(1,0,0,0); // sys_exit
 }
-